@@ -0,0 +1,1447 @@
+// File: Benchmark.cpp
+//
+// Throughput measurements for the formula classes and the V4 engine. Build it
+// next to Main.cpp, e.g.
+//   g++ -std=c++17 -O2 -pthread Benchmark.cpp -o benchmark
+// and run "benchmark [section] [rows]". The suite and precision sections
+// print one JSON object per line, so runs can be compared across commits and
+// compilers. The allocations section counts heap allocations in the V4 solve
+// paths through a replaced global operator new and exits with status 1 if
+// any path allocates once warmed up. The arena section runs a stream of
+// batch jobs with their columns on the heap and then in a FormulaV4Arena,
+// and reports time per job, heap allocations and minor page faults. The
+// service section runs FormulaV4Server on a Unix socket and measures round
+// trips from concurrent FormulaV4Client threads, and the transport section
+// compares it with the shared-memory ring of FormulaV4Ring.h. The checks
+// section replays inputs that once broke the V4 tools and exits with status
+// 1 if any of them still does.
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <sys/resource.h>
+#include "FormulaV1.h"
+#include "FormulaV2.h"
+#include "FormulaV3.h"
+#include "FormulaV4a.h"
+#include "FormulaV4b.h"
+#include "FormulaV4Arena.h"
+#include "FormulaV4Cache.h"
+#include "FormulaV4Client.h"
+#include "FormulaV4Csv.h"
+#include "FormulaV4DoubleDouble.h"
+#include "FormulaV4File.h"
+#include "FormulaV4Parallel.h"
+#include "FormulaV4Problem.h"
+#include "FormulaV4Ring.h"
+#include "FormulaV4Server.h"
+#include "FormulaV4Solver.h"
+#include "FormulaV4Sweep.h"
+
+// every heap allocation of the process, for the allocations section
+static std::atomic<uint64_t> bench_allocations(0);
+
+void *operator new(std::size_t bytes)
+{
+	bench_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = std::malloc(bytes ? bytes : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new(std::size_t bytes, std::align_val_t align)
+{
+	bench_allocations.fetch_add(1, std::memory_order_relaxed);
+	const std::size_t alignment = static_cast<std::size_t>(align);
+#if defined(_MSC_VER)
+	void *p = _aligned_malloc(bytes ? bytes : 1, alignment);
+#else
+	void *p = std::aligned_alloc(alignment, (bytes + alignment - 1) / alignment * alignment);
+#endif
+	if (!p)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+// GCC cannot see that the replaced operator new above returns malloc'd memory
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+#if defined(_MSC_VER)
+	_aligned_free(p);
+#else
+	std::free(p);
+#endif
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t align) noexcept
+{
+	operator delete(p, align);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// owns the storage behind a FormulaV4aColumns batch
+struct BenchColumns
+{
+	explicit BenchColumns(size_t rows)
+		: distance(rows), time(rows), initial_velocity(rows), final_velocity(rows), acceleration(rows), presence(rows),
+		status(rows)
+	{
+	}
+
+	FormulaV4aColumns view()
+	{
+		FormulaV4aColumns columns = { distance.data(), time.data(), initial_velocity.data(), final_velocity.data(),
+			acceleration.data(), presence.data(), status.data(), presence.size() };
+		return columns;
+	}
+
+	std::vector<double> distance, time, initial_velocity, final_velocity, acceleration;
+	std::vector<unsigned char> presence;
+	std::vector<FormulaV4Status> status;
+};
+
+// consistent problems (vi, a, t > 0) with the ten unknown pairs interleaved row by row,
+// or grouped into ten runs of rows that share a pair
+static BenchColumns make_problems(size_t rows, bool grouped = false)
+{
+	static const unsigned pairs[] = { 3, 5, 9, 17, 6, 10, 18, 12, 20, 24 };
+	std::mt19937_64 random(42);
+	std::uniform_real_distribution<double> value(0.5, 20.0);
+
+	BenchColumns c(rows);
+	for (size_t i = 0; i < rows; ++i)
+	{
+		c.initial_velocity[i] = value(random);
+		c.acceleration[i] = value(random);
+		c.time[i] = value(random);
+		c.final_velocity[i] = c.initial_velocity[i] + c.acceleration[i] * c.time[i];
+		c.distance[i] = c.initial_velocity[i] * c.time[i] + 0.5 * c.acceleration[i] * c.time[i] * c.time[i];
+		c.presence[i] = static_cast<unsigned char>(~pairs[grouped ? i * 10 / rows : i % 10] & ALL_PRESENT);
+	}
+	return c;
+}
+
+// stops the optimizer from discarding work whose result is otherwise unused
+template <class T>
+static void keep(T &value)
+{
+#if defined(__GNUC__)
+	asm volatile("" : : "g"(&value) : "memory");
+#else
+	static volatile const void *sink;
+	sink = &value;
+#endif
+}
+
+template <class F>
+static double seconds(F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// rows/s of FormulaV4Parallel for 1, 2, 4, ... threads up to the core count
+static void thread_scaling(size_t rows)
+{
+	const BenchColumns problems = make_problems(rows);
+	const unsigned cores = FormulaV4ThreadPool::default_threads();
+
+	std::cout << "threads  rows/s        speedup" << std::endl;
+	double single = 0;
+	for (unsigned threads = 1; ; threads = std::min(threads * 2, cores))
+	{
+		FormulaV4ThreadPool pool(threads);
+		BenchColumns work = problems;
+		FormulaV4aColumns columns = work.view();
+		FormulaV4Parallel::calculate(columns, pool);	// warm up
+
+		double best = 1e300;
+		for (int run = 0; run < 5; ++run)
+		{
+			work.presence = problems.presence;
+			best = std::min(best, seconds([&] { FormulaV4Parallel::calculate(columns, pool); }));
+		}
+		const double rate = rows / best;
+		if (threads == 1)
+		{
+			single = rate;
+		}
+		std::cout << std::setw(7) << threads << "  " << std::setw(12) << std::fixed << std::setprecision(0) << rate
+			<< "  " << std::setprecision(2) << rate / single << std::endl;
+
+		if (threads == cores)
+		{
+			break;
+		}
+	}
+}
+
+// FormulaV4a's dispatch before the bitmask table: an unordered_map of std::function keyed
+// on the pair of unknowns, with the XOR hash that sent (distance, final_velocity) and
+// (time, initial_velocity) to the same bucket
+struct LegacyPairHash
+{
+	size_t operator()(const std::pair<ValueId, ValueId> &p) const
+	{
+		return std::hash<int>()(static_cast<int>(p.first)) ^ std::hash<int>()(static_cast<int>(p.second));
+	}
+};
+
+typedef std::unordered_map<std::pair<ValueId, ValueId>, std::function<void (double&)>, LegacyPairHash> LegacyFormulas;
+typedef std::array<void (*)(double&), 1 << VARIABLES> TableFormulas;
+
+// stand-in for a formula, so both lookups pay the same call
+static void count_solve(double &x)
+{
+	x += 1;
+}
+
+static void legacy_pairs(std::function<void (ValueId, ValueId)> add)
+{
+	for (int first = 0; first < VARIABLES; ++first)
+	{
+		for (int second = first + 1; second < VARIABLES; ++second)
+		{
+			add(static_cast<ValueId>(first), static_cast<ValueId>(second));
+		}
+	}
+}
+
+static LegacyFormulas legacy_formulas()
+{
+	LegacyFormulas formulas;
+	legacy_pairs([&](ValueId first, ValueId second)
+	{
+		formulas[std::make_pair(first, second)] = [](double &x) { count_solve(x); };
+	});
+	return formulas;
+}
+
+// construction and pair lookup cost of the old map against the shared table
+static void dispatch_cost(size_t rows)
+{
+	std::vector<std::pair<ValueId, ValueId>> pairs;
+	legacy_pairs([&](ValueId first, ValueId second) { pairs.push_back(std::make_pair(first, second)); });
+	std::vector<std::pair<ValueId, ValueId>> lookups(rows);
+	std::mt19937 random(7);
+	for (auto &lookup : lookups)
+	{
+		lookup = pairs[random() % pairs.size()];
+	}
+
+	const size_t objects = std::max<size_t>(rows / 64, 1);
+	const double legacy_construct = seconds([&]
+	{
+		for (size_t i = 0; i < objects; ++i)
+		{
+			LegacyFormulas formulas = legacy_formulas();
+			keep(formulas);
+		}
+	});
+	const double table_construct = seconds([&]
+	{
+		for (size_t i = 0; i < objects; ++i)
+		{
+			FormulaV4a formula;
+			keep(formula);
+		}
+	});
+
+	const LegacyFormulas legacy = legacy_formulas();
+	TableFormulas table = {};
+	legacy_pairs([&](ValueId first, ValueId second)
+	{
+		table[(1u << static_cast<int>(first)) | (1u << static_cast<int>(second))] = &count_solve;
+	});
+
+	double legacy_sum = 0, table_sum = 0;
+	const double legacy_lookup = seconds([&]
+	{
+		for (const auto &lookup : lookups)
+		{
+			legacy.find(lookup)->second(legacy_sum);
+		}
+	});
+	const double table_lookup = seconds([&]
+	{
+		for (const auto &lookup : lookups)
+		{
+			table[(1u << static_cast<int>(lookup.first)) | (1u << static_cast<int>(lookup.second))](table_sum);
+		}
+	});
+	keep(legacy_sum);
+	keep(table_sum);
+
+	std::cout << std::fixed << std::setprecision(2)
+		<< "construct  unordered_map  " << std::setw(9) << legacy_construct / objects * 1e9 << " ns" << std::endl
+		<< "construct  shared table   " << std::setw(9) << table_construct / objects * 1e9 << " ns" << std::endl
+		<< "lookup     unordered_map  " << std::setw(9) << legacy_lookup / rows * 1e9 << " ns" << std::endl
+		<< "lookup     shared table   " << std::setw(9) << table_lookup / rows * 1e9 << " ns" << std::endl;
+}
+
+// the five formula classes behind one interface: field N is ValueId N, or letter a + N
+struct BenchV1
+{
+	typedef FormulaV1 Formula;
+	static const char *name() { return "V1"; }
+	static void set(Formula &f, int field, double value)
+	{
+		switch (field)
+		{
+		case 0: f.setA(value); break;
+		case 1: f.setB(value); break;
+		case 2: f.setC(value); break;
+		case 3: f.setD(value); break;
+		default: f.setE(value); break;
+		}
+	}
+};
+
+struct BenchV2
+{
+	typedef FormulaV2 Formula;
+	static const char *name() { return "V2"; }
+	static void set(Formula &f, int field, double value)
+	{
+		switch (field)
+		{
+		case 0: f.setA(value); break;
+		case 1: f.setB(value); break;
+		case 2: f.setC(value); break;
+		case 3: f.setD(value); break;
+		default: f.setE(value); break;
+		}
+	}
+};
+
+struct BenchV3
+{
+	typedef FormulaV3 Formula;
+	static const char *name() { return "V3"; }
+	static void set(Formula &f, int field, double value)
+	{
+		f.set(static_cast<FormulaV3::tag>(field), value);
+	}
+};
+
+struct BenchV4a
+{
+	typedef FormulaV4a Formula;
+	static const char *name() { return "V4a"; }
+	static void set(Formula &f, int field, double value)
+	{
+		f.set(static_cast<ValueId>(field), value);
+	}
+};
+
+struct BenchV4b
+{
+	typedef FormulaV4b Formula;
+	static const char *name() { return "V4b"; }
+	static void set(Formula &f, int field, double value)
+	{
+		f.set(static_cast<FormulaV4b::tag>(field), value);
+	}
+};
+
+static const unsigned BENCH_PAIRS[] = { 3, 5, 9, 17, 6, 10, 18, 12, 20, 24 };
+
+static const char *pair_name(unsigned key)
+{
+	static const char *names[] = { "distance", "time", "initial_velocity", "final_velocity", "acceleration" };
+	static char buffer[64];
+	buffer[0] = '\0';
+	for (int field = 0; field < VARIABLES; ++field)
+	{
+		if (key & (1u << field))
+		{
+			std::strcat(buffer[0] ? std::strcat(buffer, "+") : buffer, names[field]);
+		}
+	}
+	return buffer;
+}
+
+// what one solve costs a caller: construct, set the known fields, calculate
+template <class B>
+static bool solve_one(const BenchColumns &p, size_t i)
+{
+	const double *values[VARIABLES] = { p.distance.data(), p.time.data(), p.initial_velocity.data(),
+		p.final_velocity.data(), p.acceleration.data() };
+	typename B::Formula f;
+	keep(f);		// the compiler may not see the constructor's work through calculate's member pointer
+	for (int field = 0; field < VARIABLES; ++field)
+	{
+		if (p.presence[i] & (1u << field))
+		{
+			B::set(f, field, values[field][i]);
+		}
+	}
+	try
+	{
+		f.calculate();
+	}
+	catch (...)
+	{
+		return false;
+	}
+	keep(f);
+	return true;
+}
+
+// per-solve latency percentiles, timing groups of 16 solves to stay well above the clock resolution
+template <class B>
+static void latency(const BenchColumns &p, size_t rows, std::vector<double> &samples)
+{
+	const size_t group = 16;
+	samples.clear();
+	for (size_t i = 0; i + group <= rows; i += group)
+	{
+		samples.push_back(seconds([&]
+		{
+			for (size_t j = i; j < i + group; ++j)
+			{
+				solve_one<B>(p, j);
+			}
+		}) / group * 1e9);
+	}
+	std::sort(samples.begin(), samples.end());
+	std::cout << "{\"bench\":\"latency\",\"formula\":\"" << B::name() << "\",\"p50_ns\":"
+		<< samples[samples.size() / 2] << ",\"p99_ns\":" << samples[samples.size() * 99 / 100] << "}" << std::endl;
+}
+
+template <class B>
+static void formula_suite(size_t rows)
+{
+	const size_t objects = std::max<size_t>(rows / 4, 1);
+	const double construct = seconds([&]
+	{
+		for (size_t i = 0; i < objects; ++i)
+		{
+			typename B::Formula f;
+			keep(f);
+		}
+	});
+	std::cout << "{\"bench\":\"construct\",\"formula\":\"" << B::name() << "\",\"ns\":" << construct / objects * 1e9
+		<< "}" << std::endl;
+
+	const BenchColumns mixed = make_problems(rows);
+	std::vector<double> samples;
+	for (size_t i = 0; i < std::min<size_t>(rows, 4096); ++i)
+	{
+		solve_one<B>(mixed, i);		// warm up
+	}
+	latency<B>(mixed, rows, samples);
+
+	for (unsigned key : BENCH_PAIRS)
+	{
+		BenchColumns pair = mixed;
+		std::fill(pair.presence.begin(), pair.presence.end(), static_cast<unsigned char>(~key & ALL_PRESENT));
+		size_t solved = 0;
+		const double time = seconds([&]
+		{
+			for (size_t i = 0; i < rows; ++i)
+			{
+				solved += solve_one<B>(pair, i);
+			}
+		});
+		std::cout << "{\"bench\":\"throughput\",\"formula\":\"" << B::name() << "\",\"pair\":\"" << pair_name(key)
+			<< "\",\"solves_per_s\":" << rows / time << ",\"solved\":" << solved << "}" << std::endl;
+	}
+
+	// three blanks, so every calculate throws
+	BenchColumns bad = mixed;
+	std::fill(bad.presence.begin(), bad.presence.end(), static_cast<unsigned char>(0x03));
+	const size_t throws = std::max<size_t>(rows / 16, 1);
+	const double thrown = seconds([&]
+	{
+		for (size_t i = 0; i < throws; ++i)
+		{
+			solve_one<B>(bad, i);
+		}
+	});
+	std::cout << "{\"bench\":\"error\",\"formula\":\"" << B::name() << "\",\"path\":\"throw\",\"ns\":"
+		<< thrown / throws * 1e9 << "}" << std::endl;
+}
+
+// the noexcept solve() of V4a and V4b on the same failing problem
+template <class B>
+static void status_error(size_t rows)
+{
+	unsigned failures = 0;
+	const double time = seconds([&]
+	{
+		for (size_t i = 0; i < rows; ++i)
+		{
+			typename B::Formula f;
+			B::set(f, 0, 1.0 + i);
+			B::set(f, 1, 2.0);
+			failures += f.solve() != FormulaV4Status::ok;
+			keep(f);
+		}
+	});
+	std::cout << "{\"bench\":\"error\",\"formula\":\"" << B::name() << "\",\"path\":\"status\",\"ns\":"
+		<< time / rows * 1e9 << ",\"failures\":" << failures << "}" << std::endl;
+}
+
+template <class F>
+static void batch_rate(const char *path, const BenchColumns &problems, F solve)
+{
+	BenchColumns work = problems;
+	FormulaV4aColumns columns = work.view();
+	solve(columns);		// warm up
+	double best = 1e300;
+	for (int run = 0; run < 5; ++run)
+	{
+		work.presence = problems.presence;
+		best = std::min(best, seconds([&] { solve(columns); }));
+	}
+	std::cout << "{\"bench\":\"batch\",\"path\":\"" << path << "\",\"rows_per_s\":" << problems.presence.size() / best
+		<< "}" << std::endl;
+}
+
+static const char *isa_name(FormulaV4Simd::Isa isa)
+{
+	return isa == FormulaV4Simd::Isa::avx512 ? "avx512" : isa == FormulaV4Simd::Isa::avx2 ? "avx2" : "scalar";
+}
+
+// every formula class and batch path, as JSON lines
+static void suite(size_t rows)
+{
+#if defined(__clang__)
+	const std::string compiler = "clang " __clang_version__;
+#elif defined(__GNUC__)
+	const std::string compiler = "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+	const std::string compiler = "msvc " + std::to_string(_MSC_FULL_VER);
+#else
+	const std::string compiler = "unknown";
+#endif
+	std::cout << std::setprecision(6) << std::defaultfloat << "{\"bench\":\"meta\",\"compiler\":\"" << compiler
+		<< "\",\"cplusplus\":" << __cplusplus << ",\"isa\":\"" << isa_name(FormulaV4Simd::detect())
+		<< "\",\"threads\":" << FormulaV4ThreadPool::default_threads() << ",\"rows\":" << rows << ",\"metrics\":"
+		<< (FormulaV4Metrics::enabled ? "true" : "false") << "}" << std::endl;
+
+	formula_suite<BenchV1>(rows);
+	formula_suite<BenchV2>(rows);
+	formula_suite<BenchV3>(rows);
+	formula_suite<BenchV4a>(rows);
+	formula_suite<BenchV4b>(rows);
+	status_error<BenchV4a>(rows);
+	status_error<BenchV4b>(rows);
+
+	// interleaved pairs are the worst case for the vector paths, grouped pairs the best; mixed
+	// repeats every ten rows, which branch predictors learn, and shuffled does not
+	FormulaV4ThreadPool pool;
+	for (const char *order_name : { "mixed", "shuffled", "grouped" })
+	{
+		const bool grouped = std::strcmp(order_name, "grouped") == 0;
+		BenchColumns problems = make_problems(rows, grouped);
+		if (std::strcmp(order_name, "shuffled") == 0)
+		{
+			// every row is consistent for any pair, so shuffling the masks alone is enough
+			std::shuffle(problems.presence.begin(), problems.presence.end(), std::mt19937_64(7));
+		}
+		const std::string order = std::string("-") + order_name;
+		batch_rate(("V4a-columns" + order).c_str(), problems, [](FormulaV4aColumns &c) { FormulaV4a::solve(c); });
+		for (FormulaV4Simd::Isa isa : { FormulaV4Simd::Isa::scalar, FormulaV4Simd::Isa::avx2, FormulaV4Simd::Isa::avx512 })
+		{
+			if (isa <= FormulaV4Simd::detect())
+			{
+				batch_rate(("simd-" + std::string(isa_name(isa)) + order).c_str(), problems,
+					[isa](FormulaV4aColumns &c) { FormulaV4Simd::solve(c, 0, c.rows, isa); });
+				batch_rate(("partitioned-" + std::string(isa_name(isa)) + order).c_str(), problems,
+					[isa](FormulaV4aColumns &c) { FormulaV4Simd::solve_partitioned(c, 0, c.rows, isa); });
+			}
+		}
+		batch_rate(("parallel" + order).c_str(), problems, [&pool](FormulaV4aColumns &c) { FormulaV4Parallel::solve(c, pool); });
+	}
+
+	// the mixed problems as 48-byte records, through the stateless solver
+	const BenchColumns mixed = make_problems(rows);
+	std::vector<FormulaV4Problem> records(rows);
+	for (size_t i = 0; i < rows; ++i)
+	{
+		records[i] = { { mixed.distance[i], mixed.time[i], mixed.initial_velocity[i], mixed.final_velocity[i],
+			mixed.acceleration[i] }, mixed.presence[i], FormulaV4Status::ok };
+	}
+	const FormulaV4ProblemSolver solver;
+	double best = 1e300;
+	for (int run = 0; run < 5; ++run)
+	{
+		std::vector<FormulaV4Problem> work = records;
+		best = std::min(best, seconds([&] { solver.solve(work.data(), work.size()); }));
+	}
+	std::cout << "{\"bench\":\"batch\",\"path\":\"problems-mixed\",\"rows_per_s\":" << rows / best << "}" << std::endl;
+
+	// one pair throughout: runtime dispatch against the compile-time solver
+	BenchColumns fixed = make_problems(rows);
+	std::fill(fixed.presence.begin(), fixed.presence.end(), static_cast<unsigned char>(~3u & ALL_PRESENT));
+	batch_rate("V4a-columns-distance+time", fixed, [](FormulaV4aColumns &c) { FormulaV4a::solve(c); });
+	batch_rate("solver-distance+time", fixed, [](FormulaV4aColumns &c)
+	{
+		FormulaV4Solver<ValueId::distance, ValueId::time>::solve(c);
+	});
+}
+
+// reference arithmetic for the accuracy report: quad precision where the compiler has it
+#if defined(__SIZEOF_FLOAT128__)
+typedef __float128 BenchWide;
+static const char *const BENCH_REFERENCE = "float128";
+#else
+typedef long double BenchWide;
+static const char *const BENCH_REFERENCE = "long double";
+#endif
+
+struct BenchQuad
+{
+	BenchWide v;
+
+	BenchQuad(): v(0)
+	{
+	}
+
+	BenchQuad(double x): v(x)
+	{
+	}
+
+	static BenchQuad of(BenchWide x)
+	{
+		BenchQuad q;
+		q.v = x;
+		return q;
+	}
+};
+
+static BenchQuad operator+(BenchQuad a, BenchQuad b) { return BenchQuad::of(a.v + b.v); }
+static BenchQuad operator-(BenchQuad a, BenchQuad b) { return BenchQuad::of(a.v - b.v); }
+static BenchQuad operator*(BenchQuad a, BenchQuad b) { return BenchQuad::of(a.v * b.v); }
+static BenchQuad operator/(BenchQuad a, BenchQuad b) { return BenchQuad::of(a.v / b.v); }
+static bool operator==(BenchQuad a, BenchQuad b) { return a.v == b.v; }
+static bool operator<(BenchQuad a, BenchQuad b) { return a.v < b.v; }
+
+// Newton's method from the double root; each step doubles the correct bits
+static BenchQuad sqrt(BenchQuad a)
+{
+	if (!(a.v > 0))
+	{
+		return BenchQuad(std::sqrt(static_cast<double>(a.v)));
+	}
+	BenchWide x = std::sqrt(static_cast<double>(a.v));
+	for (int step = 0; step < 3; ++step)
+	{
+		x = (x + a.v / x) / 2;
+	}
+	return BenchQuad::of(x);
+}
+
+static double to_double(float x) { return x; }
+static double to_double(double x) { return x; }
+static BenchWide to_wide(const FormulaV4DoubleDouble &x) { return static_cast<BenchWide>(x.hi) + x.lo; }
+template <class T>
+static BenchWide to_wide(const T &x) { return static_cast<BenchWide>(to_double(x)); }
+static BenchWide to_wide(const BenchQuad &x) { return x.v; }
+
+// a copy of a double batch in scalar type T
+template <class T>
+struct BenchColumnsT
+{
+	explicit BenchColumnsT(const BenchColumns &from): presence(from.presence), status(from.status)
+	{
+		const std::vector<double> *source[VARIABLES] = { &from.distance, &from.time, &from.initial_velocity,
+			&from.final_velocity, &from.acceleration };
+		for (int id = 0; id < VARIABLES; ++id)
+		{
+			values[id].assign(source[id]->begin(), source[id]->end());
+		}
+	}
+
+	FormulaV4aColumnsT<T> view()
+	{
+		FormulaV4aColumnsT<T> columns = { values[0].data(), values[1].data(), values[2].data(), values[3].data(),
+			values[4].data(), presence.data(), status.data(), presence.size() };
+		return columns;
+	}
+
+	std::vector<T> values[VARIABLES];
+	std::vector<unsigned char> presence;
+	std::vector<FormulaV4Status> status;
+};
+
+// the relative error of each pair's unknowns in work against the reference; float also carries
+// the rounding of its inputs to float. path names the formula class when it is not FormulaV4aT.
+template <class T>
+static void accuracy(const char *path, const char *type, const BenchColumns &problems, const BenchColumnsT<T> &work,
+	const BenchColumnsT<BenchQuad> &reference)
+{
+	for (unsigned key : BENCH_PAIRS)
+	{
+		double max_error = 0, sum_error = 0;
+		size_t compared = 0, mismatches = 0;
+		for (size_t i = 0; i < problems.presence.size(); ++i)
+		{
+			if ((~problems.presence[i] & ALL_PRESENT) != key)
+			{
+				continue;
+			}
+			if (work.status[i] != reference.status[i])
+			{
+				++mismatches;
+				continue;
+			}
+			for (int id = 0; id < VARIABLES && work.status[i] == FormulaV4Status::ok; ++id)
+			{
+				if (key & (1u << id))
+				{
+					const BenchWide exact = to_wide(reference.values[id][i]);
+					const BenchWide difference = to_wide(work.values[id][i]) - exact;
+					const double error = exact != 0 ? std::fabs(static_cast<double>(difference / exact))
+						: std::fabs(static_cast<double>(difference));
+					max_error = std::max(max_error, error);
+					sum_error += error;
+					++compared;
+				}
+			}
+		}
+		std::cout << "{\"bench\":\"accuracy\",";
+		if (path)
+		{
+			std::cout << "\"path\":\"" << path << "\",";
+		}
+		std::cout << "\"type\":\"" << type << "\",\"reference\":\"" << BENCH_REFERENCE
+			<< "\",\"pair\":\"" << pair_name(key) << "\",\"max_rel\":" << max_error << ",\"mean_rel\":"
+			<< (compared ? sum_error / compared : 0) << ",\"status_mismatches\":" << mismatches << "}" << std::endl;
+	}
+}
+
+// rows/s of FormulaV4aT<T>::solve, then its accuracy
+template <class T>
+static void precision(const char *type, const BenchColumns &problems, const BenchColumnsT<BenchQuad> &reference)
+{
+	BenchColumnsT<T> work(problems);
+	FormulaV4aColumnsT<T> columns = work.view();
+	double best = 1e300;
+	for (int run = 0; run < 5; ++run)
+	{
+		work.presence = problems.presence;
+		best = std::min(best, seconds([&] { FormulaV4aT<T>::solve(columns); }));
+	}
+	std::cout << "{\"bench\":\"precision\",\"type\":\"" << type << "\",\"bytes\":" << sizeof(T) << ",\"rows_per_s\":"
+		<< problems.presence.size() / best << "}" << std::endl;
+	accuracy<T>(nullptr, type, problems, work, reference);
+}
+
+// the same for one FormulaV4bT<T> solving the rows in turn through set(), solve() and get()
+template <class T>
+static void precision_v4b(const char *type, const BenchColumns &problems, const BenchColumnsT<BenchQuad> &reference)
+{
+	typedef typename FormulaV4bT<T>::tag Tag;
+	BenchColumnsT<T> work(problems);
+	FormulaV4bT<T> formula;
+	auto solve = [&]
+	{
+		for (size_t i = 0; i < problems.presence.size(); ++i)
+		{
+			formula.reset();
+			for (int id = 0; id < VARIABLES; ++id)
+			{
+				if (problems.presence[i] & (1u << id))
+				{
+					formula.set(static_cast<Tag>(id), work.values[id][i]);
+				}
+			}
+			work.status[i] = formula.solve();
+			for (int id = 0; id < VARIABLES && work.status[i] == FormulaV4Status::ok; ++id)
+			{
+				work.values[id][i] = formula.get(static_cast<Tag>(id));
+			}
+		}
+	};
+	double best = 1e300;
+	for (int run = 0; run < 5; ++run)
+	{
+		best = std::min(best, seconds(solve));
+	}
+	std::cout << "{\"bench\":\"precision\",\"path\":\"V4b\",\"type\":\"" << type << "\",\"bytes\":" << sizeof(T)
+		<< ",\"rows_per_s\":" << problems.presence.size() / best << "}" << std::endl;
+	accuracy<T>("V4b", type, problems, work, reference);
+}
+
+// rows/s of FormulaV4SimdT<T>::solve over rows grouped by unknowns, so the vector kernels of
+// float and double run full width
+template <class T>
+static void simd_precision(const char *type, const BenchColumns &problems)
+{
+	BenchColumnsT<T> work(problems);
+	FormulaV4aColumnsT<T> columns = work.view();
+	double best = 1e300;
+	for (int run = 0; run < 5; ++run)
+	{
+		work.presence = problems.presence;
+		best = std::min(best, seconds([&] { FormulaV4SimdT<T>::solve(columns); }));
+	}
+	std::cout << "{\"bench\":\"precision\",\"path\":\"simd-" << isa_name(FormulaV4Simd::isa()) << "\",\"type\":\"" << type
+		<< "\",\"bytes\":" << sizeof(T) << ",\"rows_per_s\":" << problems.presence.size() / best << "}" << std::endl;
+}
+
+// the engine and FormulaV4bT in float, double and double-double against the wide reference
+static void precision_suite(size_t rows)
+{
+	const BenchColumns problems = make_problems(rows);
+	BenchColumnsT<BenchQuad> reference(problems);
+	FormulaV4aColumnsT<BenchQuad> columns = reference.view();
+	FormulaV4aT<BenchQuad>::solve(columns);
+
+	std::cout << std::setprecision(6) << std::defaultfloat;
+	precision<float>("float", problems, reference);
+	precision<double>("double", problems, reference);
+	precision<FormulaV4DoubleDouble>("double-double", problems, reference);
+	precision_v4b<float>("float", problems, reference);
+	precision_v4b<double>("double", problems, reference);
+	precision_v4b<FormulaV4DoubleDouble>("double-double", problems, reference);
+	const BenchColumns grouped = make_problems(rows, true);
+	simd_precision<float>("float", grouped);
+	simd_precision<double>("double", grouped);
+}
+
+// allocations made by the second of two runs of solve; the first run takes the one-time
+// allocations (thread-local metric shards, static tables). Returns 1 if there were any.
+template <class F>
+static int allocation_free(const char *path, size_t rows, F solve)
+{
+	solve();
+	const uint64_t before = bench_allocations.load();
+	solve();
+	const uint64_t count = bench_allocations.load() - before;
+	std::cout << "{\"bench\":\"allocations\",\"path\":\"" << path << "\",\"solves\":" << rows << ",\"allocations\":"
+		<< count << "}" << std::endl;
+	return count != 0;
+}
+
+// the steady-state V4 solve paths must not touch the heap; returns the number that do
+static int allocation_suite(size_t rows)
+{
+	const BenchColumns problems = make_problems(rows);
+	BenchColumns work = problems;
+	FormulaV4aColumns columns = work.view();
+	std::vector<FormulaV4Problem> records(rows);
+	for (size_t i = 0; i < rows; ++i)
+	{
+		records[i] = { { problems.distance[i], problems.time[i], problems.initial_velocity[i],
+			problems.final_velocity[i], problems.acceleration[i] }, problems.presence[i], FormulaV4Status::ok };
+	}
+	const FormulaV4ProblemSolver solver;
+	FormulaV4ThreadPool pool;
+	FormulaV4Cache cache(1 << 16);
+	auto reset = [&] { std::copy(problems.presence.begin(), problems.presence.end(), work.presence.begin()); };
+
+	int failures = 0;
+	failures += allocation_free("V4a-solve", rows, [&]
+	{
+		for (size_t i = 0; i < rows; ++i)
+		{
+			solve_one<BenchV4a>(problems, i);
+		}
+	});
+	failures += allocation_free("V4b-solve", rows, [&]
+	{
+		for (size_t i = 0; i < rows; ++i)
+		{
+			solve_one<BenchV4b>(problems, i);
+		}
+	});
+	failures += allocation_free("problems", rows, [&]
+	{
+		for (size_t i = 0; i < rows; ++i)
+		{
+			records[i].presence = problems.presence[i];
+		}
+		solver.solve(records.data(), records.size());
+	});
+	failures += allocation_free("V4a-columns", rows, [&] { reset(); FormulaV4a::solve(columns); });
+	failures += allocation_free("simd", rows, [&] { reset(); FormulaV4Simd::solve(columns); });
+	failures += allocation_free("partitioned", rows, [&] { reset(); FormulaV4Simd::solve_partitioned(columns); });
+	failures += allocation_free("parallel", rows, [&] { reset(); FormulaV4Parallel::solve(columns, pool); });
+	failures += allocation_free("cache", rows, [&] { reset(); cache.solve(columns); });
+	return failures;
+}
+
+// minor page faults of the process so far
+static long minor_faults()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+// jobs of job_rows rows, each in a fresh FormulaV4Batch that is filled, solved and dropped;
+// batch(job) makes the batch and done() runs after it is gone
+template <class Make, class Done>
+static void arena_jobs(const char *path, const BenchColumns &problems, size_t job_rows, size_t jobs, Make batch,
+	Done done)
+{
+	const std::vector<double> *from[VARIABLES] = { &problems.distance, &problems.time, &problems.initial_velocity,
+		&problems.final_velocity, &problems.acceleration };
+	const uint64_t allocations = bench_allocations.load();
+	const long faults = minor_faults();
+	const double elapsed = seconds([&]
+	{
+		for (size_t job = 0; job < jobs; ++job)
+		{
+			{
+				FormulaV4Batch b = batch();
+				const size_t first = job * job_rows % (problems.presence.size() - job_rows + 1);
+				for (int id = 0; id < VARIABLES; ++id)
+				{
+					std::copy_n(from[id]->data() + first, job_rows, b.values[id].data());
+				}
+				std::copy_n(problems.presence.data() + first, job_rows, b.presence.data());
+				b.rows = job_rows;
+				FormulaV4aColumns columns = b.view();
+				FormulaV4Simd::solve_partitioned(columns);
+				keep(b.status[0]);
+			}
+			done();
+		}
+	});
+	std::cout << "{\"bench\":\"arena\",\"path\":\"" << path << "\",\"job_rows\":" << job_rows << ",\"jobs\":" << jobs
+		<< ",\"us_per_job\":" << elapsed / jobs * 1e6 << ",\"allocations\":" << bench_allocations.load() - allocations
+		<< ",\"minor_faults\":" << minor_faults() - faults << "}" << std::endl;
+}
+
+// per-job batch columns from the heap against one arena reset after every job
+static void arena_suite(size_t rows)
+{
+	const BenchColumns problems = make_problems(rows);
+	std::cout << std::setprecision(4) << std::fixed;
+	for (size_t job_rows : { size_t(1) << 10, size_t(1) << 16 })
+	{
+		job_rows = std::min(job_rows, rows);
+		const size_t jobs = std::max<size_t>(rows / job_rows, 64);
+		arena_jobs("heap", problems, job_rows, jobs, [&] { return FormulaV4Batch(job_rows); }, [] {});
+		FormulaV4Arena arena;
+		arena_jobs("arena", problems, job_rows, jobs, [&] { return FormulaV4Batch(job_rows, &arena); },
+			[&] { arena.reset(); });
+		FormulaV4Arena huge(FormulaV4Arena::BLOCK_BYTES, FormulaV4Arena::Pages::huge);
+		arena_jobs("arena-huge", problems, job_rows, jobs, [&] { return FormulaV4Batch(job_rows, &huge); },
+			[&] { huge.reset(); });
+	}
+}
+
+// problems as records, for the service and transport sections
+static std::vector<FormulaV4Problem> make_records(size_t rows)
+{
+	const BenchColumns problems = make_problems(rows);
+	std::vector<FormulaV4Problem> records(rows);
+	for (size_t i = 0; i < rows; ++i)
+	{
+		records[i] = { { problems.distance[i], problems.time[i], problems.initial_velocity[i],
+			problems.final_velocity[i], problems.acceleration[i] }, problems.presence[i], FormulaV4Status::ok };
+	}
+	return records;
+}
+
+// clients threads each sending requests of request_rows rows one after another to a server with budget_us
+static void service_round_trips(const std::string &address, uint32_t budget_us, unsigned clients, size_t request_rows,
+	size_t requests, const std::vector<FormulaV4Problem> &records)
+{
+	FormulaV4Server::Options options;
+	options.budget_us = budget_us;
+	FormulaV4Server server(address, options);
+	std::thread loop([&] { server.run(); });
+
+	std::vector<std::vector<double>> samples(clients);
+	std::vector<uint64_t> solve_ns(clients), wait_ns(clients), failures(clients);
+	std::vector<std::thread> threads;
+	const double elapsed = seconds([&]
+	{
+		for (unsigned c = 0; c < clients; ++c)
+		{
+			threads.emplace_back([&, c]
+			{
+				FormulaV4Client client(address);
+				std::vector<FormulaV4Problem> work(request_rows);
+				for (size_t q = 0; q < requests; ++q)
+				{
+					const size_t first = (q * clients + c) * request_rows % (records.size() - request_rows + 1);
+					std::copy_n(records.data() + first, request_rows, work.data());
+					FormulaV4Client::Timing timing;
+					samples[c].push_back(seconds([&] { timing = client.solve(work.data(), work.size()); }) * 1e6);
+					solve_ns[c] += timing.solve_ns;
+					wait_ns[c] += timing.wait_ns;
+					failures[c] += work[0].status != FormulaV4Status::ok;
+				}
+			});
+		}
+		for (auto &thread : threads)
+		{
+			thread.join();
+		}
+	});
+	server.stop();
+	loop.join();
+
+	std::vector<double> all;
+	uint64_t solve_total = 0, wait_total = 0, failed = 0;
+	for (unsigned c = 0; c < clients; ++c)
+	{
+		all.insert(all.end(), samples[c].begin(), samples[c].end());
+		solve_total += solve_ns[c];
+		wait_total += wait_ns[c];
+		failed += failures[c];
+	}
+	std::sort(all.begin(), all.end());
+	const FormulaV4Server::Stats stats = server.stats();
+	std::cout << "{\"bench\":\"service\",\"budget_us\":" << budget_us << ",\"clients\":" << clients
+		<< ",\"request_rows\":" << request_rows << ",\"rows_per_s\":" << stats.rows / elapsed << ",\"p50_us\":"
+		<< all[all.size() / 2] << ",\"p99_us\":" << all[all.size() * 99 / 100] << ",\"mean_wait_us\":"
+		<< wait_total / 1e3 / all.size() << ",\"mean_solve_us\":" << solve_total / 1e3 / all.size()
+		<< ",\"rows_per_batch\":" << static_cast<double>(stats.rows) / stats.batches << ",\"failed\":" << failed << "}"
+		<< std::endl;
+}
+
+static void service_suite(size_t rows)
+{
+	const std::vector<FormulaV4Problem> records = make_records(std::max<size_t>(rows, 1 << 12));
+	const std::string address = "unix:/tmp/formulav4-bench-" + std::to_string(::getpid()) + ".sock";
+	std::cout << std::setprecision(2) << std::fixed;
+	for (uint32_t budget_us : { 0u, 50u })
+	{
+		for (unsigned clients : { 1u, 4u })
+		{
+			for (size_t request_rows : { size_t(1), size_t(64) })
+			{
+				service_round_trips(address, budget_us, clients, request_rows, 2000, records);
+			}
+		}
+	}
+	::unlink(address.c_str() + 5);
+}
+
+// round trips of one problem, then rows problems in flight through solve(problems, count)
+template <class One, class Many>
+static void transport(const char *path, const std::vector<FormulaV4Problem> &records, One one, Many many)
+{
+	std::vector<FormulaV4Problem> work(records.size());
+	std::vector<double> samples;
+	for (size_t i = 0; i < 5000; ++i)
+	{
+		FormulaV4Problem problem = records[i % records.size()];
+		samples.push_back(seconds([&] { one(problem); }) * 1e6);
+	}
+	std::sort(samples.begin(), samples.end());
+	std::copy(records.begin(), records.end(), work.begin());
+	const double elapsed = seconds([&] { many(work.data(), work.size()); });
+	size_t failed = 0;
+	for (const FormulaV4Problem &problem : work)
+	{
+		failed += problem.status != FormulaV4Status::ok;
+	}
+	std::cout << "{\"bench\":\"transport\",\"path\":\"" << path << "\",\"p50_us\":" << samples[samples.size() / 2]
+		<< ",\"p99_us\":" << samples[samples.size() * 99 / 100] << ",\"rows\":" << work.size() << ",\"rows_per_s\":"
+		<< work.size() / elapsed << ",\"failed\":" << failed << "}" << std::endl;
+}
+
+// the shared-memory ring against the Unix socket service, with the solver on its own thread
+static void transport_suite(size_t rows)
+{
+	const std::vector<FormulaV4Problem> records = make_records(rows);
+	std::cout << std::setprecision(2) << std::fixed;
+	{
+		const std::string address = "unix:/tmp/formulav4-bench-" + std::to_string(::getpid()) + ".sock";
+		FormulaV4Server::Options options;
+		options.budget_us = 0;
+		FormulaV4Server server(address, options);
+		std::thread loop([&] { server.run(); });
+		{
+			FormulaV4Client client(address);
+			transport("socket", records, [&](FormulaV4Problem &p) { client.solve(p); },
+				[&](FormulaV4Problem *p, size_t n)
+				{
+					for (size_t i = 0; i < n; i += FormulaV4RingProducer::WINDOW)
+					{
+						client.solve(p + i, std::min(n - i, size_t(FormulaV4RingProducer::WINDOW)));
+					}
+				});
+		}
+		server.stop();
+		loop.join();
+		::unlink(address.c_str() + 5);
+	}
+	{
+		const std::string name = "/formulav4-bench-" + std::to_string(::getpid());
+		FormulaV4Ring ring(name, FormulaV4Ring::SLOTS);
+		std::atomic<bool> stop(false);
+		std::thread solver([&] { ring.serve(stop); });
+		{
+			FormulaV4RingProducer producer(name);
+			transport("ring", records, [&](FormulaV4Problem &p) { producer.solve(p); },
+				[&](FormulaV4Problem *p, size_t n) { producer.solve(p, n); });
+		}
+		stop.store(true);
+		solver.join();
+	}
+}
+
+// one line per check; returns 1 if it failed
+static int check(const char *name, bool passed)
+{
+	std::cout << "{\"bench\":\"checks\",\"check\":\"" << name << "\",\"passed\":" << (passed ? "true" : "false") << "}"
+		<< std::endl;
+	return passed ? 0 : 1;
+}
+
+// a client that sends two requests and closes before reading either reply, to a server that solves
+// every request on its own; the connection goes away while the second request is being queued
+static bool service_disconnect()
+{
+	const std::string address = "unix:/tmp/formulav4-check-" + std::to_string(::getpid()) + ".sock";
+	FormulaV4Server::Options options;
+	options.batch_rows = 1;
+	options.budget_us = 0;
+	FormulaV4Server server(address, options);
+	const std::vector<FormulaV4Problem> records = make_records(2);
+	{
+		// connected and closed before the loop starts, so the server reads both requests and the end together
+		const int fd = FormulaV4Wire::connect(address);
+		for (uint32_t id = 0; id < 2; ++id)
+		{
+			FormulaV4WireHeader header = { FormulaV4WireHeader::REQUEST, id, 1, 0, 0, 0 };
+			FormulaV4Wire::send_all(fd, &header, sizeof(header), MSG_MORE);
+			FormulaV4Wire::send_all(fd, &records[id], sizeof(FormulaV4Problem));
+		}
+		::close(fd);
+	}
+	std::thread loop([&] { server.run(); });
+	FormulaV4Problem problem = records[0];
+	{
+		FormulaV4Client client(address);
+		client.solve(problem);
+	}
+	server.stop();
+	loop.join();
+	::unlink(address.c_str() + 5);
+	const FormulaV4Server::Stats stats = server.stats();
+	return problem.status == FormulaV4Status::ok && stats.connections == 2 && stats.requests == 3;
+}
+
+// a client that writes requests without reading a reply until the server stops reading it; the
+// server must have taken on no more than about OUTPUT_LIMIT of replies, and all of them must still
+// come back once the client reads
+static bool service_backpressure()
+{
+	const std::string address = "unix:/tmp/formulav4-check-" + std::to_string(::getpid()) + ".sock";
+	FormulaV4Server::Options options;
+	options.budget_us = 0;
+	FormulaV4Server server(address, options);
+	std::thread loop([&] { server.run(); });
+	const uint32_t rows = 64;
+	std::vector<char> frame(sizeof(FormulaV4WireHeader) + rows * sizeof(FormulaV4Problem));
+	const FormulaV4WireHeader header = { FormulaV4WireHeader::REQUEST, 0, rows, 0, 0, 0 };
+	std::memcpy(frame.data(), &header, sizeof(header));
+	const int fd = FormulaV4Wire::connect(address);
+	size_t sent = 0;
+	for (int idle = 0; idle < 200; )
+	{
+		const size_t at = sent % frame.size();
+		const ssize_t n = ::send(fd, frame.data() + at, frame.size() - at, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n > 0)
+		{
+			sent += size_t(n);
+			idle = 0;
+		}
+		else
+		{
+			// written again as soon as the server reads, so it is never short of input
+			pollfd writable = { fd, POLLOUT, 0 };
+			idle += ::poll(&writable, 1, 1) == 0;
+		}
+	}
+	const uint64_t taken = server.stats().requests;
+	const size_t at = sent % frame.size();
+	if (at != 0)
+	{
+		FormulaV4Wire::send_all(fd, frame.data() + at, frame.size() - at);
+	}
+	const size_t requests = (sent + frame.size() - 1) / frame.size();
+	::shutdown(fd, SHUT_WR);
+	size_t replies = 0;
+	bool solved = true;
+	std::vector<FormulaV4Problem> reply(rows);
+	for (; replies < requests; ++replies)
+	{
+		FormulaV4WireHeader got;
+		FormulaV4Wire::receive_all(fd, &got, sizeof(got));
+		FormulaV4Wire::receive_all(fd, reply.data(), rows * sizeof(FormulaV4Problem));
+		solved = solved && got.magic == FormulaV4WireHeader::REPLY && got.rows == rows;
+	}
+	::close(fd);
+	server.stop();
+	loop.join();
+	::unlink(address.c_str() + 5);
+	return solved && taken * frame.size() <= 2 * FormulaV4Server::OUTPUT_LIMIT;
+}
+
+// CSV with a line that does not parse, through a column file and a solve of it, back to CSV, as
+// main --to-binary, --binary -o and --to-csv do; the line must come back as invalid_row
+static bool binary_round_trip()
+{
+	const std::string path = "/tmp/formulav4-check-" + std::to_string(::getpid()) + ".fv4";
+	const std::string solved = path + ".solved";
+	char input[] = "1,2,,,0.5\nnot,a,row\n,,,,\n";
+	FormulaV4Batch batch(FormulaV4FileWriter::GROUP_ROWS);
+	{
+		FILE *in = ::fmemopen(input, std::strlen(input), "r");
+		FormulaV4CsvReader reader(in, ',');
+		FormulaV4FileWriter writer(path.c_str());
+		while (reader.read(batch) != 0)
+		{
+			std::fill(batch.status.begin(), batch.status.begin() + batch.rows, FormulaV4Status::ok);
+			reader.mark_invalid(batch);
+			writer.write(batch.view());
+		}
+		writer.finish();
+		std::fclose(in);
+	}
+	FormulaV4File::copy(path.c_str(), solved.c_str());
+	{
+		FormulaV4ThreadPool pool(2);
+		FormulaV4File file(solved.c_str(), FormulaV4File::Mode::update);
+		for (size_t g = 0; g < file.groups(); ++g)
+		{
+			file.solve_group(g, [&](FormulaV4aColumns &columns) { FormulaV4Parallel::solve(columns, pool); });
+		}
+		file.sync();
+	}
+	char *text = nullptr;
+	size_t length = 0;
+	{
+		FILE *out = ::open_memstream(&text, &length);
+		{
+			FormulaV4File file(solved.c_str(), FormulaV4File::Mode::read);
+			FormulaV4CsvWriter writer(out, ',');
+			for (size_t g = 0; g < file.groups(); ++g)
+			{
+				writer.write(file.group(g));
+			}
+			writer.flush();
+		}
+		std::fclose(out);
+	}
+	const std::string csv(text, length);
+	std::free(text);
+	::unlink(path.c_str());
+	::unlink(solved.c_str());
+	return csv.find(",,,,,invalid_row\n") != std::string::npos && csv.find(",,,,,too_many_blanks\n") != std::string::npos &&
+		csv.find(",ok\n") != std::string::npos;
+}
+
+// column files whose header fields would make the size check wrap around; opening them must fail
+static bool corrupt_headers()
+{
+	const std::string path = "/tmp/formulav4-check-" + std::to_string(::getpid()) + ".fv4";
+	{
+		BenchColumns problems = make_problems(100);
+		FormulaV4FileWriter writer(path.c_str());
+		writer.write(problems.view());
+		writer.finish();
+	}
+	const uint64_t corrupt[][2] = {
+		{ UINT64_MAX, FormulaV4FileWriter::GROUP_ROWS },			// rows + group_rows - 1 wraps to a few groups
+		{ 1, uint64_t(1) << 61 },									// layout() of group_rows wraps
+		{ 1, FormulaV4FileHeader::MAX_GROUP_ROWS + 1 }
+	};
+	bool rejected = true;
+	for (const auto &fields : corrupt)
+	{
+		FormulaV4FileHeader header;
+		const int fd = ::open(path.c_str(), O_RDWR);
+		bool written = ::pread(fd, &header, sizeof(header), 0) == sizeof(header);
+		header.rows = fields[0];
+		header.group_rows = fields[1];
+		written = written && ::pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+		::close(fd);
+		try
+		{
+			FormulaV4File file(path.c_str(), FormulaV4File::Mode::read);
+			rejected = false;
+		}
+		catch (const FormulaV4FileException &)
+		{
+		}
+		rejected = rejected && written;
+	}
+	::unlink(path.c_str());
+	return rejected;
+}
+
+// a ring whose slot count no longer fits its masking or its segment; the last one is a power of two
+// whose size in bytes wraps to zero
+static bool corrupt_ring()
+{
+	const std::string name = "/formulav4-check-" + std::to_string(::getpid());
+	FormulaV4Ring ring(name, 16);
+	const int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+	void *mapped = ::mmap(nullptr, sizeof(FormulaV4RingHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		return false;
+	}
+	FormulaV4RingHeader &header = *static_cast<FormulaV4RingHeader*>(mapped);
+	const uint64_t corrupt[] = { 0, 12, 1 << 20, uint64_t(1) << 58 };
+	bool rejected = true;
+	for (uint64_t slots : corrupt)
+	{
+		header.slots = slots;
+		try
+		{
+			FormulaV4Ring opened(name);
+			rejected = false;
+		}
+		catch (const FormulaV4WireException &)
+		{
+		}
+	}
+	header.slots = 16;
+	try
+	{
+		FormulaV4Ring opened(name);
+	}
+	catch (const FormulaV4WireException &)
+	{
+		rejected = false;
+	}
+	::munmap(mapped, sizeof(FormulaV4RingHeader));
+	return rejected;
+}
+
+// sweep ranges that used to run for ever or give no points: non-finite values, a zero step
+// between different values, a step away from last, and more points than a size_t holds
+static bool sweep_ranges()
+{
+	const double nan = std::nan(""), inf = HUGE_VAL;
+	const FormulaV4SweepRange invalid[] = { { 1, 3, nan }, { nan, 3, 1 }, { 1, inf, 1 }, { 1, 3, 0 }, { 1, 10, -1 },
+		{ 10, 1, 1 }, { 0, 1e30, 1e-30 } };
+	bool rejected = true;
+	for (const FormulaV4SweepRange &range : invalid)
+	{
+		try
+		{
+			FormulaV4Sweep sweep;
+			sweep.vary(ValueId::time, range);
+			rejected = false;
+		}
+		catch (const FormulaV4aException &)
+		{
+		}
+	}
+	const FormulaV4SweepRange down = { 10, 1, -1 };
+	FormulaV4Sweep huge;
+	huge.vary(ValueId::time, { 0, 1e18, 1 });
+	huge.vary(ValueId::acceleration, { 0, 1e18, 1 });
+	huge.fix(ValueId::initial_velocity, 0);
+	bool overflow = false;
+	try
+	{
+		huge.size();
+	}
+	catch (const FormulaV4aException &)
+	{
+		overflow = true;
+	}
+	return rejected && down.valid() && down.count() == 10 && down.at(9) == 1 && overflow;
+}
+
+// inputs that once broke the V4 tools; returns the number that still do
+static int check_suite()
+{
+	int failures = 0;
+	failures += check("service-disconnect", service_disconnect());
+	failures += check("service-backpressure", service_backpressure());
+	failures += check("binary-round-trip", binary_round_trip());
+	failures += check("corrupt-headers", corrupt_headers());
+	failures += check("corrupt-ring", corrupt_ring());
+	failures += check("sweep-ranges", sweep_ranges());
+	return failures;
+}
+
+// usage: benchmark [scaling|dispatch|suite|precision|allocations|arena|service|transport|checks] [rows]
+int main(int argc, char **argv)
+{
+	const char *only = argc > 1 && !std::isdigit(static_cast<unsigned char>(argv[1][0])) ? argv[1] : nullptr;
+	const int rows_arg = only ? 2 : 1;
+	const size_t rows = argc > rows_arg ? std::strtoull(argv[rows_arg], nullptr, 10) : 1 << 24;
+
+	if (!only || std::strcmp(only, "scaling") == 0)
+	{
+		thread_scaling(rows);
+	}
+	if (!only || std::strcmp(only, "dispatch") == 0)
+	{
+		dispatch_cost(rows);
+	}
+	if (!only || std::strcmp(only, "suite") == 0)
+	{
+		suite(std::min<size_t>(rows, 1 << 20));
+	}
+	if (!only || std::strcmp(only, "precision") == 0)
+	{
+		precision_suite(std::min<size_t>(rows, 1 << 20));
+	}
+	if (!only || std::strcmp(only, "arena") == 0)
+	{
+		arena_suite(std::min<size_t>(rows, 1 << 22));
+	}
+	if (!only || std::strcmp(only, "service") == 0)
+	{
+		service_suite(std::min<size_t>(rows, 1 << 16));
+	}
+	if (!only || std::strcmp(only, "transport") == 0)
+	{
+		transport_suite(std::min<size_t>(rows, 1 << 18));
+	}
+	int failures = 0;
+	if (!only || std::strcmp(only, "checks") == 0)
+	{
+		failures += check_suite();
+	}
+	if (!only || std::strcmp(only, "allocations") == 0)
+	{
+		failures += allocation_suite(std::min<size_t>(rows, 1 << 20));
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -5,9 +5,6 @@
 #include <string>
 #include <sstream>
 #include <array>
-#include <unordered_map>
-#include <map>
-#include <functional>
 
 class FormulaV2Exception :public std::exception
 {
@@ -32,7 +29,7 @@ private:
 class FormulaV2 
 {
 public:
-	FormulaV2() : _a_hasval(false), _b_hasval(false), _c_hasval(false), _d_hasval(false), _e_hasval(false),_formulas(create_function_map(this))
+	FormulaV2() : _a_hasval(false), _b_hasval(false), _c_hasval(false), _d_hasval(false), _e_hasval(false)
 	{
 	}
 
@@ -44,11 +41,8 @@ public:
 	void calculate() 
 	{
 		// Find the right equation given the missing values (getUnknownsKey)
-		auto const function_it(_formulas.find(getUnknownsKey()));
-		if (function_it == _formulas.end())
-			throw FormulaV2Exception("Unrecognized combination of unknowns");
-		// Compute the missing values
-		function_it->second();
+		// and compute them; unsupported keys land on compute_invalid
+		(this->*formula(getUnknownsKey()))();
 	}
 
 
@@ -152,9 +146,9 @@ private:
 		return !hasA() + (!hasB() << 1) + (!hasC() << 2) + (!hasD() << 3) + (!hasE() << 4); 
 	}
 
-	typedef std::map<unsigned int, std::function<void()>> FormulasV2;
+	typedef void (FormulaV2::*Compute)();
+	typedef std::array<Compute, 32> FormulasV2;
 
-	FormulasV2 _formulas;
 	double	_a, _b, _c, _d, _e;
 	bool	_a_hasval, _b_hasval, _c_hasval, _d_hasval, _e_hasval;
 
@@ -219,22 +213,35 @@ private:
 		setD(24.1);
 		setE(24.2);
 	}
+
+	void compute_invalid()
+	{
+		throw FormulaV2Exception("Unrecognized combination of unknowns");
+	}
 #pragma endregion
 
-	static FormulasV2 create_function_map(FormulaV2* p)
-	{
-		FormulasV2 formulas;
-		formulas[3] = std::bind(&FormulaV2::compute_ab, p);
-		formulas[5] = std::bind(&FormulaV2::compute_ac, p);
-		formulas[9] = std::bind(&FormulaV2::compute_ad, p);
-		formulas[17] = std::bind(&FormulaV2::compute_ae, p);
-		formulas[6] = std::bind(&FormulaV2::compute_bc, p);
-		formulas[10] = std::bind(&FormulaV2::compute_bd, p);
-		formulas[18] = std::bind(&FormulaV2::compute_be, p);
-		formulas[12] = std::bind(&FormulaV2::compute_cd, p);
-		formulas[20] = std::bind(&FormulaV2::compute_ce, p);
-		formulas[24] = std::bind(&FormulaV2::compute_de, p);
+	// one table for all instances, indexed by getUnknownsKey()
+	static constexpr FormulasV2 create_function_map()
+	{
+		FormulasV2 formulas = {};
+		for (auto &formula : formulas)
+			formula = &FormulaV2::compute_invalid;
+		formulas[3] = &FormulaV2::compute_ab;
+		formulas[5] = &FormulaV2::compute_ac;
+		formulas[9] = &FormulaV2::compute_ad;
+		formulas[17] = &FormulaV2::compute_ae;
+		formulas[6] = &FormulaV2::compute_bc;
+		formulas[10] = &FormulaV2::compute_bd;
+		formulas[18] = &FormulaV2::compute_be;
+		formulas[12] = &FormulaV2::compute_cd;
+		formulas[20] = &FormulaV2::compute_ce;
+		formulas[24] = &FormulaV2::compute_de;
 		return formulas;
 	}
-};
 
+	static Compute formula(unsigned key)
+	{
+		static constexpr FormulasV2 formulas = create_function_map();
+		return formulas[key];
+	}
+};
@@ -1,9 +1,8 @@
+#pragma once
 #include <array>
 #include <bitset>
-#include <functional>
 #include <stdexcept>
 #include <string>
-#include <map>
 
 struct FormulaV3Exception : std::runtime_error
 {
@@ -20,18 +19,14 @@ public:
 	enum struct tag : unsigned { a, b, c, d, e, count };
 
 	FormulaV3()
-		: _functions(create_function_map(this))
 	{
 	}
 
 	void calculate()
 	{
 		// Find the right equation given the missing values (getUnknownsKey)
-		auto const function_it(_functions.find(getUnknownsKey()));
-		if (function_it == _functions.end())
-			throw  FormulaV3Exception("Unrecognized combination of unknowns");
-		// Compute the missing values
-		function_it->second();
+		// and compute them; unsupported keys land on compute_invalid
+		(this->*function(getUnknownsKey()))();
 	}
 
 	void set(tag const t, double const v)
@@ -59,31 +54,41 @@ private:
 
 	typedef std::array<double, static_cast<unsigned>(tag::count)> value_sequence;
 	typedef std::bitset<static_cast<unsigned>(tag::count)>        presence_sequence;
-	typedef std::map<unsigned, std::function<void()>>   function_map;
+	typedef void (FormulaV3::*compute_function)();
+	typedef std::array<compute_function, 1 << static_cast<unsigned>(tag::count)> function_map;
 
-	static unsigned as_underlying(tag const t) { return static_cast<unsigned>(t); }
-	static unsigned as_bit       (tag const t) { return 1 << as_underlying(t);    }
+	static constexpr unsigned as_underlying(tag const t) { return static_cast<unsigned>(t); }
+	static constexpr unsigned as_bit       (tag const t) { return 1 << as_underlying(t);    }
 
-	static function_map create_function_map(FormulaV3* p)
+	// one table for all instances, indexed by getUnknownsKey()
+	static constexpr function_map create_function_map()
 	{
-		function_map f;
-		f[as_bit(tag::a) | as_bit(tag::b)] = std::bind(&FormulaV3::compute_ab, p);
-		f[as_bit(tag::a) | as_bit(tag::c)] = std::bind(&FormulaV3::compute_ac, p);
-		f[as_bit(tag::a) | as_bit(tag::d)] = std::bind(&FormulaV3::compute_ad, p);
-		f[as_bit(tag::a) | as_bit(tag::e)] = std::bind(&FormulaV3::compute_ae, p);
+		function_map f = {};
+		for (auto &e : f)
+			e = &FormulaV3::compute_invalid;
+		f[as_bit(tag::a) | as_bit(tag::b)] = &FormulaV3::compute_ab;
+		f[as_bit(tag::a) | as_bit(tag::c)] = &FormulaV3::compute_ac;
+		f[as_bit(tag::a) | as_bit(tag::d)] = &FormulaV3::compute_ad;
+		f[as_bit(tag::a) | as_bit(tag::e)] = &FormulaV3::compute_ae;
 
-		f[as_bit(tag::b) | as_bit(tag::c)] = std::bind(&FormulaV3::compute_bc, p);
-		f[as_bit(tag::b) | as_bit(tag::d)] = std::bind(&FormulaV3::compute_bd, p);
-		f[as_bit(tag::b) | as_bit(tag::e)] = std::bind(&FormulaV3::compute_be, p);
+		f[as_bit(tag::b) | as_bit(tag::c)] = &FormulaV3::compute_bc;
+		f[as_bit(tag::b) | as_bit(tag::d)] = &FormulaV3::compute_bd;
+		f[as_bit(tag::b) | as_bit(tag::e)] = &FormulaV3::compute_be;
 
-		f[as_bit(tag::c) | as_bit(tag::d)] = std::bind(&FormulaV3::compute_cd, p);
-		f[as_bit(tag::c) | as_bit(tag::e)] = std::bind(&FormulaV3::compute_ce, p);
+		f[as_bit(tag::c) | as_bit(tag::d)] = &FormulaV3::compute_cd;
+		f[as_bit(tag::c) | as_bit(tag::e)] = &FormulaV3::compute_ce;
 
-		f[as_bit(tag::d) | as_bit(tag::e)] = std::bind(&FormulaV3::compute_de, p);
+		f[as_bit(tag::d) | as_bit(tag::e)] = &FormulaV3::compute_de;
 
 		return f;
 	}
 
+	static compute_function function(unsigned const key)
+	{
+		static constexpr function_map functions = create_function_map();
+		return functions[key];
+	}
+
 	void compute_ab() { set(tag::a,  1.1); set(tag::b,  1.2); }
 	void compute_ac() { set(tag::a,  2.1); set(tag::c,  2.2); }
 	void compute_ad() { set(tag::a,  3.1); set(tag::d,  3.2); }
@@ -94,8 +99,8 @@ private:
 	void compute_cd() { set(tag::c,  8.1); set(tag::d,  8.2); }
 	void compute_ce() { set(tag::c,  9.1); set(tag::e,  9.2); }
 	void compute_de() { set(tag::d, 10.1); set(tag::e, 10.2); }
-	
+	void compute_invalid() { throw FormulaV3Exception("Unrecognized combination of unknowns"); }
+
 	value_sequence    _values;
 	presence_sequence _presence;
-	function_map      _functions;
 };
@@ -0,0 +1,323 @@
+// FormulaV4Cache.h
+//
+// Bounded memo of solved problems, for inputs that repeat. The key is the
+// mask of unknowns plus the three known values, compared bit for bit or,
+// with a tolerance, after rounding each to a multiple of it (so nearby
+// inputs share the first result computed for any of them). A hit copies
+// the two stored unknowns and status back without running a formula.
+//
+// The cache is set-associative: a key hashes to one set of WAYS entries
+// and the least recently used entry of a full set is evicted, so memory is
+// fixed at construction and nothing is allocated afterwards.
+// FormulaV4Cache is for one thread; FormulaV4ConcurrentCache locks stripes
+// of sets and can be shared by the threads of a FormulaV4ThreadPool.
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include "FormulaV4a.h"
+
+struct FormulaV4CacheStats
+{
+	uint64_t hits;
+	uint64_t misses;
+};
+
+template <class Lock, unsigned Stripes>
+class FormulaV4BasicCache
+{
+public:
+	static const unsigned WAYS = 8;
+
+	// room for at least capacity results; tolerance 0 keys on the exact bits
+	explicit FormulaV4BasicCache(size_t capacity, double tolerance = 0)
+		: sets_(1), tolerance_(tolerance)
+	{
+		while (sets_ * WAYS < capacity)
+		{
+			sets_ *= 2;
+		}
+		entries_.reset(new Entry[sets_ * WAYS]);
+		clocks_.reset(new uint32_t[sets_]());
+	}
+
+	FormulaV4BasicCache(const FormulaV4BasicCache&) = delete;
+	FormulaV4BasicCache& operator=(const FormulaV4BasicCache&) = delete;
+
+	// FormulaV4a::solve() through the cache
+	FormulaV4Status solve(FormulaV4a &formula)
+	{
+		double values[VARIABLES];
+		unsigned presence = 0;
+		for (int id = 0; id < VARIABLES; ++id)
+		{
+			values[id] = formula.get(static_cast<ValueId>(id));
+			presence |= formula.is_blank(static_cast<ValueId>(id)) ? 0 : 1u << id;
+		}
+		Key key;
+		if (!make_key(values, presence, key))
+		{
+			return formula.solve();
+		}
+
+		Result result;
+		if (!find(key, result))
+		{
+			result.status = formula.solve();
+			store_unknowns(key, result, [&](int id) { return formula.get(static_cast<ValueId>(id)); });
+			insert(key, result);
+		}
+		else if (result.status == FormulaV4Status::ok)
+		{
+			load_unknowns(key, result, [&](int id, double value) { formula.set(static_cast<ValueId>(id), value); });
+		}
+		return result.status;
+	}
+
+	// FormulaV4a::solve(columns) through the cache, row by row
+	void solve(FormulaV4aColumns &columns)
+	{
+		solve(columns, 0, columns.rows);
+	}
+
+	void solve(FormulaV4aColumns &columns, size_t first, size_t last)
+	{
+		double *column[VARIABLES] = { columns.distance, columns.time, columns.initial_velocity, columns.final_velocity,
+			columns.acceleration };
+		for (size_t i = first; i < last; ++i)
+		{
+			double values[VARIABLES];
+			for (int id = 0; id < VARIABLES; ++id)
+			{
+				values[id] = column[id][i];
+			}
+			Key key;
+			Result result;
+			if (!make_key(values, columns.presence[i], key) || !find(key, result))
+			{
+				FormulaV4aColumns row = { columns.distance + i, columns.time + i, columns.initial_velocity + i,
+					columns.final_velocity + i, columns.acceleration + i, columns.presence + i, columns.status + i, 1 };
+				FormulaV4a::solve(row);
+				if (key.unknowns != 0)
+				{
+					result.status = columns.status[i];
+					store_unknowns(key, result, [&](int id) { return column[id][i]; });
+					insert(key, result);
+				}
+				continue;
+			}
+			columns.status[i] = result.status;
+			if (result.status == FormulaV4Status::ok)
+			{
+				load_unknowns(key, result, [&](int id, double value) { column[id][i] = value; });
+				columns.presence[i] = ALL_PRESENT;
+			}
+		}
+	}
+
+	FormulaV4CacheStats stats()
+	{
+		FormulaV4CacheStats total = { 0, 0 };
+		for (auto &stripe : stripes_)
+		{
+			std::lock_guard<Lock> lock(stripe.lock);
+			total.hits += stripe.hits;
+			total.misses += stripe.misses;
+		}
+		return total;
+	}
+
+	void clear()
+	{
+		for (auto &stripe : stripes_)
+		{
+			std::lock_guard<Lock> lock(stripe.lock);
+			stripe.hits = stripe.misses = 0;
+		}
+		for (size_t i = 0; i < sets_ * WAYS; ++i)
+		{
+			entries_[i] = Entry();
+		}
+		std::fill(clocks_.get(), clocks_.get() + sets_, 0u);
+	}
+
+	size_t capacity() const
+	{
+		return sets_ * WAYS;
+	}
+
+private:
+	// the unknowns mask and the known values in ValueId order, as bits or multiples of the tolerance
+	struct Key
+	{
+		uint64_t known[3];
+		unsigned unknowns;		// 0 in an empty entry
+
+		bool operator==(const Key &other) const
+		{
+			return unknowns == other.unknowns && known[0] == other.known[0] && known[1] == other.known[1] &&
+				known[2] == other.known[2];
+		}
+	};
+
+	struct Result
+	{
+		double unknown[2];		// in ValueId order
+		FormulaV4Status status;
+	};
+
+	struct Entry
+	{
+		Key key = {};
+		Result result = {};
+		uint32_t used = 0;		// set clock at the last hit or insert
+	};
+
+	struct alignas(64) Stripe
+	{
+		Lock lock;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+	};
+
+	// only rows with exactly two blanks are cached; the rest fail fast anyway
+	bool make_key(const double *values, unsigned presence, Key &key) const
+	{
+		key.unknowns = 0;
+		const unsigned unknowns = ~presence & ALL_PRESENT;
+		if (unknowns_status(unknowns) != FormulaV4Status::unsupported_pair)
+		{
+			return false;
+		}
+		int k = 0;
+		for (int id = 0; id < VARIABLES; ++id)
+		{
+			if (!(unknowns & (1u << id)))
+			{
+				key.known[k++] = quantize(values[id]);
+			}
+		}
+		key.unknowns = unknowns;
+		return true;
+	}
+
+	uint64_t quantize(double value) const
+	{
+		if (tolerance_ > 0)
+		{
+			const double steps = std::floor(value / tolerance_ + 0.5);
+			if (std::fabs(steps) < 9e18)
+			{
+				return static_cast<uint64_t>(static_cast<int64_t>(steps));
+			}
+		}
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	template <class Get>
+	static void store_unknowns(const Key &key, Result &result, Get get)
+	{
+		int k = 0;
+		for (int id = 0; id < VARIABLES; ++id)
+		{
+			if (key.unknowns & (1u << id))
+			{
+				result.unknown[k++] = get(id);
+			}
+		}
+	}
+
+	template <class Set>
+	static void load_unknowns(const Key &key, const Result &result, Set set)
+	{
+		int k = 0;
+		for (int id = 0; id < VARIABLES; ++id)
+		{
+			if (key.unknowns & (1u << id))
+			{
+				set(id, result.unknown[k++]);
+			}
+		}
+	}
+
+	size_t set_of(const Key &key) const
+	{
+		uint64_t h = key.unknowns;
+		for (uint64_t word : key.known)
+		{
+			h = (h ^ word) * 0x9E3779B97F4A7C15ull;
+			h ^= h >> 29;
+		}
+		return static_cast<size_t>(h) & (sets_ - 1);
+	}
+
+	bool find(const Key &key, Result &result)
+	{
+		const size_t set = set_of(key);
+		Stripe &stripe = stripes_[set % Stripes];
+		std::lock_guard<Lock> lock(stripe.lock);
+		Entry *ways = &entries_[set * WAYS];
+		for (unsigned way = 0; way < WAYS; ++way)
+		{
+			if (ways[way].key == key)
+			{
+				ways[way].used = ++clocks_[set];
+				result = ways[way].result;
+				++stripe.hits;
+				return true;
+			}
+		}
+		++stripe.misses;
+		return false;
+	}
+
+	void insert(const Key &key, const Result &result)
+	{
+		const size_t set = set_of(key);
+		Stripe &stripe = stripes_[set % Stripes];
+		std::lock_guard<Lock> lock(stripe.lock);
+		Entry *ways = &entries_[set * WAYS];
+		Entry *victim = &ways[0];
+		for (unsigned way = 0; way < WAYS; ++way)
+		{
+			if (ways[way].key == key)
+			{
+				return;		// another thread got here first
+			}
+			// empty entries have used 0 and go first; set clocks only wrap after 2^32 uses
+			if (ways[way].used < victim->used)
+			{
+				victim = &ways[way];
+			}
+		}
+		victim->key = key;
+		victim->result = result;
+		victim->used = ++clocks_[set];
+	}
+
+	size_t sets_;
+	double tolerance_;
+	std::unique_ptr<Entry[]> entries_;
+	std::unique_ptr<uint32_t[]> clocks_;
+	Stripe stripes_[Stripes];
+};
+
+// for use from one thread at a time
+struct FormulaV4CacheNoLock
+{
+	void lock()
+	{
+	}
+
+	void unlock()
+	{
+	}
+};
+
+typedef FormulaV4BasicCache<FormulaV4CacheNoLock, 1> FormulaV4Cache;
+typedef FormulaV4BasicCache<std::mutex, 64> FormulaV4ConcurrentCache;
@@ -0,0 +1,77 @@
+// FormulaV4Client.h
+//
+// Blocking client of the local solver service (FormulaV4Server.h), for
+// services that would rather call the daemon than solve in process:
+//
+//   FormulaV4Client client("unix:/run/formulav4.sock");
+//   client.solve(problems.data(), problems.size());	// solved in place
+//
+// A client is one connection and is not safe to share between threads
+// without a lock; open one per thread instead, and the server will batch
+// their requests together.
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include "FormulaV4Wire.h"
+
+class FormulaV4Client
+{
+public:
+	// what the server reported for a solve, summed over the frames it took
+	struct Timing
+	{
+		uint64_t wait_ns;			// in the server before the batch started
+		uint64_t solve_ns;			// in the kernels, for the whole micro-batch
+	};
+
+	explicit FormulaV4Client(const std::string &address): fd_(FormulaV4Wire::connect(address)), next_id_(0)
+	{
+	}
+
+	~FormulaV4Client()
+	{
+		::close(fd_);
+	}
+
+	FormulaV4Client(const FormulaV4Client&) = delete;
+	FormulaV4Client& operator=(const FormulaV4Client&) = delete;
+
+	// solve count problems in place, each with its status; more than MAX_ROWS go as several requests
+	Timing solve(FormulaV4Problem *problems, size_t count)
+	{
+		Timing timing = { 0, 0 };
+		do
+		{
+			const uint32_t rows = static_cast<uint32_t>(std::min<size_t>(count, FormulaV4WireHeader::MAX_ROWS));
+			FormulaV4WireHeader header = { FormulaV4WireHeader::REQUEST, next_id_++, rows, 0, 0, 0 };
+			FormulaV4Wire::send_all(fd_, &header, sizeof(header), rows ? MSG_MORE : 0);
+			FormulaV4Wire::send_all(fd_, problems, rows * sizeof(FormulaV4Problem));
+
+			FormulaV4WireHeader reply;
+			FormulaV4Wire::receive_all(fd_, &reply, sizeof(reply));
+			if (reply.magic != FormulaV4WireHeader::REPLY || reply.id != header.id || reply.error != FormulaV4WireHeader::none ||
+				reply.rows != rows)
+			{
+				throw FormulaV4WireException("Error: the solver service sent a bad reply.");
+			}
+			FormulaV4Wire::receive_all(fd_, problems, rows * sizeof(FormulaV4Problem));
+			timing.wait_ns += reply.wait_ns;
+			timing.solve_ns += reply.solve_ns;
+			problems += rows;
+			count -= rows;
+		}
+		while (count != 0);
+		return timing;
+	}
+
+	FormulaV4Status solve(FormulaV4Problem &problem)
+	{
+		solve(&problem, 1);
+		return problem.status;
+	}
+
+private:
+	int fd_;
+	uint32_t next_id_;
+};
@@ -0,0 +1,454 @@
+// FormulaV4Csv.h
+//
+// Streaming CSV/TSV input and output for the V4 batch solvers. A row holds
+// distance, time, initial velocity, final velocity and acceleration in that
+// order, with blank cells for the unknowns. The reader fills a fixed-size
+// FormulaV4Batch from a large read buffer and the writer formats a solved
+// batch into a large write buffer, so memory stays the same whatever the
+// input size and nothing is allocated per row. Numbers are parsed and printed
+// with std::from_chars/std::to_chars, which ignore the C locale.
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "FormulaV4a.h"
+#include "FormulaV4Arena.h"
+#include "FormulaV4Trace.h"
+
+// owns the storage behind a FormulaV4aColumns batch of up to capacity() rows, with every column
+// 64-byte aligned; given an arena, the columns live in it and go away with its reset()
+struct FormulaV4Batch
+{
+	template <class T>
+	using Column = std::vector<T, FormulaV4ArenaAllocator<T>>;
+
+	explicit FormulaV4Batch(size_t capacity, FormulaV4Arena *arena = nullptr)
+		: presence(capacity, 0, arena), status(capacity, FormulaV4Status::ok, arena), rows(0)
+	{
+		for (auto &column : values)
+		{
+			column = Column<double>(capacity, 0.0, arena);
+		}
+	}
+
+	size_t capacity() const
+	{
+		return presence.size();
+	}
+
+	double *column(ValueId id)
+	{
+		return values[static_cast<int>(id)].data();
+	}
+
+	// view of the rows in use
+	FormulaV4aColumns view()
+	{
+		FormulaV4aColumns columns = { column(ValueId::distance), column(ValueId::time), column(ValueId::initial_velocity),
+			column(ValueId::final_velocity), column(ValueId::acceleration), presence.data(), status.data(), rows };
+		return columns;
+	}
+
+	Column<double> values[VARIABLES];	// indexed by ValueId
+	Column<unsigned char> presence;
+	Column<FormulaV4Status> status;
+	size_t rows;
+};
+
+// turns lines of one delimiter into batch rows; holds no other state, so the parsers of
+// FormulaV4Pipeline.h can share one. A line that is not five numbers or blanks becomes a row
+// flagged in invalid, which mark_invalid() turns into an invalid_row status after solving.
+class FormulaV4CsvParser
+{
+public:
+	explicit FormulaV4CsvParser(char delimiter = ','): delimiter_(delimiter)
+	{
+	}
+
+	char delimiter() const
+	{
+		return delimiter_;
+	}
+
+	// drop blanks at both ends; false if nothing is left
+	static bool trim(const char *&first, const char *&last)
+	{
+		while (first != last && blank(*first))
+		{
+			++first;
+		}
+		while (last != first && blank(last[-1]))
+		{
+			--last;
+		}
+		return first != last;
+	}
+
+	// every line of [first, last) appended to batch, blank lines skipped; the caller makes sure
+	// there is room for them
+	void parse(const char *first, const char *last, FormulaV4Batch &batch, unsigned char *invalid) const
+	{
+		while (first != last)
+		{
+			const char *stop = static_cast<const char*>(std::memchr(first, '\n', last - first));
+			if (!stop)
+			{
+				stop = last;
+			}
+			parse_line(first, stop, batch, invalid);
+			first = stop == last ? last : stop + 1;
+		}
+	}
+
+	// one line appended to batch, or nothing for a blank line
+	void parse_line(const char *first, const char *last, FormulaV4Batch &batch, unsigned char *invalid) const
+	{
+		if (!trim(first, last))
+		{
+			return;
+		}
+		if (!parse_row(first, last, batch, batch.rows))
+		{
+			add_invalid(batch, invalid);
+			return;
+		}
+		invalid[batch.rows++] = 0;
+	}
+
+	// the trimmed line [first, last) into row of batch; false if it is not five numbers or blanks
+	bool parse_row(const char *first, const char *last, FormulaV4Batch &batch, size_t row) const
+	{
+		unsigned presence = 0;
+		for (int field = 0; field < VARIABLES; ++field)
+		{
+			const char *cell_end = static_cast<const char*>(std::memchr(first, delimiter_, last - first));
+			if (!cell_end)
+			{
+				cell_end = last;
+			}
+			if ((cell_end == last) != (field == VARIABLES - 1))
+			{
+				return false;	// too few or too many fields
+			}
+
+			double &value = batch.values[field][row];
+			const char *cell = first;
+			const char *cell_last = cell_end;
+			while (cell != cell_last && blank(*cell))
+			{
+				++cell;
+			}
+			while (cell_last != cell && blank(cell_last[-1]))
+			{
+				--cell_last;
+			}
+			value = 0;
+			if (cell != cell_last)
+			{
+				if (*cell == '+')
+				{
+					++cell;
+				}
+				const std::from_chars_result result = std::from_chars(cell, cell_last, value);
+				if (result.ec != std::errc() || result.ptr != cell_last)
+				{
+					return false;
+				}
+				presence |= 1u << field;
+			}
+			first = cell_end + 1;
+		}
+		batch.presence[row] = static_cast<unsigned char>(presence);
+		return true;
+	}
+
+	// an invalid row appended to batch; it has no blanks, so solving leaves it alone
+	static void add_invalid(FormulaV4Batch &batch, unsigned char *invalid)
+	{
+		for (auto &column : batch.values)
+		{
+			column[batch.rows] = 0;
+		}
+		batch.presence[batch.rows] = static_cast<unsigned char>(ALL_PRESENT);
+		invalid[batch.rows++] = 1;
+	}
+
+	// blank out the rows flagged in invalid and set their status
+	static void mark_invalid(FormulaV4Batch &batch, const unsigned char *invalid)
+	{
+		FormulaV4TraceSpan span("validate");
+		for (size_t row = 0; row < batch.rows; ++row)
+		{
+			if (invalid[row])
+			{
+				batch.presence[row] = 0;
+				batch.status[row] = FormulaV4Status::invalid_row;
+			}
+		}
+	}
+
+private:
+	static bool blank(char c)
+	{
+		return c == ' ' || c == '\r';
+	}
+
+	char delimiter_;
+};
+
+class FormulaV4CsvReader
+{
+public:
+	static const size_t BUFFER_BYTES = 1 << 20;
+
+	// delimiter 0 picks tab if the first line has one, comma otherwise
+	explicit FormulaV4CsvReader(FILE *in, char delimiter = 0)
+		: in_(in), buffer_(BUFFER_BYTES), begin_(0), end_(0), bytes_(0), delimiter_(delimiter), first_line_(true),
+		eof_(false), overlong_(false)
+	{
+	}
+
+	// fill batch with up to batch.capacity() rows; returns the row count, 0 at end of input.
+	// Rows that do not parse come back with no blanks, so solving leaves them alone; call
+	// mark_invalid() after solving to give them the invalid_row status.
+	size_t read(FormulaV4Batch &batch)
+	{
+		FormulaV4TraceSpan span("parse");
+		batch.rows = 0;
+		invalid_.assign(batch.capacity(), 0);
+		while (batch.rows < batch.capacity())
+		{
+			const char *line = buffer_.data() + begin_;
+			const char *stop = static_cast<const char*>(std::memchr(line, '\n', end_ - begin_));
+			if (!stop)
+			{
+				if (!eof_)
+				{
+					fill();
+					continue;
+				}
+				if (begin_ == end_ && !overlong_)
+				{
+					break;
+				}
+				stop = buffer_.data() + end_;	// last line without a newline
+			}
+			begin_ = std::min<size_t>(stop - buffer_.data() + 1, end_);
+
+			if (overlong_)
+			{
+				overlong_ = false;
+				FormulaV4CsvParser::add_invalid(batch, invalid_.data());
+				continue;
+			}
+			parse_line(line, stop, batch);
+		}
+		return batch.rows;
+	}
+
+	// blank out the rows of the last read() that did not parse and set their status
+	void mark_invalid(FormulaV4Batch &batch) const
+	{
+		FormulaV4CsvParser::mark_invalid(batch, invalid_.data());
+	}
+
+	// first line, if it was a header rather than a row
+	const std::string &header() const
+	{
+		return header_;
+	}
+
+	char delimiter() const
+	{
+		return delimiter_ ? delimiter_ : ',';
+	}
+
+	size_t bytes() const
+	{
+		return bytes_;
+	}
+
+private:
+	// move the unread tail to the front and read more after it; a line longer than the
+	// whole buffer is dropped and comes back as one invalid row
+	void fill()
+	{
+		FormulaV4TraceSpan span("read");
+		if (begin_ == 0 && end_ == buffer_.size())
+		{
+			overlong_ = true;
+			end_ = 0;
+		}
+		std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+		end_ -= begin_;
+		begin_ = 0;
+		const size_t n = std::fread(buffer_.data() + end_, 1, buffer_.size() - end_, in_);
+		end_ += n;
+		bytes_ += n;
+		eof_ = n == 0;
+	}
+
+	void parse_line(const char *first, const char *last, FormulaV4Batch &batch)
+	{
+		if (first_line_)
+		{
+			if (!FormulaV4CsvParser::trim(first, last))
+			{
+				return;
+			}
+			first_line_ = false;
+			if (!delimiter_)
+			{
+				delimiter_ = std::memchr(first, '\t', last - first) ? '\t' : ',';
+			}
+			parser_ = FormulaV4CsvParser(delimiter_);
+			if (!parser_.parse_row(first, last, batch, batch.rows))
+			{
+				header_.assign(first, last);
+				return;
+			}
+			invalid_[batch.rows++] = 0;
+			return;
+		}
+		parser_.parse_line(first, last, batch, invalid_.data());
+	}
+
+	FILE *in_;
+	std::vector<char> buffer_;
+	size_t begin_;				// unread data is [begin_, end_)
+	size_t end_;
+	size_t bytes_;
+	char delimiter_;
+	bool first_line_;
+	bool eof_;
+	bool overlong_;
+	FormulaV4CsvParser parser_;
+	std::string header_;
+	std::vector<unsigned char> invalid_;
+};
+
+class FormulaV4CsvWriter
+{
+public:
+	static const size_t BUFFER_BYTES = 1 << 20;
+
+	FormulaV4CsvWriter(FILE *out, char delimiter)
+		: out_(out), buffer_(BUFFER_BYTES), end_(0), bytes_(0), delimiter_(delimiter), failed_(false)
+	{
+	}
+
+	~FormulaV4CsvWriter()
+	{
+		flush();
+	}
+
+	FormulaV4CsvWriter(const FormulaV4CsvWriter&) = delete;
+	FormulaV4CsvWriter& operator=(const FormulaV4CsvWriter&) = delete;
+
+	// header line with a status column appended
+	void write_header(const std::string &header)
+	{
+		reserve(header.size() + 16);
+		append(header.data(), header.size());
+		buffer_[end_++] = delimiter_;
+		append("status\n", 7);
+	}
+
+	static const size_t MAX_NUMBER = 32;				// the longest shortest-round-trip double is 24 chars
+	static const size_t MAX_LINE = VARIABLES * (MAX_NUMBER + 1) + 32;
+
+	// one line per row: the five values, blank where still unknown, then the status name
+	void write(const FormulaV4aColumns &columns)
+	{
+		FormulaV4TraceSpan span("format");
+		for (size_t row = 0; row < columns.rows; ++row)
+		{
+			reserve(MAX_LINE);
+			end_ = format(buffer_.data() + end_, columns, row, row + 1, delimiter_) - buffer_.data();
+		}
+	}
+
+	// the lines of rows [first, last) at p, which has room for MAX_LINE bytes a row; returns their end
+	static char *format(char *p, const FormulaV4aColumns &columns, size_t first, size_t last, char delimiter)
+	{
+		const double *values[VARIABLES] = { columns.distance, columns.time, columns.initial_velocity,
+			columns.final_velocity, columns.acceleration };
+		for (size_t row = first; row < last; ++row)
+		{
+			for (int field = 0; field < VARIABLES; ++field)
+			{
+				if (columns.presence[row] & (1u << field))
+				{
+					p = std::to_chars(p, p + MAX_NUMBER, values[field][row]).ptr;
+				}
+				*p++ = delimiter;
+			}
+			const char *name = status_name(columns.status[row]);
+			const size_t length = std::strlen(name);
+			std::memcpy(p, name, length);
+			p += length;
+			*p++ = '\n';
+		}
+		return p;
+	}
+
+	void flush()
+	{
+		FormulaV4TraceSpan span("write");
+		if (end_ && std::fwrite(buffer_.data(), 1, end_, out_) != end_)
+		{
+			failed_ = true;
+		}
+		bytes_ += end_;
+		end_ = 0;
+		std::fflush(out_);
+	}
+
+	// true once a write has come up short, e.g. on a full disk
+	bool failed() const
+	{
+		return failed_;
+	}
+
+	size_t bytes() const
+	{
+		return bytes_ + end_;
+	}
+
+private:
+	void reserve(size_t n)
+	{
+		if (buffer_.size() - end_ < n)
+		{
+			FormulaV4TraceSpan span("write");
+			const size_t keep = end_;
+			if (std::fwrite(buffer_.data(), 1, keep, out_) != keep)
+			{
+				failed_ = true;
+			}
+			bytes_ += keep;
+			end_ = 0;
+			if (buffer_.size() < n)
+			{
+				buffer_.resize(n);
+			}
+		}
+	}
+
+	void append(const char *text, size_t n)
+	{
+		std::memcpy(buffer_.data() + end_, text, n);
+		end_ += n;
+	}
+
+	FILE *out_;
+	std::vector<char> buffer_;
+	size_t end_;
+	size_t bytes_;
+	char delimiter_;
+	bool failed_;
+};
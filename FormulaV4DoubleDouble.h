@@ -0,0 +1,117 @@
+// FormulaV4DoubleDouble.h
+//
+// Compensated "double-double" arithmetic: a value is the unevaluated sum
+// hi + lo of two doubles, which carries about 106 bits of significand.
+// It has the operators and sqrt() the V4 formulas use, so the engine can be
+// instantiated with it for audits that need more than double precision.
+// The error-free transforms need IEEE double rounding and no extended
+// precision, i.e. SSE2 rather than x87 on 32-bit x86.
+#pragma once
+#include <cmath>
+
+struct FormulaV4DoubleDouble
+{
+	double hi;
+	double lo;
+
+	FormulaV4DoubleDouble(): hi(0), lo(0)
+	{
+	}
+
+	FormulaV4DoubleDouble(double value): hi(value), lo(0)
+	{
+	}
+
+	FormulaV4DoubleDouble(double high, double low): hi(high), lo(low)
+	{
+	}
+
+	explicit operator double() const
+	{
+		return hi + lo;
+	}
+
+	// s + e == a + b exactly, with |e| <= ulp(s) / 2
+	static FormulaV4DoubleDouble two_sum(double a, double b)
+	{
+		const double s = a + b;
+		const double bb = s - a;
+		return FormulaV4DoubleDouble(s, (a - (s - bb)) + (b - bb));
+	}
+
+	// the same for |a| >= |b|
+	static FormulaV4DoubleDouble quick_two_sum(double a, double b)
+	{
+		const double s = a + b;
+		return FormulaV4DoubleDouble(s, b - (s - a));
+	}
+
+	// p + e == a * b exactly
+	static FormulaV4DoubleDouble two_prod(double a, double b)
+	{
+		const double p = a * b;
+		return FormulaV4DoubleDouble(p, std::fma(a, b, -p));
+	}
+};
+
+inline FormulaV4DoubleDouble operator-(const FormulaV4DoubleDouble &a)
+{
+	return FormulaV4DoubleDouble(-a.hi, -a.lo);
+}
+
+inline FormulaV4DoubleDouble operator+(const FormulaV4DoubleDouble &a, const FormulaV4DoubleDouble &b)
+{
+	FormulaV4DoubleDouble s = FormulaV4DoubleDouble::two_sum(a.hi, b.hi);
+	const FormulaV4DoubleDouble t = FormulaV4DoubleDouble::two_sum(a.lo, b.lo);
+	s = FormulaV4DoubleDouble::quick_two_sum(s.hi, s.lo + t.hi);
+	return FormulaV4DoubleDouble::quick_two_sum(s.hi, s.lo + t.lo);
+}
+
+inline FormulaV4DoubleDouble operator-(const FormulaV4DoubleDouble &a, const FormulaV4DoubleDouble &b)
+{
+	return a + -b;
+}
+
+inline FormulaV4DoubleDouble operator*(const FormulaV4DoubleDouble &a, const FormulaV4DoubleDouble &b)
+{
+	const FormulaV4DoubleDouble p = FormulaV4DoubleDouble::two_prod(a.hi, b.hi);
+	return FormulaV4DoubleDouble::quick_two_sum(p.hi, p.lo + (a.hi * b.lo + a.lo * b.hi));
+}
+
+// long division, one double of quotient at a time
+inline FormulaV4DoubleDouble operator/(const FormulaV4DoubleDouble &a, const FormulaV4DoubleDouble &b)
+{
+	const double q1 = a.hi / b.hi;
+	FormulaV4DoubleDouble r = a - b * q1;
+	const double q2 = r.hi / b.hi;
+	r = r - b * q2;
+	const double q3 = r.hi / b.hi;
+	return FormulaV4DoubleDouble::quick_two_sum(q1, q2) + q3;
+}
+
+inline bool operator==(const FormulaV4DoubleDouble &a, const FormulaV4DoubleDouble &b)
+{
+	return a.hi == b.hi && a.lo == b.lo;
+}
+
+inline bool operator!=(const FormulaV4DoubleDouble &a, const FormulaV4DoubleDouble &b)
+{
+	return !(a == b);
+}
+
+inline bool operator<(const FormulaV4DoubleDouble &a, const FormulaV4DoubleDouble &b)
+{
+	return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+// one Newton step from the double square root doubles its precision
+inline FormulaV4DoubleDouble sqrt(const FormulaV4DoubleDouble &a)
+{
+	if (!(a.hi > 0))
+	{
+		return FormulaV4DoubleDouble(std::sqrt(a.hi));		// 0, or NaN for negatives
+	}
+	const double root = std::sqrt(a.hi);
+	const FormulaV4DoubleDouble residual = a - FormulaV4DoubleDouble::two_prod(root, root);
+	return FormulaV4DoubleDouble::quick_two_sum(root, residual.hi / (2 * root));
+}
@@ -0,0 +1,417 @@
+// FormulaV4File.h
+//
+// Binary columnar file format for V4 batches, read and solved through mmap
+// so the kernels work directly on the mapped pages. POSIX only.
+//
+// A file is a header followed by row groups of group_rows rows each (at
+// most MAX_GROUP_ROWS; the last group may be short), every group group_bytes
+// long. Inside a group, at the offsets given in the header, are the five
+// double columns in ValueId order, the presence masks (one byte per row, bit
+// N set when ValueId N is known) and the status column, each block 64-byte
+// aligned. A group is therefore exactly a FormulaV4aColumns. Values are
+// stored in the native byte order, which the header records.
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "FormulaV4a.h"
+
+class FormulaV4FileException: public std::exception
+{
+public:
+	FormulaV4FileException(std::string message): msg_(message)
+	{
+	}
+
+	std::string message() const
+	{
+		return msg_;
+	}
+
+private:
+	std::string msg_;
+};
+
+struct FormulaV4FileHeader
+{
+	static const uint32_t VERSION = 1;
+	static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+	static const uint64_t MAX_GROUP_ROWS = 1 << 24;
+	enum Block { distance, time, initial_velocity, final_velocity, acceleration, presence, status, BLOCKS };
+
+	char magic[8];					// "FV4COLS" and a zero
+	uint32_t version;
+	uint32_t byte_order;			// BYTE_ORDER_MARK as written by the producer
+	uint64_t header_bytes;			// offset of the first group
+	uint64_t rows;
+	uint64_t group_rows;
+	uint64_t group_bytes;
+	uint64_t offsets[BLOCKS];		// of each block within a group
+
+	// header for a file with groups of group_rows rows
+	static FormulaV4FileHeader layout(uint64_t group_rows)
+	{
+		FormulaV4FileHeader header = {};
+		std::memcpy(header.magic, "FV4COLS", 8);
+		header.version = VERSION;
+		header.byte_order = BYTE_ORDER_MARK;
+		header.header_bytes = PAGE_BYTES;
+		header.group_rows = group_rows;
+		uint64_t offset = 0;
+		for (int block = 0; block < BLOCKS; ++block)
+		{
+			header.offsets[block] = offset;
+			offset = align(offset + group_rows * (block < presence ? sizeof(double) : 1), 64);
+		}
+		header.group_bytes = align(offset, PAGE_BYTES);
+		return header;
+	}
+
+	uint64_t groups() const
+	{
+		return rows / group_rows + (rows % group_rows != 0);
+	}
+
+	// true if the groups this header describes fit in a file of bytes bytes; group_rows and
+	// group_bytes must already be known to be non-zero, and nothing here can wrap around
+	bool fits(uint64_t bytes) const
+	{
+		return bytes >= header_bytes && groups() <= (bytes - header_bytes) / group_bytes;
+	}
+
+	uint64_t file_bytes() const
+	{
+		return header_bytes + groups() * group_bytes;
+	}
+
+	static const uint64_t PAGE_BYTES = 4096;
+
+	static uint64_t align(uint64_t n, uint64_t to)
+	{
+		return (n + to - 1) / to * to;
+	}
+};
+
+// a mapped file; read gives a private copy-on-write view, update writes results back to the file
+class FormulaV4File
+{
+public:
+	enum class Mode { read, update };
+
+	FormulaV4File(const char *path, Mode mode)
+		: fd_(-1), map_(nullptr), bytes_(0)
+	{
+		fd_ = ::open(path, mode == Mode::update ? O_RDWR : O_RDONLY);
+		if (fd_ < 0)
+		{
+			fail("cannot open", path);
+		}
+		struct stat info;
+		if (::fstat(fd_, &info) != 0 || static_cast<uint64_t>(info.st_size) < sizeof(FormulaV4FileHeader))
+		{
+			close();
+			throw FormulaV4FileException(std::string("Error: ") + path + " is not a V4 column file.");
+		}
+		bytes_ = static_cast<size_t>(info.st_size);
+		map_ = ::mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, mode == Mode::update ? MAP_SHARED : MAP_PRIVATE, fd_, 0);
+		if (map_ == MAP_FAILED)
+		{
+			map_ = nullptr;
+			close();
+			fail("cannot map", path);
+		}
+
+		// the header may be corrupt or hostile: group_rows is bounded before layout() is worked out
+		// from it, and the size check cannot overflow
+		const FormulaV4FileHeader &h = header();
+		const bool bounded = h.group_rows != 0 && h.group_rows <= FormulaV4FileHeader::MAX_GROUP_ROWS;
+		const FormulaV4FileHeader expected = FormulaV4FileHeader::layout(bounded ? h.group_rows : 1);
+		if (std::memcmp(h.magic, expected.magic, sizeof(h.magic)) != 0 || h.version != FormulaV4FileHeader::VERSION ||
+			!bounded || h.header_bytes != expected.header_bytes || h.group_bytes != expected.group_bytes ||
+			std::memcmp(h.offsets, expected.offsets, sizeof(h.offsets)) != 0 || !h.fits(bytes_))
+		{
+			close();
+			throw FormulaV4FileException(std::string("Error: ") + path + " is not a V4 column file of version " +
+				std::to_string(FormulaV4FileHeader::VERSION) + ".");
+		}
+		if (h.byte_order != FormulaV4FileHeader::BYTE_ORDER_MARK)
+		{
+			close();
+			throw FormulaV4FileException(std::string("Error: ") + path + " was written with a different byte order.");
+		}
+	}
+
+	~FormulaV4File()
+	{
+		close();
+	}
+
+	FormulaV4File(const FormulaV4File&) = delete;
+	FormulaV4File& operator=(const FormulaV4File&) = delete;
+
+	const FormulaV4FileHeader &header() const
+	{
+		return *static_cast<const FormulaV4FileHeader*>(map_);
+	}
+
+	size_t rows() const
+	{
+		return static_cast<size_t>(header().rows);
+	}
+
+	size_t groups() const
+	{
+		return static_cast<size_t>(header().groups());
+	}
+
+	// the rows of group g, pointing into the mapping
+	FormulaV4aColumns group(size_t g)
+	{
+		const FormulaV4FileHeader &h = header();
+		char *base = static_cast<char*>(map_) + h.header_bytes + g * h.group_bytes;
+		const uint64_t first = g * h.group_rows;
+		FormulaV4aColumns columns = {
+			reinterpret_cast<double*>(base + h.offsets[FormulaV4FileHeader::distance]),
+			reinterpret_cast<double*>(base + h.offsets[FormulaV4FileHeader::time]),
+			reinterpret_cast<double*>(base + h.offsets[FormulaV4FileHeader::initial_velocity]),
+			reinterpret_cast<double*>(base + h.offsets[FormulaV4FileHeader::final_velocity]),
+			reinterpret_cast<double*>(base + h.offsets[FormulaV4FileHeader::acceleration]),
+			reinterpret_cast<unsigned char*>(base + h.offsets[FormulaV4FileHeader::presence]),
+			reinterpret_cast<FormulaV4Status*>(base + h.offsets[FormulaV4FileHeader::status]),
+			static_cast<size_t>(std::min<uint64_t>(h.group_rows, h.rows - first)) };
+		return columns;
+	}
+
+	// solve group g in place with solve(columns) and return it. Rows stored as invalid_row (lines
+	// the CSV reader could not parse) keep that status instead of coming back as too_many_blanks,
+	// as mark_invalid() does for the CSV path.
+	template <class Solve>
+	FormulaV4aColumns solve_group(size_t g, Solve solve)
+	{
+		FormulaV4aColumns columns = group(g);
+		invalid_.clear();
+		for (size_t row = 0; row < columns.rows; ++row)
+		{
+			if (columns.status[row] == FormulaV4Status::invalid_row)
+			{
+				invalid_.push_back(row);
+			}
+		}
+		solve(columns);
+		for (size_t row : invalid_)
+		{
+			columns.status[row] = FormulaV4Status::invalid_row;
+		}
+		return columns;
+	}
+
+	// flush an update mapping to disk
+	void sync()
+	{
+		if (::msync(map_, bytes_, MS_SYNC) != 0)
+		{
+			throw FormulaV4FileException(std::string("Error: cannot write results: ") + std::strerror(errno));
+		}
+	}
+
+	// copy a column file without passing the data through user space, so it can be solved in place
+	static void copy(const char *from, const char *to)
+	{
+		const int in = ::open(from, O_RDONLY);
+		if (in < 0)
+		{
+			fail("cannot open", from);
+		}
+		const int out = ::open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out < 0)
+		{
+			::close(in);
+			fail("cannot create", to);
+		}
+		struct stat info;
+		const bool ok = ::fstat(in, &info) == 0 && transfer(in, out, static_cast<uint64_t>(info.st_size));
+		const int error = errno;
+		::close(in);
+		if (::close(out) != 0 || !ok)
+		{
+			errno = error;
+			fail("cannot copy to", to);
+		}
+	}
+
+	// bytes from the position of in to the position of out, in the kernel where the files allow it;
+	// false with errno set on an error or if in ends early
+	static bool transfer(int in, int out, uint64_t bytes)
+	{
+		bool in_kernel = true;
+		for (uint64_t left = bytes; left > 0; )
+		{
+			ssize_t n = in_kernel ? ::copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(left), 0) : -1;
+			if (n < 0 && in_kernel && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				in_kernel = false;	// not supported between these files; fall back to read/write
+				continue;
+			}
+			if (!in_kernel)
+			{
+				char buffer[1 << 16];
+				n = ::read(in, buffer, static_cast<size_t>(std::min<uint64_t>(left, sizeof(buffer))));
+				for (ssize_t written = 0, w; n > 0 && written < n; written += w)
+				{
+					w = ::write(out, buffer + written, static_cast<size_t>(n - written));
+					if (w <= 0)
+					{
+						n = -1;
+						break;
+					}
+				}
+			}
+			if (n <= 0)
+			{
+				errno = n == 0 ? EIO : errno;
+				return false;
+			}
+			left -= static_cast<uint64_t>(n);
+		}
+		return true;
+	}
+
+private:
+	[[noreturn]] static void fail(const char *what, const char *path)
+	{
+		throw FormulaV4FileException(std::string("Error: ") + what + " " + path + ": " + std::strerror(errno));
+	}
+
+	void close()
+	{
+		if (map_)
+		{
+			::munmap(map_, bytes_);
+			map_ = nullptr;
+		}
+		if (fd_ >= 0)
+		{
+			::close(fd_);
+			fd_ = -1;
+		}
+	}
+
+	int fd_;
+	void *map_;
+	size_t bytes_;
+	std::vector<size_t> invalid_;	// rows of the group in solve_group()
+};
+
+// streams rows into a new column file, in any batch size; finish() writes the header
+class FormulaV4FileWriter
+{
+public:
+	static const size_t GROUP_ROWS = 1 << 16;
+
+	explicit FormulaV4FileWriter(const char *path, size_t group_rows = GROUP_ROWS)
+		: path_(path), header_(FormulaV4FileHeader::layout(std::min(std::max<uint64_t>(group_rows, 1),
+			uint64_t(FormulaV4FileHeader::MAX_GROUP_ROWS)))), finished_(false)
+	{
+		fd_ = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd_ < 0)
+		{
+			throw FormulaV4FileException(std::string("Error: cannot create ") + path + ": " + std::strerror(errno));
+		}
+	}
+
+	~FormulaV4FileWriter()
+	{
+		if (fd_ >= 0)
+		{
+			::close(fd_);
+		}
+	}
+
+	FormulaV4FileWriter(const FormulaV4FileWriter&) = delete;
+	FormulaV4FileWriter& operator=(const FormulaV4FileWriter&) = delete;
+
+	void write(const FormulaV4aColumns &columns)
+	{
+		const void *blocks[FormulaV4FileHeader::BLOCKS] = { columns.distance, columns.time, columns.initial_velocity,
+			columns.final_velocity, columns.acceleration, columns.presence, columns.status };
+		for (size_t done = 0; done < columns.rows; )
+		{
+			const uint64_t group = header_.rows / header_.group_rows;
+			const uint64_t row = header_.rows % header_.group_rows;
+			const size_t n = static_cast<size_t>(std::min<uint64_t>(columns.rows - done, header_.group_rows - row));
+			const uint64_t base = header_.header_bytes + group * header_.group_bytes;
+			for (int block = 0; block < FormulaV4FileHeader::BLOCKS; ++block)
+			{
+				const size_t width = block < FormulaV4FileHeader::presence ? sizeof(double) : 1;
+				put(static_cast<const char*>(blocks[block]) + done * width, n * width,
+					base + header_.offsets[block] + row * width);
+			}
+			done += n;
+			header_.rows += n;
+		}
+	}
+
+	size_t rows() const
+	{
+		return static_cast<size_t>(header_.rows);
+	}
+
+	// size the file to whole groups and write the header
+	void finish()
+	{
+		if (finished_)
+		{
+			return;
+		}
+		finished_ = true;
+		if (::ftruncate(fd_, static_cast<off_t>(header_.file_bytes())) != 0)
+		{
+			fail();
+		}
+		put(&header_, sizeof(header_), 0);
+		if (::close(fd_) != 0)
+		{
+			fd_ = -1;
+			fail();
+		}
+		fd_ = -1;
+	}
+
+private:
+	void put(const void *data, size_t n, uint64_t offset)
+	{
+		const char *p = static_cast<const char*>(data);
+		while (n > 0)
+		{
+			const ssize_t written = ::pwrite(fd_, p, n, static_cast<off_t>(offset));
+			if (written <= 0)
+			{
+				if (written < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				fail();
+			}
+			p += written;
+			n -= static_cast<size_t>(written);
+			offset += static_cast<uint64_t>(written);
+		}
+	}
+
+	[[noreturn]] void fail()
+	{
+		throw FormulaV4FileException("Error: cannot write " + path_ + ": " + std::strerror(errno));
+	}
+
+	std::string path_;
+	FormulaV4FileHeader header_;
+	int fd_;
+	bool finished_;
+};
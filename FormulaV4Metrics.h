@@ -0,0 +1,447 @@
+// FormulaV4Metrics.h
+//
+// Runtime counters for the V4 solve paths: solves by unknowns and status,
+// and a latency histogram per set of unknowns. Single solves (FormulaV4a,
+// FormulaV4b, FormulaV4a row batches) record their own time; the vector
+// paths record each block of rows with the same unknowns at its time per
+// row. FormulaV4Solver and cache hits run no dispatch and are not counted.
+// Every solve is counted, but only one in FORMULAV4_METRICS_SAMPLE (per
+// thread) is timed, since reading the clock costs more than most solves.
+//
+// Build with FORMULAV4_METRICS=1 to turn them on. Otherwise every hook is an
+// empty inline function and compiles to nothing. Each thread writes only
+// its own shard, so recording takes no lock and shares no cache line;
+// snapshot() adds the shards up, and the dumps are Prometheus text or JSON.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "FormulaV4Status.h"
+
+#ifndef FORMULAV4_METRICS
+#define FORMULAV4_METRICS 0
+#endif
+#ifndef FORMULAV4_METRICS_SAMPLE
+#define FORMULAV4_METRICS_SAMPLE 16
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define FORMULAV4_CLOCK_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define FORMULAV4_CLOCK_TSC 1
+#endif
+
+// a cheap monotonic tick: the time stamp counter on x86, steady_clock nanoseconds elsewhere
+struct FormulaV4Clock
+{
+	static uint64_t now()
+	{
+#if FORMULAV4_CLOCK_TSC
+		return __rdtsc();
+#else
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+	}
+
+	// measured once against steady_clock, over about 10 ms
+	static double ticks_per_ns()
+	{
+#if FORMULAV4_CLOCK_TSC
+		static const double rate = []
+		{
+			const auto start = std::chrono::steady_clock::now();
+			const uint64_t first = now();
+			std::chrono::steady_clock::time_point end;
+			do
+			{
+				end = std::chrono::steady_clock::now();
+			} while (end - start < std::chrono::milliseconds(10));
+			const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+			return static_cast<double>(now() - first) / ns;
+		}();
+		return rate;
+#else
+		return 1.0;
+#endif
+	}
+};
+
+// totals over all threads, indexed by the 5-bit mask of unknowns
+struct FormulaV4MetricsSnapshot
+{
+	static const int KEYS = 32;
+	static const int STATUSES = static_cast<int>(FormulaV4Status::invalid_row) + 1;
+	static const int BUCKETS = 40;		// bucket b holds times of [2^b, 2^(b+1)) ticks
+
+	uint64_t solves[KEYS][STATUSES];
+	uint64_t latency[KEYS][BUCKETS];
+	uint64_t ticks[KEYS];				// total time of the timed solves
+	double ticks_per_ns;
+
+	// number of timed solves
+	uint64_t samples(unsigned key) const
+	{
+		uint64_t n = 0;
+		for (int bucket = 0; bucket < BUCKETS; ++bucket)
+		{
+			n += latency[key][bucket];
+		}
+		return n;
+	}
+
+	// the blank fields of key, e.g. "distance+time"; "none" for no blanks
+	static std::string unknowns_name(unsigned key)
+	{
+		static const char *names[] = { "distance", "time", "initial_velocity", "final_velocity", "acceleration" };
+		std::string name;
+		for (int field = 0; field < 5; ++field)
+		{
+			if (key & (1u << field))
+			{
+				name += (name.empty() ? "" : "+") + std::string(names[field]);
+			}
+		}
+		return name.empty() ? "none" : name;
+	}
+
+	// Prometheus text exposition format
+	std::string prometheus() const
+	{
+		std::string out = "# HELP formulav4_solves_total V4 solves by unknown fields and outcome.\n"
+			"# TYPE formulav4_solves_total counter\n";
+		for (unsigned key = 0; key < KEYS; ++key)
+		{
+			for (int status = 0; status < STATUSES; ++status)
+			{
+				if (solves[key][status] != 0)
+				{
+					out += "formulav4_solves_total{unknowns=\"" + unknowns_name(key) + "\",status=\"" +
+						status_name(static_cast<FormulaV4Status>(status)) + "\"} " + std::to_string(solves[key][status]) + "\n";
+				}
+			}
+		}
+		out += "# HELP formulav4_solve_seconds Time per solved row by unknown fields, sampled.\n"
+			"# TYPE formulav4_solve_seconds histogram\n";
+		for (unsigned key = 0; key < KEYS; ++key)
+		{
+			const uint64_t n = samples(key);
+			if (n == 0)
+			{
+				continue;
+			}
+			const std::string label = "{unknowns=\"" + unknowns_name(key) + "\"";
+			uint64_t cumulative = 0;
+			for (int bucket = 0; bucket < BUCKETS; ++bucket)
+			{
+				cumulative += latency[key][bucket];
+				if (latency[key][bucket] != 0)
+				{
+					out += "formulav4_solve_seconds_bucket" + label + ",le=\"" + number(upper_ns(bucket) * 1e-9) + "\"} " +
+						std::to_string(cumulative) + "\n";
+				}
+			}
+			out += "formulav4_solve_seconds_bucket" + label + ",le=\"+Inf\"} " + std::to_string(n) + "\n";
+			out += "formulav4_solve_seconds_sum" + label + "} " + number(ticks[key] / ticks_per_ns * 1e-9) + "\n";
+			out += "formulav4_solve_seconds_count" + label + "} " + std::to_string(n) + "\n";
+		}
+		return out;
+	}
+
+	// one JSON object: {"solves":[...],"latency":[...]}, non-zero entries only
+	std::string json() const
+	{
+		std::string out = "{\"solves\":[";
+		const char *comma = "";
+		for (unsigned key = 0; key < KEYS; ++key)
+		{
+			for (int status = 0; status < STATUSES; ++status)
+			{
+				if (solves[key][status] != 0)
+				{
+					out += comma + std::string("{\"unknowns\":\"") + unknowns_name(key) + "\",\"status\":\"" +
+						status_name(static_cast<FormulaV4Status>(status)) + "\",\"count\":" +
+						std::to_string(solves[key][status]) + "}";
+					comma = ",";
+				}
+			}
+		}
+		out += "],\"latency\":[";
+		comma = "";
+		for (unsigned key = 0; key < KEYS; ++key)
+		{
+			const uint64_t n = samples(key);
+			if (n == 0)
+			{
+				continue;
+			}
+			out += comma + std::string("{\"unknowns\":\"") + unknowns_name(key) + "\",\"count\":" + std::to_string(n) +
+				",\"mean_ns\":" + number(ticks[key] / ticks_per_ns / n) + ",\"buckets\":[";
+			const char *bucket_comma = "";
+			for (int bucket = 0; bucket < BUCKETS; ++bucket)
+			{
+				if (latency[key][bucket] != 0)
+				{
+					out += bucket_comma + std::string("{\"le_ns\":") + number(upper_ns(bucket)) + ",\"count\":" +
+						std::to_string(latency[key][bucket]) + "}";
+					bucket_comma = ",";
+				}
+			}
+			out += "]}";
+			comma = ",";
+		}
+		return out + "]}";
+	}
+
+private:
+	double upper_ns(int bucket) const
+	{
+		return static_cast<double>(uint64_t(2) << bucket) / ticks_per_ns;
+	}
+
+	static std::string number(double x)
+	{
+		char buffer[32];
+		std::snprintf(buffer, sizeof(buffer), "%.6g", x);
+		return buffer;
+	}
+};
+
+class FormulaV4Metrics
+{
+public:
+	static const bool enabled = FORMULAV4_METRICS != 0;
+
+	// the tick to pass to record() once the solve is done; 0 when this solve is not timed
+	static uint64_t start()
+	{
+#if FORMULAV4_METRICS
+		Shard &shard = local();
+		if (--shard.countdown != 0)
+		{
+			return 0;
+		}
+		// a random gap averaging the sample rate, so periodic input cannot alias with it
+		shard.random ^= shard.random << 13;
+		shard.random ^= shard.random >> 17;
+		shard.random ^= shard.random << 5;
+		shard.countdown = 1 + shard.random % (2 * FORMULAV4_METRICS_SAMPLE - 1);
+		return FormulaV4Clock::now();
+#else
+		return 0;
+#endif
+	}
+
+	// one solve of the unknowns in key, started at start()
+	static void record(unsigned key, FormulaV4Status status, uint64_t start)
+	{
+#if FORMULAV4_METRICS
+		Shard &shard = local();
+		add(shard.solves[key & 31][static_cast<int>(status)], 1);
+		if (start != 0)
+		{
+			const uint64_t ticks = FormulaV4Clock::now() - start;
+			add(shard.latency[key & 31][bucket(ticks)], 1);
+			add(shard.ticks[key & 31], ticks);
+		}
+#else
+		(void)key;
+		(void)status;
+		(void)start;
+#endif
+	}
+
+	// rows solves of the same unknowns, started together at start()
+	static void record_block(unsigned key, const FormulaV4Status *status, size_t rows, uint64_t start)
+	{
+#if FORMULAV4_METRICS
+		Shard &shard = local();
+		for (size_t i = 0; i < rows; ++i)
+		{
+			add(shard.solves[key & 31][static_cast<int>(status[i])], 1);
+		}
+		if (start != 0 && rows != 0)
+		{
+			const uint64_t ticks = FormulaV4Clock::now() - start;
+			add(shard.latency[key & 31][bucket(ticks / rows)], rows);
+			add(shard.ticks[key & 31], ticks);
+		}
+#else
+		(void)key;
+		(void)status;
+		(void)rows;
+		(void)start;
+#endif
+	}
+
+	// totals so far; all zero when compiled out
+	static FormulaV4MetricsSnapshot snapshot()
+	{
+		FormulaV4MetricsSnapshot total = {};
+		total.ticks_per_ns = 1;
+#if FORMULAV4_METRICS
+		total.ticks_per_ns = FormulaV4Clock::ticks_per_ns();
+		Registry &registry = shards();
+		std::lock_guard<std::mutex> lock(registry.lock);
+		for (auto &shard : registry.shards)
+		{
+			for (int key = 0; key < FormulaV4MetricsSnapshot::KEYS; ++key)
+			{
+				for (int status = 0; status < FormulaV4MetricsSnapshot::STATUSES; ++status)
+				{
+					total.solves[key][status] += shard->solves[key][status].load(std::memory_order_relaxed);
+				}
+				for (int b = 0; b < FormulaV4MetricsSnapshot::BUCKETS; ++b)
+				{
+					total.latency[key][b] += shard->latency[key][b].load(std::memory_order_relaxed);
+				}
+				total.ticks[key] += shard->ticks[key].load(std::memory_order_relaxed);
+			}
+		}
+#endif
+		return total;
+	}
+
+	// zero every counter; exact only while no thread is solving
+	static void reset()
+	{
+#if FORMULAV4_METRICS
+		Registry &registry = shards();
+		std::lock_guard<std::mutex> lock(registry.lock);
+		for (auto &shard : registry.shards)
+		{
+			shard->clear();
+		}
+#endif
+	}
+
+	static std::string prometheus()
+	{
+		return snapshot().prometheus();
+	}
+
+	static std::string json()
+	{
+		return snapshot().json();
+	}
+
+#if FORMULAV4_METRICS
+private:
+	typedef std::atomic<uint64_t> Counter;
+
+	// one thread's counters; only the owning thread writes them
+	struct alignas(64) Shard
+	{
+		Shard()
+		{
+			clear();
+		}
+
+		void clear()
+		{
+			for (int key = 0; key < FormulaV4MetricsSnapshot::KEYS; ++key)
+			{
+				for (auto &counter : solves[key])
+				{
+					counter.store(0, std::memory_order_relaxed);
+				}
+				for (auto &counter : latency[key])
+				{
+					counter.store(0, std::memory_order_relaxed);
+				}
+				ticks[key].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		Counter solves[FormulaV4MetricsSnapshot::KEYS][FormulaV4MetricsSnapshot::STATUSES];
+		Counter latency[FormulaV4MetricsSnapshot::KEYS][FormulaV4MetricsSnapshot::BUCKETS];
+		Counter ticks[FormulaV4MetricsSnapshot::KEYS];
+		unsigned countdown = 1;			// solves until the next timed one
+		uint32_t random = 2463534242u;	// xorshift state for the gaps
+		std::atomic<bool> in_use{ false };
+	};
+
+	// every shard ever handed out; a shard outlives its thread and is reused by the next one,
+	// so its counts stay in the totals
+	struct Registry
+	{
+		std::mutex lock;
+		std::vector<std::unique_ptr<Shard>> shards;
+	};
+
+	static Registry &shards()
+	{
+		static Registry *registry = new Registry;		// never destroyed, so exiting threads can still release
+		return *registry;
+	}
+
+	// releases the thread's shard when the thread exits
+	struct Owner
+	{
+		Shard *shard = nullptr;
+
+		~Owner()
+		{
+			if (shard)
+			{
+				shard->in_use.store(false, std::memory_order_release);
+			}
+		}
+	};
+
+	static Shard &local()
+	{
+		thread_local Owner owner;
+		if (!owner.shard)
+		{
+			Registry &registry = shards();
+			std::lock_guard<std::mutex> lock(registry.lock);
+			for (auto &shard : registry.shards)
+			{
+				bool free = false;
+				if (shard->in_use.compare_exchange_strong(free, true, std::memory_order_acquire))
+				{
+					owner.shard = shard.get();
+					break;
+				}
+			}
+			if (!owner.shard)
+			{
+				registry.shards.emplace_back(new Shard);
+				owner.shard = registry.shards.back().get();
+				owner.shard->in_use.store(true, std::memory_order_relaxed);
+			}
+		}
+		return *owner.shard;
+	}
+
+	// a plain load and store: one writer, and readers only need a recent value
+	static void add(Counter &counter, uint64_t n)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	// floor(log2(ticks)), capped at the last bucket
+	static int bucket(uint64_t ticks)
+	{
+#if defined(__GNUC__)
+		const int b = ticks > 1 ? 63 - __builtin_clzll(ticks) : 0;
+#else
+		int b = 0;
+		for (uint64_t t = ticks; t > 1; t >>= 1)
+		{
+			++b;
+		}
+#endif
+		return std::min(b, FormulaV4MetricsSnapshot::BUCKETS - 1);
+	}
+#endif
+};
@@ -0,0 +1,275 @@
+// FormulaV4Parallel.h
+//
+// Multi-core batch solving: FormulaV4ThreadPool hands out chunks of a job to a
+// fixed set of threads that steal from each other when they run dry, and
+// FormulaV4Parallel splits a FormulaV4aColumns batch into cache-sized chunks
+// solved with FormulaV4Simd.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "FormulaV4Simd.h"
+
+class FormulaV4ThreadPool
+{
+public:
+	// threads counts the calling thread, which works on every job it submits
+	explicit FormulaV4ThreadPool(unsigned threads = default_threads())
+		: count_(std::max(threads, 1u)), queues_(new Queue[count_]), generation_(0), stop_(false),
+		body_(nullptr), context_(nullptr), remaining_(0)
+	{
+		try
+		{
+			for (unsigned i = 1; i < count_; ++i)
+			{
+				threads_.emplace_back(&FormulaV4ThreadPool::worker, this, i);
+			}
+		}
+		catch (...)
+		{
+			join();		// the threads that did start, which would otherwise terminate the process
+			throw;
+		}
+	}
+
+	~FormulaV4ThreadPool()
+	{
+		join();
+	}
+
+	FormulaV4ThreadPool(const FormulaV4ThreadPool&) = delete;
+	FormulaV4ThreadPool& operator=(const FormulaV4ThreadPool&) = delete;
+
+	static unsigned default_threads()
+	{
+		return std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	unsigned threads() const
+	{
+		return count_;
+	}
+
+	// call body(context, chunk) once for every chunk in [0, chunks) and return when all are done;
+	// each thread starts on its own contiguous share and steals half of a busy thread's remainder
+	void run(size_t chunks, void (*body)(void*, size_t), void *context)
+	{
+		std::lock_guard<std::mutex> one_job(run_mutex_);
+		if (chunks == 0)
+		{
+			return;
+		}
+
+		body_ = body;
+		context_ = context;
+		remaining_.store(chunks);
+		for (unsigned i = 0; i < count_; ++i)
+		{
+			std::lock_guard<std::mutex> lock(queues_[i].mutex);
+			queues_[i].begin = chunks * i / count_;
+			queues_[i].end = chunks * (i + 1) / count_;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			++generation_;
+		}
+		wake_.notify_all();
+
+		work(0);
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_.wait(lock, [this] { return remaining_.load() == 0; });
+	}
+
+	template <class F>
+	void run(size_t chunks, F &f)
+	{
+		run(chunks, [](void *context, size_t chunk) { (*static_cast<F*>(context))(chunk); }, &f);
+	}
+
+private:
+	void join()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		wake_.notify_all();
+		for (auto &thread : threads_)
+		{
+			thread.join();
+		}
+	}
+
+	// the chunks a thread still owns; others steal from the back
+	struct alignas(64) Queue
+	{
+		std::mutex mutex;
+		size_t begin = 0;
+		size_t end = 0;
+	};
+
+	bool take(unsigned self, size_t &chunk)
+	{
+		{
+			Queue &own = queues_[self];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (own.begin < own.end)
+			{
+				chunk = own.begin++;
+				return true;
+			}
+		}
+		for (unsigned i = 1; i < count_; ++i)
+		{
+			Queue &victim = queues_[(self + i) % count_];
+			size_t first, last;
+			{
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (victim.begin >= victim.end)
+				{
+					continue;
+				}
+				last = victim.end;
+				first = last - (last - victim.begin + 1) / 2;
+				victim.end = first;
+			}
+			Queue &own = queues_[self];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			own.begin = first + 1;
+			own.end = last;
+			chunk = first;
+			return true;
+		}
+		return false;
+	}
+
+	void work(unsigned self)
+	{
+		size_t chunk;
+		while (take(self, chunk))
+		{
+			body_(context_, chunk);
+			if (remaining_.fetch_sub(1) == 1)
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				done_.notify_all();
+			}
+		}
+	}
+
+	void worker(unsigned self)
+	{
+		unsigned long seen = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+				if (stop_)
+				{
+					return;
+				}
+				seen = generation_;
+			}
+			work(self);
+		}
+	}
+
+	unsigned count_;
+	std::unique_ptr<Queue[]> queues_;
+	std::vector<std::thread> threads_;
+
+	std::mutex run_mutex_;				// one job at a time
+	std::mutex mutex_;					// guards generation_ and stop_
+	std::condition_variable wake_;
+	std::condition_variable done_;
+	unsigned long generation_;
+	bool stop_;
+
+	void (*body_)(void*, size_t);
+	void *context_;
+	std::atomic<size_t> remaining_;
+};
+
+class FormulaV4Parallel
+{
+public:
+	// 4096 rows of five doubles plus presence are ~164KB, which keeps a chunk in L2
+	static const size_t CHUNK_ROWS = 4096;
+
+	// solve every row of a columnar batch across the pool. Each chunk writes only its own
+	// rows, so results do not depend on the thread count or on scheduling. If a row fails,
+	// the other chunks are still solved and the error of the lowest failing chunk is
+	// rethrown, which is the first error a serial FormulaV4Simd::calculate would hit.
+	static void calculate(FormulaV4aColumns &columns, FormulaV4ThreadPool &pool, size_t chunk_rows = CHUNK_ROWS)
+	{
+		chunk_rows = std::max<size_t>(chunk_rows, 1);
+		const size_t chunks = (columns.rows + chunk_rows - 1) / chunk_rows;
+
+		std::mutex error_mutex;
+		size_t error_chunk = chunks;
+		std::exception_ptr error;
+
+		auto solve_chunk = [&](size_t chunk)
+		{
+			const size_t first = chunk * chunk_rows;
+			const size_t last = std::min(first + chunk_rows, columns.rows);
+			try
+			{
+				FormulaV4Simd::calculate(columns, first, last);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (chunk < error_chunk)
+				{
+					error_chunk = chunk;
+					error = std::current_exception();
+				}
+			}
+		};
+		pool.run(chunks, solve_chunk);
+
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+
+	// non-throwing variant: every row is attempted and gets its status in columns.status; chunks
+	// are sorted by unknowns first (FormulaV4Simd::solve_partitioned), so row order does not matter
+	static void solve(FormulaV4aColumns &columns, FormulaV4ThreadPool &pool, size_t chunk_rows = CHUNK_ROWS)
+	{
+		chunk_rows = std::max<size_t>(chunk_rows, 1);
+		const size_t chunks = (columns.rows + chunk_rows - 1) / chunk_rows;
+
+		auto solve_chunk = [&](size_t chunk)
+		{
+			const size_t first = chunk * chunk_rows;
+			FormulaV4Simd::solve_partitioned(columns, first, std::min(first + chunk_rows, columns.rows));
+		};
+		pool.run(chunks, solve_chunk);
+	}
+
+	// solve() through a cache shared by the pool's threads, such as a FormulaV4ConcurrentCache
+	template <class Cache>
+	static void solve(FormulaV4aColumns &columns, FormulaV4ThreadPool &pool, Cache &cache, size_t chunk_rows = CHUNK_ROWS)
+	{
+		chunk_rows = std::max<size_t>(chunk_rows, 1);
+		const size_t chunks = (columns.rows + chunk_rows - 1) / chunk_rows;
+
+		auto solve_chunk = [&](size_t chunk)
+		{
+			const size_t first = chunk * chunk_rows;
+			cache.solve(columns, first, std::min(first + chunk_rows, columns.rows));
+		};
+		pool.run(chunks, solve_chunk);
+	}
+};
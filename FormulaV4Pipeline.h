@@ -0,0 +1,492 @@
+// FormulaV4Pipeline.h
+//
+// CSV/TSV solving as four stages on their own threads, so reading, parsing,
+// solving and writing overlap instead of taking turns:
+//
+//   read     one thread cuts the input into chunks of whole lines
+//   parse    parses a chunk's lines into its FormulaV4Batch
+//   solve    runs the partitioned vector kernels over the batch
+//   write    formats the batch, then writes it out in input order
+//
+// Stages hand chunks to each other through FormulaV4Queue, and a fixed set
+// of chunks goes round and round: the writer returns each one to the reader
+// once it is written, so nothing is allocated once every chunk has been
+// used, and the reader waits for a chunk when the stages after it fall
+// behind. Parse, solve and write can each have several threads. The output
+// is the same as FormulaV4CsvReader and FormulaV4CsvWriter produce. The
+// time each stage spends working and waiting for input, and the time the
+// reader waits for a free chunk, are kept to show which stage limits the
+// throughput.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FormulaV4Csv.h"
+#include "FormulaV4Queue.h"
+#include "FormulaV4Simd.h"
+
+struct FormulaV4PipelineOptions
+{
+	unsigned parse_threads = 1;
+	unsigned solve_threads = 1;
+	unsigned write_threads = 1;			// format in parallel; the output is still written in order
+	size_t chunk_rows = 1 << 14;		// lines per chunk
+	size_t chunks = 0;					// in flight at once; 0 for two per thread and two more
+	char delimiter = 0;					// 0 picks tab if the first line has one, comma otherwise
+	bool header = true;					// false if the first line is a row even when it does not parse
+};
+
+class FormulaV4Pipeline
+{
+public:
+	typedef FormulaV4PipelineOptions Options;
+
+	enum Stage { read, parse, solve, write, STAGES };
+
+	struct StageReport
+	{
+		const char *name;
+		unsigned threads;
+		double busy;				// seconds working, summed over the stage's threads
+		double idle;				// seconds waiting for a chunk from the stage before
+		double blocked;				// seconds the reader waited for a free chunk
+
+		// share of the stage's thread time spent working over seconds of wall time
+		double utilization(double seconds) const
+		{
+			return seconds > 0 ? busy / (seconds * threads) : 0;
+		}
+	};
+
+	// the chunk batches come from arena when one is given
+	explicit FormulaV4Pipeline(Options options = Options(), FormulaV4Arena *arena = nullptr)
+		: options_(options), buffer_(FormulaV4CsvReader::BUFFER_BYTES), begin_(0), end_(0), eof_(false),
+		overlong_(false), delimiter_(options.delimiter), rows_(0), bytes_in_(0), bytes_out_(0), seconds_(0),
+		failed_(false), next_write_(0), committing_(false), stages_left_{}, busy_{}, idle_{}, blocked_{}
+	{
+		options_.parse_threads = std::max(options_.parse_threads, 1u);
+		options_.solve_threads = std::max(options_.solve_threads, 1u);
+		options_.write_threads = std::max(options_.write_threads, 1u);
+		options_.chunk_rows = std::max<size_t>(options_.chunk_rows, 1);
+		if (options_.chunks == 0)
+		{
+			options_.chunks = 2 * (options_.parse_threads + options_.solve_threads + options_.write_threads) + 2;
+		}
+		for (size_t i = 0; i < options_.chunks; ++i)
+		{
+			chunks_.emplace_back(new Chunk(options_.chunk_rows, arena));
+		}
+		ready_ = std::vector<std::atomic<Chunk*>>(options_.chunks);
+	}
+
+	FormulaV4Pipeline(const FormulaV4Pipeline&) = delete;
+	FormulaV4Pipeline& operator=(const FormulaV4Pipeline&) = delete;
+
+	// solve every row of the next bytes of in and write it to out, after the header line if in
+	// has one; returns false if out could not be written. The calling thread is the reader.
+	bool run(FILE *in, FILE *out, uint64_t bytes = UINT64_MAX)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		in_ = in;
+		out_ = out;
+		limit_ = bytes;
+		begin_ = end_ = 0;
+		eof_ = overlong_ = false;
+		rows_ = bytes_in_ = bytes_out_ = 0;
+		failed_.store(false);
+		next_write_.store(0);
+		for (auto &slot : ready_)
+		{
+			slot.store(nullptr);
+		}
+		for (int stage = 0; stage < STAGES; ++stage)
+		{
+			busy_[stage].store(0);
+			idle_[stage].store(0);
+			blocked_[stage].store(0);
+		}
+
+		FormulaV4Queue<Chunk*> free(options_.chunks), parsing(options_.chunks), solving(options_.chunks),
+			writing(options_.chunks);
+		for (auto &chunk : chunks_)
+		{
+			free.push(chunk.get());
+		}
+		header(out);
+
+		stages_left_[parse].store(options_.parse_threads);
+		stages_left_[solve].store(options_.solve_threads);
+		std::vector<std::thread> threads;
+		try
+		{
+			for (unsigned t = 0; t < options_.parse_threads; ++t)
+			{
+				threads.emplace_back([&] { work(parse, parsing, solving, [&](Chunk &chunk) { parse_chunk(chunk); }); });
+			}
+			for (unsigned t = 0; t < options_.solve_threads; ++t)
+			{
+				threads.emplace_back([&] { work(solve, solving, writing, [&](Chunk &chunk) { solve_chunk(chunk); }); });
+			}
+			for (unsigned t = 0; t < options_.write_threads; ++t)
+			{
+				threads.emplace_back([&] { write_chunks(writing, free); });
+			}
+		}
+		catch (...)
+		{
+			// nothing has been read yet: with every queue closed, the threads that did start find
+			// nothing to do and end, and can be joined before the error goes on
+			parsing.close();
+			solving.close();
+			writing.close();
+			for (auto &thread : threads)
+			{
+				thread.join();
+			}
+			throw;
+		}
+
+		// read on this thread
+		for (uint64_t sequence = 0; ; ++sequence)
+		{
+			Chunk *chunk = nullptr;
+			timed(blocked_[read], [&] { free.pop(chunk); });
+			const bool more = timed(busy_[read], [&] { return cut(*chunk); });
+			if (!more)
+			{
+				break;
+			}
+			chunk->sequence = sequence;
+			parsing.push(chunk);
+		}
+		parsing.close();
+		for (auto &thread : threads)
+		{
+			thread.join();
+		}
+		if (std::fflush(out) != 0)
+		{
+			failed_.store(true);
+		}
+		seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return !failed_.load();
+	}
+
+	// rows written by the last run()
+	size_t rows() const
+	{
+		return rows_;
+	}
+
+	size_t bytes_in() const
+	{
+		return bytes_in_;
+	}
+
+	size_t bytes_out() const
+	{
+		return bytes_out_;
+	}
+
+	// wall time of the last run()
+	double seconds() const
+	{
+		return seconds_;
+	}
+
+	StageReport report(Stage stage) const
+	{
+		static const char *const names[STAGES] = { "read", "parse", "solve", "write" };
+		const unsigned threads[STAGES] = { 1, options_.parse_threads, options_.solve_threads, options_.write_threads };
+		StageReport report = { names[stage], threads[stage], busy_[stage].load() / 1e9, idle_[stage].load() / 1e9,
+			blocked_[stage].load() / 1e9 };
+		return report;
+	}
+
+	// "read 1x 12%, parse 1x 80%, ..." utilization of each stage over the last run()
+	std::string summary() const
+	{
+		std::string text;
+		for (int stage = 0; stage < STAGES; ++stage)
+		{
+			const StageReport r = report(static_cast<Stage>(stage));
+			char line[64];
+			std::snprintf(line, sizeof(line), "%s%s %ux %.0f%%", stage ? ", " : "", r.name, r.threads,
+				100 * r.utilization(seconds_));
+			text += line;
+		}
+		return text;
+	}
+
+private:
+	struct Chunk
+	{
+		Chunk(size_t rows, FormulaV4Arena *arena): sequence(0), batch(rows, arena), invalid(rows)
+		{
+		}
+
+		uint64_t sequence;				// position in the input
+		std::vector<char> text;			// whole lines, each ending in a newline
+		FormulaV4Batch batch;
+		std::vector<unsigned char> invalid;
+		std::vector<char> out;			// the formatted lines
+	};
+
+	// f() with its time added to total
+	template <class F>
+	static auto timed(std::atomic<uint64_t> &total, F f) -> decltype(f())
+	{
+		struct Add
+		{
+			std::atomic<uint64_t> &total;
+			std::chrono::steady_clock::time_point start;
+
+			~Add()
+			{
+				total.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start).count()), std::memory_order_relaxed);
+			}
+		} add = { total, std::chrono::steady_clock::now() };
+		return f();
+	}
+
+	// a parse or solve thread: step each chunk from in and pass it on to out; the stage's
+	// last thread to finish closes out
+	template <class Step>
+	void work(Stage stage, FormulaV4Queue<Chunk*> &in, FormulaV4Queue<Chunk*> &out, Step step)
+	{
+		Chunk *chunk;
+		while (timed(idle_[stage], [&] { return in.pop(chunk); }))
+		{
+			timed(busy_[stage], [&] { step(*chunk); });
+			out.push(chunk);
+		}
+		if (stages_left_[stage].fetch_sub(1) == 1)
+		{
+			out.close();
+		}
+	}
+
+	void parse_chunk(Chunk &chunk)
+	{
+		FormulaV4TraceSpan span("parse");
+		chunk.batch.rows = 0;
+		parser_.parse(chunk.text.data(), chunk.text.data() + chunk.text.size(), chunk.batch, chunk.invalid.data());
+	}
+
+	void solve_chunk(Chunk &chunk)
+	{
+		FormulaV4aColumns columns = chunk.batch.view();
+		FormulaV4Simd::solve_partitioned(columns);
+		FormulaV4CsvParser::mark_invalid(chunk.batch, chunk.invalid.data());
+	}
+
+	// a write thread: format each chunk, wait for the chunks before it to be written, write it
+	void write_chunks(FormulaV4Queue<Chunk*> &in, FormulaV4Queue<Chunk*> &free)
+	{
+		Chunk *chunk;
+		while (timed(idle_[write], [&] { return in.pop(chunk); }))
+		{
+			const FormulaV4aColumns columns = chunk->batch.view();
+			timed(busy_[write], [&]
+			{
+				FormulaV4TraceSpan span("format");
+				const size_t most = columns.rows * FormulaV4CsvWriter::MAX_LINE;
+				if (chunk->out.size() < most)
+				{
+					chunk->out.resize(most);
+				}
+				const char *end = FormulaV4CsvWriter::format(chunk->out.data(), columns, 0, columns.rows, delimiter_);
+				chunk->out.resize(end - chunk->out.data());
+			});
+			timed(busy_[write], [&] { commit(chunk, free); });
+		}
+	}
+
+	// make a formatted chunk ready, then write every ready chunk that is next in input order.
+	// One write thread at a time does the writing; a thread that finds another at it leaves its
+	// chunk behind rather than waiting, since the chunk being waited for may still need a write
+	// thread to format it.
+	void commit(Chunk *chunk, FormulaV4Queue<Chunk*> &free)
+	{
+		ready_[chunk->sequence % ready_.size()].store(chunk);
+		for (;;)
+		{
+			bool idle = false;
+			if (!committing_.compare_exchange_strong(idle, true))
+			{
+				return;
+			}
+			uint64_t next = next_write_.load(std::memory_order_relaxed);
+			for (Chunk *c; (c = ready_[next % ready_.size()].load()) != nullptr && c->sequence == next; ++next)
+			{
+				FormulaV4TraceSpan span("write");
+				ready_[next % ready_.size()].store(nullptr);
+				if (!c->out.empty() && std::fwrite(c->out.data(), 1, c->out.size(), out_) != c->out.size())
+				{
+					failed_.store(true);
+				}
+				bytes_out_ += c->out.size();
+				rows_ += c->batch.rows;
+				next_write_.store(next + 1, std::memory_order_relaxed);
+				free.push(c);
+			}
+			committing_.store(false);
+
+			// a chunk made ready after the loop looked, by a thread that found this one writing
+			Chunk *c = ready_[next % ready_.size()].load();
+			if (c == nullptr || c->sequence != next)
+			{
+				return;
+			}
+		}
+	}
+
+	// settle the delimiter from the first line that is not blank, and write the header if that
+	// line is one rather than a row
+	void header(FILE *out)
+	{
+		for (;;)
+		{
+			const char *line = buffer_.data() + begin_;
+			const char *stop = static_cast<const char*>(std::memchr(line, '\n', end_ - begin_));
+			if (!stop && !eof_ && !overlong_)
+			{
+				fill();
+				continue;
+			}
+			if (!stop)
+			{
+				stop = buffer_.data() + end_;
+			}
+			const char *first = line;
+			const char *last = stop;
+			if (overlong_ || (begin_ == end_ && eof_) || FormulaV4CsvParser::trim(first, last))
+			{
+				if (!delimiter_)
+				{
+					delimiter_ = !overlong_ && std::memchr(first, '\t', last - first) ? '\t' : ',';
+				}
+				parser_ = FormulaV4CsvParser(delimiter_);
+				FormulaV4Batch &scratch = chunks_[0]->batch;
+				if (options_.header && !overlong_ && first != last && !parser_.parse_row(first, last, scratch, 0))
+				{
+					const std::string text = std::string(first, last) + delimiter_ + "status\n";
+					if (std::fwrite(text.data(), 1, text.size(), out) != text.size())
+					{
+						failed_.store(true);
+					}
+					bytes_out_ += text.size();
+					begin_ = std::min<size_t>(stop - buffer_.data() + 1, end_);
+				}
+				return;
+			}
+			begin_ = std::min<size_t>(stop - buffer_.data() + 1, end_);		// a blank line
+		}
+	}
+
+	// up to chunk_rows whole lines of input into chunk.text; false once the input is used up.
+	// A line longer than the read buffer becomes "#", which parses as one invalid row.
+	bool cut(Chunk &chunk)
+	{
+		FormulaV4TraceSpan span("read");
+		chunk.text.clear();
+		size_t lines = 0;
+		const char *data = buffer_.data();
+		size_t run = begin_;			// lines taken but not yet copied are [run, begin_)
+		while (lines < options_.chunk_rows)
+		{
+			const char *line = data + begin_;
+			const char *stop = static_cast<const char*>(std::memchr(line, '\n', end_ - begin_));
+			if (!stop)
+			{
+				if (!eof_)
+				{
+					chunk.text.insert(chunk.text.end(), data + run, line);
+					fill();
+					run = begin_;
+					continue;
+				}
+				if (begin_ == end_ && !overlong_)
+				{
+					break;
+				}
+				stop = data + end_;	// last line without a newline
+			}
+			if (overlong_)
+			{
+				overlong_ = false;
+				chunk.text.insert(chunk.text.end(), data + run, line);
+				chunk.text.push_back('#');
+				chunk.text.push_back('\n');
+				begin_ = std::min<size_t>(stop - data + 1, end_);
+				run = begin_;
+			}
+			else if (stop == data + end_)
+			{
+				chunk.text.insert(chunk.text.end(), data + run, stop);
+				chunk.text.push_back('\n');
+				begin_ = run = end_;
+			}
+			else
+			{
+				begin_ = stop - data + 1;
+			}
+			++lines;
+		}
+		chunk.text.insert(chunk.text.end(), data + run, data + begin_);
+		return lines != 0;
+	}
+
+	// as FormulaV4CsvReader::fill()
+	void fill()
+	{
+		if (begin_ == 0 && end_ == buffer_.size())
+		{
+			overlong_ = true;
+			end_ = 0;
+		}
+		std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+		end_ -= begin_;
+		begin_ = 0;
+		const size_t n = std::fread(buffer_.data() + end_, 1,
+			static_cast<size_t>(std::min<uint64_t>(buffer_.size() - end_, limit_ - bytes_in_)), in_);
+		end_ += n;
+		bytes_in_ += n;
+		eof_ = n == 0;
+	}
+
+	Options options_;
+	std::vector<std::unique_ptr<Chunk>> chunks_;
+	FILE *in_;
+	FILE *out_;
+	uint64_t limit_;				// bytes of in_ to read
+
+	// the reader's
+	std::vector<char> buffer_;
+	size_t begin_;					// unread data is [begin_, end_)
+	size_t end_;
+	bool eof_;
+	bool overlong_;
+	char delimiter_;
+	FormulaV4CsvParser parser_;
+
+	size_t rows_;					// written by the committing write thread
+	size_t bytes_in_;
+	size_t bytes_out_;
+	double seconds_;
+	std::atomic<bool> failed_;
+	std::vector<std::atomic<Chunk*>> ready_;	// formatted chunks by sequence, as no more than chunks are in flight
+	std::atomic<uint64_t> next_write_;		// sequence of the chunk to write next
+	std::atomic<bool> committing_;			// a write thread is writing
+	std::atomic<unsigned> stages_left_[STAGES];
+	std::atomic<uint64_t> busy_[STAGES];
+	std::atomic<uint64_t> idle_[STAGES];
+	std::atomic<uint64_t> blocked_[STAGES];
+};
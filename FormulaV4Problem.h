@@ -0,0 +1,113 @@
+// FormulaV4Problem.h
+//
+// FormulaV4Problem is one problem as plain data: the five values in ValueId
+// order, a presence mask and the outcome of the last solve, in 48 bytes. It
+// is trivially copyable, so problems can be kept by the million in a vector,
+// memcpy'd, or mapped from a file.
+//
+// FormulaV4ProblemSolver holds no state. solve() is const, takes its problem
+// by reference and only touches that problem, so one solver can be shared by
+// any number of threads without locking. It runs the FormulaV4a formulas,
+// through the same table FormulaV4a dispatches with.
+#pragma once
+#include <cstddef>
+#include <type_traits>
+#include "FormulaV4a.h"
+
+struct FormulaV4Problem
+{
+	double values[VARIABLES];		// in ValueId order; blank values are ignored
+	unsigned char presence;			// bit N on when ValueId N is known
+	FormulaV4Status status;			// of the last solve
+
+	void set(ValueId id, double value)
+	{
+		values[static_cast<int>(id)] = value;
+		presence = static_cast<unsigned char>(presence | (1u << static_cast<int>(id)));
+	}
+
+	double get(ValueId id) const
+	{
+		return values[static_cast<int>(id)];
+	}
+
+	bool is_blank(ValueId id) const
+	{
+		return !(presence & (1u << static_cast<int>(id)));
+	}
+};
+
+static_assert(std::is_trivially_copyable<FormulaV4Problem>::value, "FormulaV4Problem must stay plain data");
+static_assert(std::is_standard_layout<FormulaV4Problem>::value, "FormulaV4Problem must stay plain data");
+static_assert(sizeof(FormulaV4Problem) <= 48, "FormulaV4Problem must fit in 48 bytes");
+
+class FormulaV4ProblemSolver
+{
+public:
+	// fills in the two blank values and marks them present; on failure the problem's
+	// values and presence are unchanged. The status is also stored in problem.status.
+	FormulaV4Status solve(FormulaV4Problem &problem) const noexcept
+	{
+		const uint64_t start = FormulaV4Metrics::start();
+		const unsigned key = ~problem.presence & ALL_PRESENT;
+		auto formula = FormulaV4a::formula<Record>(key);
+		FormulaV4Status status = unknowns_status(key);
+		if (formula != nullptr)
+		{
+			Record record(problem.values);
+			status = check_status(formula(record));
+			if (status == FormulaV4Status::ok)
+			{
+				problem.presence = ALL_PRESENT;
+			}
+		}
+		problem.status = status;
+		FormulaV4Metrics::record(key, status, start);
+		return status;
+	}
+
+	// solve count problems stored contiguously
+	void solve(FormulaV4Problem *problems, size_t count) const noexcept
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			solve(problems[i]);
+		}
+	}
+
+private:
+	// the problem's values with the accessors the formulas use
+	struct Record
+	{
+		explicit Record(double *values): values_(values)
+		{
+		}
+
+		double& distance()
+		{
+			return values_[static_cast<int>(ValueId::distance)];
+		}
+
+		double& time()
+		{
+			return values_[static_cast<int>(ValueId::time)];
+		}
+
+		double& initial_velocity()
+		{
+			return values_[static_cast<int>(ValueId::initial_velocity)];
+		}
+
+		double& final_velocity()
+		{
+			return values_[static_cast<int>(ValueId::final_velocity)];
+		}
+
+		double& acceleration()
+		{
+			return values_[static_cast<int>(ValueId::acceleration)];
+		}
+
+		double *values_;
+	};
+};
@@ -0,0 +1,168 @@
+// FormulaV4Queue.h
+//
+// Bounded lock-free MPMC queue of small values (pointers, indices), for
+// handing buffers between the threads of FormulaV4Pipeline.h. Every cell
+// carries a sequence number, as in FormulaV4Ring.h: a producer claims a
+// position with a compare-and-swap on the tail and publishes the cell by
+// advancing its sequence, and a consumer does the same on the head.
+// Neither side ever takes a lock; a thread that has to wait backs off with
+// FormulaV4Backoff.
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sched.h>
+#include <time.h>
+
+// spin, then yield, then sleep 50 us at a time
+class FormulaV4Backoff
+{
+public:
+	FormulaV4Backoff(): spins_(0)
+	{
+	}
+
+	void wait()
+	{
+		if (++spins_ < 64)
+		{
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#endif
+		}
+		else if (spins_ < 1024)
+		{
+			::sched_yield();
+		}
+		else
+		{
+			const timespec pause = { 0, 50000 };
+			::nanosleep(&pause, nullptr);
+		}
+	}
+
+	void reset()
+	{
+		spins_ = 0;
+	}
+
+private:
+	unsigned spins_;
+};
+
+template <class T>
+class FormulaV4Queue
+{
+public:
+	// room for capacity values, rounded up to a power of two
+	explicit FormulaV4Queue(size_t capacity): closed_(false), head_(0), tail_(0)
+	{
+		size_t rounded = 2;
+		while (rounded < capacity)
+		{
+			rounded *= 2;
+		}
+		cells_ = std::vector<Cell>(rounded);
+		for (size_t i = 0; i < rounded; ++i)
+		{
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	FormulaV4Queue(const FormulaV4Queue&) = delete;
+	FormulaV4Queue& operator=(const FormulaV4Queue&) = delete;
+
+	// false if the queue is full
+	bool try_push(T value)
+	{
+		size_t position = tail_.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Cell &cell = cells_[position & (cells_.size() - 1)];
+			const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			const intptr_t lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+			if (lag == 0 && tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+			{
+				cell.value = value;
+				cell.sequence.store(position + 1, std::memory_order_release);
+				return true;
+			}
+			if (lag < 0)
+			{
+				return false;
+			}
+			if (lag > 0)
+			{
+				position = tail_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// false if the queue is empty
+	bool try_pop(T &value)
+	{
+		size_t position = head_.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Cell &cell = cells_[position & (cells_.size() - 1)];
+			const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			const intptr_t lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+			if (lag == 0 && head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+			{
+				value = cell.value;
+				cell.sequence.store(position + cells_.size(), std::memory_order_release);
+				return true;
+			}
+			if (lag < 0)
+			{
+				return false;
+			}
+			if (lag > 0)
+			{
+				position = head_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// wait for room
+	void push(T value)
+	{
+		for (FormulaV4Backoff backoff; !try_push(value); )
+		{
+			backoff.wait();
+		}
+	}
+
+	// wait for a value; false once the queue is closed and empty
+	bool pop(T &value)
+	{
+		for (FormulaV4Backoff backoff; !try_pop(value); )
+		{
+			if (closed_.load(std::memory_order_acquire))
+			{
+				return try_pop(value);		// a value pushed just before close()
+			}
+			backoff.wait();
+		}
+		return true;
+	}
+
+	// no more values will be pushed
+	void close()
+	{
+		closed_.store(true, std::memory_order_release);
+	}
+
+private:
+	struct alignas(64) Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::vector<Cell> cells_;
+	std::atomic<bool> closed_;
+	alignas(64) std::atomic<size_t> head_;		// next position to pop
+	alignas(64) std::atomic<size_t> tail_;		// next position to push
+};
@@ -0,0 +1,364 @@
+// FormulaV4Ring.h
+//
+// Lock-free ring of FormulaV4Problem records in POSIX shared memory, for
+// producers on the same host as the solver. A producer writes a problem
+// straight into a slot, a solver solves it in that slot, and the producer
+// reads the answer back from it: no copy into a socket, no serialization.
+//
+// Every slot carries a sequence number that says whose turn it is. For the
+// slot at position p (slot p % slots):
+//   p                 free, for the producer that claims position p
+//   p + 1             submitted, for a solver
+//   p + 2             solved, for the producer that submitted it
+//   p + slots         collected, free for position p + slots
+// Producers claim positions from head and solvers from tail. With
+// Sharing::multiple on a side, its threads and processes claim with a
+// compare-and-swap (MPMC); with Sharing::single they use a plain store
+// (SPSC). Waiting spins, then yields, then sleeps briefly (FormulaV4Backoff),
+// so an idle solver costs little and a busy one never enters the kernel.
+// POSIX only; older glibc needs -lrt for shm_open.
+//
+//   FormulaV4Ring ring("/formulav4", 4096);			// solver process: create,
+//   ring.serve(stop);									// and solve until stop
+//
+//   FormulaV4RingProducer producer("/formulav4");		// producer process
+//   producer.solve(problems.data(), problems.size());
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "FormulaV4Problem.h"
+#include "FormulaV4Queue.h"
+#include "FormulaV4Wire.h"
+
+struct alignas(64) FormulaV4RingSlot
+{
+	std::atomic<uint64_t> sequence;
+	FormulaV4Problem problem;
+};
+
+struct FormulaV4RingHeader
+{
+	static const uint32_t VERSION = 1;
+
+	char magic[8];						// "FV4RING" and a zero
+	uint32_t version;
+	uint32_t byte_order;				// FormulaV4FileHeader's mark, as written by the creator
+	uint64_t slots;						// a power of two
+	uint32_t shared_producers;			// Sharing::multiple on that side
+	uint32_t shared_solvers;
+	std::atomic<uint32_t> ready;		// set last by the creator
+	alignas(64) std::atomic<uint64_t> head;		// next position for a producer
+	alignas(64) std::atomic<uint64_t> tail;		// next position for a solver
+};
+
+static_assert(sizeof(FormulaV4RingSlot) == 64, "a ring slot is one cache line");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring atomics must work across processes");
+
+class FormulaV4Ring
+{
+public:
+	static const size_t SLOTS = 1 << 12;
+	static const size_t SOLVE_RUN = 64;			// most problems a solver claims at once
+
+	enum class Sharing { single, multiple };
+
+	// create the segment name ("/something") with slots rounded up to a power of two; fails if
+	// it exists. The segment is removed again when this ring is destroyed.
+	FormulaV4Ring(const std::string &name, size_t slots, Sharing producers = Sharing::multiple,
+		Sharing solvers = Sharing::single)
+		: name_(name), owner_(true)
+	{
+		size_t rounded = 4;
+		while (rounded < slots)
+		{
+			rounded *= 2;
+		}
+		const int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0)
+		{
+			FormulaV4Wire::fail("cannot create the ring " + name);
+		}
+		bytes_ = sizeof(FormulaV4RingHeader) + rounded * sizeof(FormulaV4RingSlot);
+		if (::ftruncate(fd, static_cast<off_t>(bytes_)) != 0)
+		{
+			const int error = errno;
+			::close(fd);
+			::shm_unlink(name.c_str());
+			errno = error;
+			FormulaV4Wire::fail("cannot size the ring " + name);
+		}
+		map(fd);
+
+		// the new pages are zero, so only what is not zero is written before ready
+		std::memcpy(header_->magic, "FV4RING", 8);
+		header_->version = FormulaV4RingHeader::VERSION;
+		header_->byte_order = BYTE_ORDER_MARK;
+		header_->slots = rounded;
+		header_->shared_producers = producers == Sharing::multiple;
+		header_->shared_solvers = solvers == Sharing::multiple;
+		for (uint64_t p = 0; p < rounded; ++p)
+		{
+			slots_[p].sequence.store(p, std::memory_order_relaxed);
+		}
+		header_->ready.store(1, std::memory_order_release);
+	}
+
+	// open the segment name made by another process
+	explicit FormulaV4Ring(const std::string &name): name_(name), owner_(false)
+	{
+		const int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+		if (fd < 0)
+		{
+			FormulaV4Wire::fail("cannot open the ring " + name);
+		}
+		struct stat info;
+		if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(FormulaV4RingHeader))
+		{
+			::close(fd);
+			throw FormulaV4WireException("Error: " + name + " is not a V4 ring.");
+		}
+		bytes_ = static_cast<size_t>(info.st_size);
+		map(fd);
+		if (std::memcmp(header_->magic, "FV4RING", 8) != 0 || header_->ready.load(std::memory_order_acquire) != 1 ||
+			header_->version != FormulaV4RingHeader::VERSION || header_->byte_order != BYTE_ORDER_MARK)
+		{
+			::munmap(header_, bytes_);
+			throw FormulaV4WireException("Error: " + name + " is not a V4 ring of version " +
+				std::to_string(FormulaV4RingHeader::VERSION) + " in this byte order.");
+		}
+		// positions are masked with slots - 1, so anything but a power of two that fits is corrupt
+		const uint64_t slots = header_->slots;
+		if (slots == 0 || (slots & (slots - 1)) != 0 ||
+			slots > (bytes_ - sizeof(FormulaV4RingHeader)) / sizeof(FormulaV4RingSlot))
+		{
+			::munmap(header_, bytes_);
+			throw FormulaV4WireException("Error: " + name + " has a corrupt slot count of " + std::to_string(slots) +
+				".");
+		}
+	}
+
+	~FormulaV4Ring()
+	{
+		::munmap(header_, bytes_);
+		if (owner_)
+		{
+			::shm_unlink(name_.c_str());
+		}
+	}
+
+	FormulaV4Ring(const FormulaV4Ring&) = delete;
+	FormulaV4Ring& operator=(const FormulaV4Ring&) = delete;
+
+	size_t slots() const
+	{
+		return header_->slots;
+	}
+
+	// producer: copy problem into a free slot and submit it; false if the ring is full.
+	// ticket is what collect() takes back.
+	bool try_submit(const FormulaV4Problem &problem, uint64_t &ticket)
+	{
+		uint64_t position = header_->head.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			FormulaV4RingSlot &slot = slots_[position & (header_->slots - 1)];
+			const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence != position)
+			{
+				if (static_cast<int64_t>(sequence - position) < 0)
+				{
+					return false;			// the slot's last problem is still out
+				}
+				position = header_->head.load(std::memory_order_relaxed);
+				continue;					// another producer took the position
+			}
+			if (!claim(header_->head, position, header_->shared_producers))
+			{
+				continue;
+			}
+			slot.problem = problem;
+			slot.sequence.store(position + 1, std::memory_order_release);
+			ticket = position;
+			return true;
+		}
+	}
+
+	uint64_t submit(const FormulaV4Problem &problem)
+	{
+		uint64_t ticket;
+		for (FormulaV4Backoff backoff; !try_submit(problem, ticket); )
+		{
+			backoff.wait();
+		}
+		return ticket;
+	}
+
+	// producer: the solved problem of ticket into problem, freeing its slot; false if not solved yet
+	bool try_collect(uint64_t ticket, FormulaV4Problem &problem)
+	{
+		FormulaV4RingSlot &slot = slots_[ticket & (header_->slots - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != ticket + 2)
+		{
+			return false;
+		}
+		problem = slot.problem;
+		slot.sequence.store(ticket + header_->slots, std::memory_order_release);
+		return true;
+	}
+
+	void collect(uint64_t ticket, FormulaV4Problem &problem)
+	{
+		for (FormulaV4Backoff backoff; !try_collect(ticket, problem); )
+		{
+			backoff.wait();
+		}
+	}
+
+	// solver: solve up to SOLVE_RUN submitted problems in their slots; returns how many
+	size_t solve(const FormulaV4ProblemSolver &solver)
+	{
+		uint64_t position = header_->tail.load(std::memory_order_relaxed);
+		size_t run = 0;
+		for (;;)
+		{
+			run = 0;
+			while (run < SOLVE_RUN &&
+				slots_[(position + run) & (header_->slots - 1)].sequence.load(std::memory_order_acquire) == position + run + 1)
+			{
+				++run;
+			}
+			if (run == 0)
+			{
+				return 0;
+			}
+			if (claim(header_->tail, position, header_->shared_solvers, run))
+			{
+				break;
+			}
+		}
+		for (size_t i = 0; i < run; ++i)
+		{
+			FormulaV4RingSlot &slot = slots_[(position + i) & (header_->slots - 1)];
+			solver.solve(slot.problem);
+			slot.sequence.store(position + i + 2, std::memory_order_release);
+		}
+		return run;
+	}
+
+	// solver: solve until stop is set
+	void serve(const std::atomic<bool> &stop)
+	{
+		const FormulaV4ProblemSolver solver;
+		for (FormulaV4Backoff backoff; !stop.load(std::memory_order_relaxed); )
+		{
+			if (solve(solver) != 0)
+			{
+				backoff.reset();
+			}
+			else
+			{
+				backoff.wait();
+			}
+		}
+	}
+
+private:
+	static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+	// move counter from position to position + count; on failure position is the counter's value
+	static bool claim(std::atomic<uint64_t> &counter, uint64_t &position, uint32_t shared, uint64_t count = 1)
+	{
+		if (!shared)
+		{
+			counter.store(position + count, std::memory_order_relaxed);
+			return true;
+		}
+		return counter.compare_exchange_weak(position, position + count, std::memory_order_relaxed);
+	}
+
+	void map(int fd)
+	{
+		void *base = ::mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		const int error = errno;
+		::close(fd);
+		if (base == MAP_FAILED)
+		{
+			if (owner_)
+			{
+				::shm_unlink(name_.c_str());
+			}
+			errno = error;
+			FormulaV4Wire::fail("cannot map the ring " + name_);
+		}
+		header_ = static_cast<FormulaV4RingHeader*>(base);
+		slots_ = reinterpret_cast<FormulaV4RingSlot*>(static_cast<char*>(base) + sizeof(FormulaV4RingHeader));
+	}
+
+	std::string name_;
+	bool owner_;
+	size_t bytes_;
+	FormulaV4RingHeader *header_;
+	FormulaV4RingSlot *slots_;
+};
+
+// producer side of a ring made by a solver process
+class FormulaV4RingProducer
+{
+public:
+	static const size_t WINDOW = 256;
+
+	explicit FormulaV4RingProducer(const std::string &name): ring_(name)
+	{
+	}
+
+	FormulaV4Status solve(FormulaV4Problem &problem)
+	{
+		ring_.collect(ring_.submit(problem), problem);
+		return problem.status;
+	}
+
+	// solve count problems in place, keeping up to window of them in the ring at once. When the
+	// ring is full this producer collects its oldest problem before submitting more, since the
+	// slot it is waiting for may be one of its own.
+	void solve(FormulaV4Problem *problems, size_t count, size_t window = WINDOW)
+	{
+		uint64_t tickets[WINDOW];
+		window = std::max<size_t>(std::min(window, size_t(WINDOW)), 1);
+		size_t submitted = 0;
+		size_t collected = 0;
+		for (FormulaV4Backoff backoff; collected < count; )
+		{
+			uint64_t ticket;
+			if (submitted < count && submitted < collected + window && ring_.try_submit(problems[submitted], ticket))
+			{
+				tickets[submitted++ % window] = ticket;
+				backoff.reset();
+			}
+			else if (collected < submitted)
+			{
+				ring_.collect(tickets[collected % window], problems[collected]);
+				++collected;
+			}
+			else
+			{
+				backoff.wait();		// full of other producers' problems
+			}
+		}
+	}
+
+	FormulaV4Ring &ring()
+	{
+		return ring_;
+	}
+
+private:
+	FormulaV4Ring ring_;
+};
@@ -0,0 +1,592 @@
+// FormulaV4Server.h
+//
+// Local solver service: one thread running an epoll event loop over a Unix
+// domain socket or loopback TCP, in the framing of FormulaV4Wire.h. Rows of
+// requests that arrive close together, from any number of connections, are
+// gathered into one micro-batch and solved with the partitioned vector
+// kernels. A batch is solved when it holds batch_rows rows, or when its
+// first request has waited budget_us microseconds, or as soon as every open
+// connection has a request in it, since clients that wait for their replies
+// cannot add more. With a budget of 0, each batch holds whatever arrived
+// during one wakeup of the loop. Either way batches grow with the load, and
+// a lone client never waits. A connection whose
+// replies are not being read stops being read itself, which pushes back on
+// its client. POSIX and Linux (epoll, timerfd, eventfd) only.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "FormulaV4Arena.h"
+#include "FormulaV4Csv.h"
+#include "FormulaV4Simd.h"
+#include "FormulaV4Wire.h"
+
+struct FormulaV4ServerOptions
+{
+	size_t batch_rows = 4096;			// solve once a batch has this many rows
+	uint32_t budget_us = 100;			// or once its first request has waited this long
+};
+
+class FormulaV4Server
+{
+public:
+	typedef FormulaV4ServerOptions Options;
+
+	static const size_t OUTPUT_LIMIT = 4 << 20;		// unsent reply bytes before a connection stops being read
+	static const size_t INPUT_LIMIT = 4 * (sizeof(FormulaV4WireHeader) +
+		FormulaV4WireHeader::MAX_ROWS * sizeof(FormulaV4Problem));	// unframed bytes before it stops being read
+
+	struct Stats
+	{
+		uint64_t connections;
+		uint64_t requests;
+		uint64_t rows;
+		uint64_t batches;
+	};
+
+	explicit FormulaV4Server(const std::string &address, Options options = Options())
+		: options_(options), arena_(FormulaV4Arena::BLOCK_BYTES),
+		batch_(std::max<size_t>(options.batch_rows, 1) + FormulaV4WireHeader::MAX_ROWS, &arena_), listener_(-1),
+		epoll_(-1), timer_(-1), wake_(-1), next_serial_(FIRST_SERIAL), waiting_(0), armed_(false), stats_()
+	{
+		options_.batch_rows = std::max<size_t>(options_.batch_rows, 1);
+		epoll_ = ::epoll_create1(EPOLL_CLOEXEC);
+		timer_ = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		wake_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (epoll_ < 0 || timer_ < 0 || wake_ < 0)
+		{
+			const int error = errno;
+			close_all();
+			errno = error;
+			FormulaV4Wire::fail("cannot set up the event loop");
+		}
+		try
+		{
+			listener_ = FormulaV4Wire::listen(address);
+		}
+		catch (...)
+		{
+			close_all();
+			throw;
+		}
+		watch(listener_, LISTENER, EPOLLIN);
+		watch(timer_, TIMER, EPOLLIN);
+		watch(wake_, WAKE, EPOLLIN);
+	}
+
+	~FormulaV4Server()
+	{
+		close_all();
+	}
+
+	FormulaV4Server(const FormulaV4Server&) = delete;
+	FormulaV4Server& operator=(const FormulaV4Server&) = delete;
+
+	// serve until stop(); what is already batched is solved and sent before returning
+	void run()
+	{
+		epoll_event events[64];
+		for (bool stopping = false; !stopping; )
+		{
+			const int n = ::epoll_wait(epoll_, events, 64, -1);
+			if (n < 0 && errno != EINTR)
+			{
+				FormulaV4Wire::fail("epoll_wait");
+			}
+			bool expired = false;
+			for (int i = 0; i < n; ++i)
+			{
+				const uint64_t serial = events[i].data.u64;
+				if (serial == LISTENER)
+				{
+					accept_all();
+				}
+				else if (serial == TIMER)
+				{
+					uint64_t ticks;
+					expired = ::read(timer_, &ticks, sizeof(ticks)) == sizeof(ticks) || expired;
+				}
+				else if (serial == WAKE)
+				{
+					stopping = true;
+				}
+				else
+				{
+					ready(serial, events[i].events);
+				}
+			}
+			resume_held();
+			close_finished();
+			if (!pending_.empty() && (expired || stopping || options_.budget_us == 0 || waiting_ == connections_.size()))
+			{
+				solve();
+				resume_held();
+				close_finished();
+			}
+		}
+		drain();
+	}
+
+	// ask run() to return; safe from any thread and from a signal handler
+	void stop()
+	{
+		const uint64_t one = 1;
+		const ssize_t written = ::write(wake_, &one, sizeof(one));
+		(void)written;
+	}
+
+	Stats stats() const
+	{
+		Stats stats;
+		stats.connections = stats_.connections.load(std::memory_order_relaxed);
+		stats.requests = stats_.requests.load(std::memory_order_relaxed);
+		stats.rows = stats_.rows.load(std::memory_order_relaxed);
+		stats.batches = stats_.batches.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+private:
+	enum : uint64_t { LISTENER, TIMER, WAKE, FIRST_SERIAL };
+
+	struct Connection
+	{
+		int fd = -1;
+		std::vector<char> in;			// received, not yet framed
+		std::vector<char> out;			// replies not yet sent, from sent on
+		size_t sent = 0;
+		size_t pending = 0;				// requests in the current batch
+		uint32_t events = 0;			// registered with epoll
+		bool eof = false;				// no more requests will come
+		bool closing = false;			// in closing_
+		bool held = false;				// in held_: complete requests in in wait for out to drain
+	};
+
+	// a request in the current batch
+	struct Pending
+	{
+		uint64_t serial;
+		uint32_t id;
+		uint32_t rows;
+		size_t first;					// row in batch_
+		std::chrono::steady_clock::time_point arrived;
+	};
+
+	void watch(int fd, uint64_t serial, uint32_t events)
+	{
+		epoll_event event = {};
+		event.events = events;
+		event.data.u64 = serial;
+		if (::epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) != 0)
+		{
+			FormulaV4Wire::fail("epoll_ctl");
+		}
+	}
+
+	void accept_all()
+	{
+		for (;;)
+		{
+			sockaddr_storage storage;
+			socklen_t length = sizeof(storage);
+			const int fd = ::accept4(listener_, reinterpret_cast<sockaddr*>(&storage), &length,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0)
+			{
+				return;				// EAGAIN, or a connection that went away before it was accepted
+			}
+			FormulaV4Wire::no_delay(fd, storage);
+			const uint64_t serial = next_serial_++;
+			Connection &connection = connections_[serial];
+			connection.fd = fd;
+			connection.events = EPOLLIN;
+			watch(fd, serial, EPOLLIN);
+			stats_.connections.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	void ready(uint64_t serial, uint32_t events)
+	{
+		auto found = connections_.find(serial);
+		if (found == connections_.end())
+		{
+			return;
+		}
+		// send() leaves a finished connection for close_finished(), so connection stays valid here
+		Connection &connection = found->second;
+		if (!connection.eof && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		{
+			receive(connection);
+		}
+		if (events & EPOLLOUT)
+		{
+			send(serial, connection);
+		}
+		frame(serial, connection);
+	}
+
+	// read what is there, up to INPUT_LIMIT unframed bytes; whatever is left is reported again by
+	// the level-triggered epoll on a later wakeup, so one busy client cannot hold up the loop
+	void receive(Connection &connection)
+	{
+		while (connection.in.size() < INPUT_LIMIT)
+		{
+			const ssize_t received = ::recv(connection.fd, scratch_, sizeof(scratch_), 0);
+			if (received > 0)
+			{
+				connection.in.insert(connection.in.end(), scratch_, scratch_ + received);
+				continue;
+			}
+			if (received < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				break;
+			}
+			connection.eof = true;		// closed, or reset
+			break;
+		}
+	}
+
+	// queue every complete request received, until the replies not yet sent pass OUTPUT_LIMIT; the
+	// rest is held in in, and framed again by resume_held() once the output is back under the limit
+	void frame(uint64_t serial, Connection &connection)
+	{
+		size_t offset = 0;
+		for (;;)
+		{
+			if (connection.in.size() - offset < sizeof(FormulaV4WireHeader))
+			{
+				connection.held = false;
+				break;
+			}
+			if (connection.out.size() - connection.sent > OUTPUT_LIMIT)
+			{
+				if (!connection.held)
+				{
+					connection.held = true;
+					held_.push_back(serial);
+				}
+				break;
+			}
+			FormulaV4WireHeader header;
+			std::memcpy(&header, connection.in.data() + offset, sizeof(header));
+			const uint32_t error = header.magic != FormulaV4WireHeader::REQUEST ? FormulaV4WireHeader::bad_magic :
+				header.rows > FormulaV4WireHeader::MAX_ROWS ? FormulaV4WireHeader::too_many_rows : FormulaV4WireHeader::none;
+			if (error != FormulaV4WireHeader::none)
+			{
+				reply(connection, header.id, error, 0, 0, 0, 0);
+				connection.eof = true;
+				connection.held = false;
+				offset = connection.in.size();
+				break;
+			}
+			const size_t bytes = sizeof(header) + header.rows * sizeof(FormulaV4Problem);
+			if (connection.in.size() - offset < bytes)
+			{
+				connection.held = false;
+				break;
+			}
+			queue(serial, connection, header, connection.in.data() + offset + sizeof(header));
+			offset += bytes;
+		}
+		connection.in.erase(connection.in.begin(), connection.in.begin() + offset);
+		send(serial, connection);
+	}
+
+	// the rows of a request into the batch, solving the batch first if they would not fit
+	void queue(uint64_t serial, Connection &connection, const FormulaV4WireHeader &header, const char *records)
+	{
+		if (batch_.rows + header.rows > batch_.capacity())
+		{
+			solve();
+		}
+		if (pending_.empty() && options_.budget_us != 0)
+		{
+			arm(options_.budget_us);
+		}
+		Pending request = { serial, header.id, header.rows, batch_.rows, std::chrono::steady_clock::now() };
+		for (uint32_t r = 0; r < header.rows; ++r)
+		{
+			FormulaV4Problem problem;
+			std::memcpy(&problem, records + r * sizeof(FormulaV4Problem), sizeof(problem));
+			const size_t row = batch_.rows + r;
+			for (int id = 0; id < VARIABLES; ++id)
+			{
+				batch_.values[id][row] = problem.values[id];
+			}
+			batch_.presence[row] = problem.presence;
+		}
+		batch_.rows += header.rows;
+		pending_.push_back(request);
+		waiting_ += connection.pending++ == 0;
+		stats_.requests.fetch_add(1, std::memory_order_relaxed);
+		stats_.rows.fetch_add(header.rows, std::memory_order_relaxed);
+		if (batch_.rows >= options_.batch_rows)
+		{
+			solve();
+		}
+	}
+
+	// solve the batch and queue a reply for every request in it
+	void solve()
+	{
+		if (pending_.empty())
+		{
+			return;
+		}
+		arm(0);
+		const auto start = std::chrono::steady_clock::now();
+		FormulaV4aColumns columns = batch_.view();
+		FormulaV4Simd::solve_partitioned(columns);
+		const auto end = std::chrono::steady_clock::now();
+		const uint64_t solve_ns = nanoseconds(end - start);
+		stats_.batches.fetch_add(1, std::memory_order_relaxed);
+
+		touched_.clear();
+		for (const Pending &request : pending_)
+		{
+			auto found = connections_.find(request.serial);
+			if (found == connections_.end())
+			{
+				continue;
+			}
+			Connection &connection = found->second;
+			reply(connection, request.id, FormulaV4WireHeader::none, nanoseconds(start - request.arrived), solve_ns,
+				request.first, request.rows);
+			--connection.pending;
+			if (touched_.empty() || touched_.back() != request.serial)
+			{
+				touched_.push_back(request.serial);
+			}
+		}
+		pending_.clear();
+		waiting_ = 0;
+		batch_.rows = 0;
+		for (uint64_t serial : touched_)
+		{
+			auto found = connections_.find(serial);
+			if (found != connections_.end())
+			{
+				send(serial, found->second);
+			}
+		}
+	}
+
+	// a reply frame onto the connection's output, with rows [first, first + rows) of the batch
+	void reply(Connection &connection, uint32_t id, uint32_t error, uint64_t wait_ns, uint64_t solve_ns, size_t first,
+		uint32_t rows)
+	{
+		FormulaV4WireHeader header = { FormulaV4WireHeader::REPLY, id, rows, error, wait_ns, solve_ns };
+		const size_t at = connection.out.size();
+		connection.out.resize(at + sizeof(header) + rows * sizeof(FormulaV4Problem));
+		char *p = connection.out.data() + at;
+		std::memcpy(p, &header, sizeof(header));
+		p += sizeof(header);
+		for (size_t row = first; row < first + rows; ++row)
+		{
+			FormulaV4Problem problem = {};
+			for (int id = 0; id < VARIABLES; ++id)
+			{
+				problem.values[id] = batch_.values[id][row];
+			}
+			problem.presence = batch_.presence[row];
+			problem.status = batch_.status[row];
+			std::memcpy(p, &problem, sizeof(problem));
+			p += sizeof(problem);
+		}
+	}
+
+	// send what the socket takes, then watch for whatever is still needed; once the client is gone
+	// and every reply it is owed has been sent, the connection is left for close_finished(), since
+	// callers up the stack (receive, queue) still hold a reference to it
+	void send(uint64_t serial, Connection &connection)
+	{
+		while (connection.sent < connection.out.size())
+		{
+			const ssize_t sent = ::send(connection.fd, connection.out.data() + connection.sent,
+				connection.out.size() - connection.sent, MSG_NOSIGNAL);
+			if (sent > 0)
+			{
+				connection.sent += static_cast<size_t>(sent);
+			}
+			else if (sent < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				break;
+			}
+			else
+			{
+				connection.eof = true;		// the client is gone; drop what it was owed
+				connection.sent = connection.out.size();
+			}
+		}
+		const size_t unsent = connection.out.size() - connection.sent;
+		if (unsent == 0)
+		{
+			connection.out.clear();
+			connection.sent = 0;
+		}
+		if (connection.eof && unsent == 0 && connection.pending == 0 && !connection.held)
+		{
+			if (!connection.closing)
+			{
+				connection.closing = true;
+				closing_.push_back(serial);
+			}
+			return;
+		}
+		const uint32_t readable = connection.eof || unsent > OUTPUT_LIMIT || connection.in.size() >= INPUT_LIMIT ? 0u :
+			uint32_t(EPOLLIN);
+		const uint32_t events = readable | (unsent ? uint32_t(EPOLLOUT) : 0u);
+		if (events != connection.events)
+		{
+			// a connection with nothing to wait for leaves the epoll set, which would otherwise keep
+			// reporting its hangup until the batch holding its last request is solved
+			epoll_event event = {};
+			event.events = events;
+			event.data.u64 = serial;
+			::epoll_ctl(epoll_, events == 0 ? EPOLL_CTL_DEL : connection.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+				connection.fd, &event);
+			connection.events = events;
+		}
+	}
+
+	// frame the requests held back by frame() on connections whose output has drained since; a
+	// connection still over OUTPUT_LIMIT goes back on the list, and is waiting for EPOLLOUT
+	void resume_held()
+	{
+		resuming_.swap(held_);
+		for (uint64_t serial : resuming_)
+		{
+			auto found = connections_.find(serial);
+			if (found != connections_.end() && found->second.held)
+			{
+				found->second.held = false;
+				frame(serial, found->second);
+			}
+		}
+		resuming_.clear();
+	}
+
+	// close the connections send() found finished, unless a request queued since then is still owed a reply
+	void close_finished()
+	{
+		for (uint64_t serial : closing_)
+		{
+			auto found = connections_.find(serial);
+			if (found == connections_.end())
+			{
+				continue;
+			}
+			Connection &connection = found->second;
+			connection.closing = false;
+			if (connection.pending == 0 && connection.sent == connection.out.size() && !connection.held)
+			{
+				::close(connection.fd);
+				connections_.erase(found);
+			}
+		}
+		closing_.clear();
+	}
+
+	// after stop(): send what can be sent without blocking and close every connection
+	void drain()
+	{
+		solve();
+		for (auto &entry : connections_)
+		{
+			Connection &connection = entry.second;
+			while (connection.sent < connection.out.size())
+			{
+				const ssize_t sent = ::send(connection.fd, connection.out.data() + connection.sent,
+					connection.out.size() - connection.sent, MSG_NOSIGNAL);
+				if (sent <= 0)
+				{
+					break;
+				}
+				connection.sent += static_cast<size_t>(sent);
+			}
+			::close(connection.fd);
+		}
+		connections_.clear();
+		closing_.clear();
+		held_.clear();
+	}
+
+	// fire the timer after us microseconds, or disarm it for 0
+	void arm(uint32_t us)
+	{
+		if (us == 0 && !armed_)
+		{
+			return;
+		}
+		itimerspec spec = {};
+		spec.it_value.tv_sec = us / 1000000;
+		spec.it_value.tv_nsec = static_cast<long>(us % 1000000) * 1000;
+		::timerfd_settime(timer_, 0, &spec, nullptr);
+		armed_ = us != 0;
+	}
+
+	template <class Duration>
+	static uint64_t nanoseconds(Duration duration)
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+	}
+
+	void close_all()
+	{
+		for (auto &entry : connections_)
+		{
+			::close(entry.second.fd);
+		}
+		connections_.clear();
+		for (int fd : { listener_, epoll_, timer_, wake_ })
+		{
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+		}
+		listener_ = epoll_ = timer_ = wake_ = -1;
+	}
+
+	Options options_;
+	FormulaV4Arena arena_;
+	FormulaV4Batch batch_;
+	std::vector<Pending> pending_;
+	std::vector<uint64_t> touched_;
+	std::vector<uint64_t> closing_;			// connections for close_finished()
+	std::vector<uint64_t> held_;			// connections for resume_held()
+	std::vector<uint64_t> resuming_;
+	std::unordered_map<uint64_t, Connection> connections_;
+	int listener_;
+	int epoll_;
+	int timer_;
+	int wake_;
+	uint64_t next_serial_;
+	size_t waiting_;						// connections with a request in the batch
+	bool armed_;
+	char scratch_[1 << 16];					// for recv()
+
+	// written by the loop, read by stats() from any thread
+	struct
+	{
+		std::atomic<uint64_t> connections{ 0 };
+		std::atomic<uint64_t> requests{ 0 };
+		std::atomic<uint64_t> rows{ 0 };
+		std::atomic<uint64_t> batches{ 0 };
+	} stats_;
+};
@@ -0,0 +1,609 @@
+// FormulaV4Shard.h
+//
+// Splits one large input across worker processes, for jobs bigger than one
+// process handles comfortably and to rehearse multi-node splits on one
+// host. The input, CSV/TSV or a FormulaV4File column file, is cut into
+// shards on row boundaries: byte ranges that start after a newline for
+// CSV, runs of whole row groups for column files. Every shard is solved by
+// its own forked worker, with its own solver threads, into its own output
+// file next to the output, and the shards are then concatenated into the
+// output in row order. POSIX only.
+//
+// Progress is kept in a manifest, output.manifest, rewritten after every
+// shard that finishes:
+//
+//   FV4SHARDS 1
+//   input csv <bytes> <mtime ns> <delimiter>
+//   shards <count>
+//   <index> done|pending <first> <last> <rows> <bytes> <file>
+//
+// first and last are input bytes for CSV and rows for a column file. A
+// worker that fails is retried; a shard that still fails is left pending,
+// and running the same job again solves only the shards that are not done,
+// as long as the input and the split have not changed. Without merging the
+// shards and the manifest are left in place, the manifest listing the
+// shard files in row order for whatever concatenates them.
+//
+//   FormulaV4Shards job("big.csv", "big.out.csv", options);
+//   if (!job.run()) ...;		// a shard failed; run again to retry it
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "FormulaV4Arena.h"
+#include "FormulaV4File.h"
+#include "FormulaV4Parallel.h"
+#include "FormulaV4Pipeline.h"
+
+struct FormulaV4ShardOptions
+{
+	unsigned shards = 2;				// and worker processes
+	unsigned threads = 1;				// solve threads in each worker
+	unsigned retries = 2;				// more tries for a shard whose worker failed
+	bool merge = true;					// false leaves the shards and the manifest in place of output
+	char delimiter = 0;					// as FormulaV4PipelineOptions
+	FormulaV4Arena::Pages pages = FormulaV4Arena::Pages::normal;
+};
+
+class FormulaV4Shards
+{
+public:
+	typedef FormulaV4ShardOptions Options;
+
+	enum class Kind { csv, binary };
+
+	struct Shard
+	{
+		uint64_t first;				// input bytes for CSV, rows for a column file
+		uint64_t last;
+		bool done;
+		uint64_t rows;				// solved, once done
+		uint64_t bytes;				// of the shard file, once done
+		unsigned tries;				// in this run
+		bool reused;				// done by an earlier run
+	};
+
+	FormulaV4Shards(const char *input, const char *output, Options options = Options())
+		: input_(input), output_(output), manifest_(std::string(output) + ".manifest"), options_(options),
+		kind_(Kind::csv), delimiter_(options.delimiter), header_end_(0), seconds_(0)
+	{
+		options_.shards = std::max(options_.shards, 1u);
+		options_.threads = std::max(options_.threads, 1u);
+	}
+
+	FormulaV4Shards(const FormulaV4Shards&) = delete;
+	FormulaV4Shards& operator=(const FormulaV4Shards&) = delete;
+
+	// solve every shard that is not done yet and merge them if asked; false if a shard failed
+	// every try, in which case the manifest says which
+	bool run()
+	{
+		const auto start = std::chrono::steady_clock::now();
+		plan();
+		if (!resume())
+		{
+			for (size_t i = 0; i < shards_.size(); ++i)
+			{
+				::unlink(shard_path(i).c_str());
+			}
+		}
+		save();
+
+		std::vector<size_t> pending;
+		for (size_t i = 0; i < shards_.size(); ++i)
+		{
+			if (!shards_[i].done)
+			{
+				pending.push_back(i);
+			}
+		}
+		const bool solved = work(pending);
+		if (solved && options_.merge)
+		{
+			merge();
+		}
+		seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return solved;
+	}
+
+	Kind kind() const
+	{
+		return kind_;
+	}
+
+	const std::vector<Shard> &shards() const
+	{
+		return shards_;
+	}
+
+	const std::string &manifest() const
+	{
+		return manifest_;
+	}
+
+	// rows solved over the shards that are done
+	size_t rows() const
+	{
+		size_t rows = 0;
+		for (const Shard &shard : shards_)
+		{
+			rows += shard.done ? static_cast<size_t>(shard.rows) : 0;
+		}
+		return rows;
+	}
+
+	double seconds() const
+	{
+		return seconds_;
+	}
+
+	std::string shard_path(size_t index) const
+	{
+		return output_ + ".shard-" + std::to_string(index);
+	}
+
+private:
+	static const uint32_t VERSION = 1;
+
+	// what a worker sends back on its pipe
+	struct Report
+	{
+		uint64_t rows;
+	};
+
+	// a worker process and the read end of its pipe
+	struct Worker
+	{
+		pid_t pid;
+		size_t shard;
+		int report;
+	};
+
+	// the shards of the input, none done
+	void plan()
+	{
+		struct stat info;
+		if (::stat(input_.c_str(), &info) != 0)
+		{
+			fail("cannot open", input_);
+		}
+		input_bytes_ = static_cast<uint64_t>(info.st_size);
+		input_mtime_ = static_cast<uint64_t>(info.st_mtim.tv_sec) * 1000000000u + static_cast<uint64_t>(info.st_mtim.tv_nsec);
+
+		char magic[8] = {};
+		FILE *in = std::fopen(input_.c_str(), "rb");
+		if (!in)
+		{
+			fail("cannot open", input_);
+		}
+		const bool binary = std::fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+			std::memcmp(magic, "FV4COLS", sizeof(magic)) == 0;
+		kind_ = binary ? Kind::binary : Kind::csv;
+
+		shards_.clear();
+		const Shard empty = { 0, 0, false, 0, 0, 0, false };
+		if (kind_ == Kind::binary)
+		{
+			std::fclose(in);
+			FormulaV4File file(input_.c_str(), FormulaV4File::Mode::read);
+			const uint64_t groups = file.groups();
+			const uint64_t group_rows = file.header().group_rows;
+			delimiter_ = 0;
+			for (uint64_t i = 0; i < options_.shards; ++i)
+			{
+				Shard shard = empty;
+				shard.first = std::min<uint64_t>(groups * i / options_.shards * group_rows, file.rows());
+				shard.last = std::min<uint64_t>(groups * (i + 1) / options_.shards * group_rows, file.rows());
+				shards_.push_back(shard);
+			}
+			return;
+		}
+
+		std::rewind(in);
+		scan_header(in);
+		std::fclose(in);
+		const int fd = ::open(input_.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			fail("cannot open", input_);
+		}
+		uint64_t first = 0;
+		for (uint64_t i = 0; i < options_.shards; ++i)
+		{
+			Shard shard = empty;
+			shard.first = first;
+			shard.last = i + 1 == options_.shards ? input_bytes_ :
+				line_start(fd, std::max(std::max(input_bytes_ * (i + 1) / options_.shards, header_end_), first));
+			first = shard.last;
+			shards_.push_back(shard);
+		}
+		::close(fd);
+	}
+
+	// settle the delimiter as FormulaV4Pipeline::header() does, from the first line that is not
+	// blank, and find where that line ends: it may be a header, so shard 0 has to hold it
+	void scan_header(FILE *in)
+	{
+		std::string line;
+		uint64_t offset = 0;
+		char block[1 << 16];
+		for (size_t n; (n = std::fread(block, 1, sizeof(block), in)) != 0; )
+		{
+			for (size_t i = 0; i < n; )
+			{
+				const char *stop = static_cast<const char*>(std::memchr(block + i, '\n', n - i));
+				const size_t take = (stop ? stop - block : n) - i;
+				line.append(block + i, std::min(take, FormulaV4CsvReader::BUFFER_BYTES - line.size()));
+				offset += take;
+				i += take;
+				if (stop)
+				{
+					++offset;
+					++i;
+					if (settle(line))
+					{
+						header_end_ = offset;
+						return;
+					}
+					line.clear();
+				}
+			}
+		}
+		settle(line);
+		header_end_ = offset;
+	}
+
+	// true, with the delimiter set, if line is not blank
+	bool settle(const std::string &line)
+	{
+		const bool overlong = line.size() >= FormulaV4CsvReader::BUFFER_BYTES;
+		const char *first = line.data();
+		const char *last = first + line.size();
+		if (!overlong && !FormulaV4CsvParser::trim(first, last))
+		{
+			delimiter_ = delimiter_ ? delimiter_ : ',';		// for an input of blank lines only
+			return false;
+		}
+		if (!options_.delimiter)
+		{
+			delimiter_ = !overlong && std::memchr(first, '\t', last - first) ? '\t' : ',';
+		}
+		return true;
+	}
+
+	// the first offset at or after position that starts a line
+	uint64_t line_start(int fd, uint64_t position) const
+	{
+		char block[1 << 16];
+		for (position = position == 0 ? 0 : position - 1; position < input_bytes_; )
+		{
+			const ssize_t n = ::pread(fd, block, sizeof(block), static_cast<off_t>(position));
+			if (n <= 0)
+			{
+				fail("cannot read", input_);
+			}
+			const char *stop = static_cast<const char*>(std::memchr(block, '\n', static_cast<size_t>(n)));
+			if (stop)
+			{
+				return position + (stop - block) + 1;
+			}
+			position += static_cast<uint64_t>(n);
+		}
+		return std::min(position, input_bytes_);
+	}
+
+	// take the shards an earlier run of the same job finished; false if the manifest is missing
+	// or is for other input or another split
+	bool resume()
+	{
+		FILE *file = std::fopen(manifest_.c_str(), "rb");
+		if (!file)
+		{
+			return false;
+		}
+		unsigned version = 0;
+		char kind[16] = {};
+		unsigned long long bytes = 0, mtime = 0, count = 0;
+		int delimiter = 0;
+		bool same = std::fscanf(file, "FV4SHARDS %u input %15s %llu %llu %d shards %llu", &version, kind, &bytes, &mtime,
+			&delimiter, &count) == 6 && version == VERSION && std::strcmp(kind, kind_name()) == 0 &&
+			bytes == input_bytes_ && mtime == input_mtime_ && delimiter == delimiter_ && count == shards_.size();
+		std::vector<Shard> done;
+		for (size_t i = 0; same && i < shards_.size(); ++i)
+		{
+			unsigned long long index = 0, first = 0, last = 0, rows = 0, shard_bytes = 0;
+			char state[16] = {};
+			same = std::fscanf(file, "%llu %15s %llu %llu %llu %llu %*[^\n]", &index, state, &first, &last, &rows,
+				&shard_bytes) == 6 && index == i && first == shards_[i].first && last == shards_[i].last;
+			Shard shard = shards_[i];
+			struct stat info;
+			if (same && std::strcmp(state, "done") == 0 && ::stat(shard_path(i).c_str(), &info) == 0 &&
+				static_cast<uint64_t>(info.st_size) == shard_bytes)
+			{
+				shard.done = shard.reused = true;
+				shard.rows = rows;
+				shard.bytes = shard_bytes;
+			}
+			done.push_back(shard);
+		}
+		std::fclose(file);
+		if (same)
+		{
+			shards_ = done;
+		}
+		return same;
+	}
+
+	// write the manifest, replacing the old one whole
+	void save() const
+	{
+		const std::string temporary = manifest_ + ".tmp";
+		FILE *file = std::fopen(temporary.c_str(), "wb");
+		if (!file)
+		{
+			fail("cannot create", temporary);
+		}
+		std::fprintf(file, "FV4SHARDS %u\ninput %s %llu %llu %d\nshards %zu\n", VERSION, kind_name(),
+			static_cast<unsigned long long>(input_bytes_), static_cast<unsigned long long>(input_mtime_), delimiter_,
+			shards_.size());
+		for (size_t i = 0; i < shards_.size(); ++i)
+		{
+			const Shard &shard = shards_[i];
+			std::fprintf(file, "%zu %s %llu %llu %llu %llu %s\n", i, shard.done ? "done" : "pending",
+				static_cast<unsigned long long>(shard.first), static_cast<unsigned long long>(shard.last),
+				static_cast<unsigned long long>(shard.rows), static_cast<unsigned long long>(shard.bytes),
+				shard_path(i).c_str());
+		}
+		const bool written = !std::ferror(file);
+		if (std::fclose(file) != 0 || !written || std::rename(temporary.c_str(), manifest_.c_str()) != 0)
+		{
+			fail("cannot write", manifest_);
+		}
+	}
+
+	const char *kind_name() const
+	{
+		return kind_ == Kind::csv ? "csv" : "binary";
+	}
+
+	// run a worker for every pending shard at once, retrying the ones that fail; false if one
+	// failed every try
+	bool work(std::vector<size_t> pending)
+	{
+		std::vector<Worker> running;
+		bool solved = true;
+		while (!pending.empty() || !running.empty())
+		{
+			for (size_t shard : pending)
+			{
+				running.push_back(start(shard));
+			}
+			pending.clear();
+
+			int status = 0;
+			const pid_t pid = ::waitpid(-1, &status, 0);
+			if (pid < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				fail("cannot wait for the workers of", input_);
+			}
+			const auto worker = std::find_if(running.begin(), running.end(), [&](const Worker &w) { return w.pid == pid; });
+			if (worker == running.end())
+			{
+				continue;
+			}
+			Shard &shard = shards_[worker->shard];
+			Report report = {};
+			const bool reported = ::read(worker->report, &report, sizeof(report)) == sizeof(report);
+			::close(worker->report);
+			struct stat info;
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && reported &&
+				::stat(shard_path(worker->shard).c_str(), &info) == 0)
+			{
+				shard.done = true;
+				shard.rows = report.rows;
+				shard.bytes = static_cast<uint64_t>(info.st_size);
+				save();
+			}
+			else if (shard.tries <= options_.retries)
+			{
+				std::fprintf(stderr, "shard %zu failed, retrying\n", worker->shard);
+				pending.push_back(worker->shard);
+			}
+			else
+			{
+				std::fprintf(stderr, "shard %zu failed %u times; run again to retry it\n", worker->shard, shard.tries);
+				solved = false;
+			}
+			running.erase(worker);
+		}
+		return solved;
+	}
+
+	// fork the worker of shard index, which reports its rows on a pipe
+	Worker start(size_t index)
+	{
+		int report[2];
+		std::fflush(nullptr);
+		if (::pipe(report) != 0)
+		{
+			fail("cannot start a worker for", input_);
+		}
+		++shards_[index].tries;
+		// built before the fork, so the worker need not allocate to clean up after a failure
+		const std::string temporary = shard_path(index) + ".tmp";
+		const pid_t pid = ::fork();
+		if (pid < 0)
+		{
+			fail("cannot start a worker for", input_);
+		}
+		if (pid == 0)
+		{
+			// nothing may unwind out of the worker into the parent's frames above start(): every
+			// exception ends it here, with its temporary file removed
+			::close(report[0]);
+			int code = 1;
+			try
+			{
+				const Report result = { solve(index) };
+				code = ::write(report[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+			}
+			catch (const FormulaV4FileException &e)
+			{
+				std::fprintf(stderr, "shard %zu: %s\n", index, e.message().c_str());
+			}
+			catch (const std::exception &e)
+			{
+				std::fprintf(stderr, "shard %zu: Error: %s\n", index, e.what());
+			}
+			catch (...)
+			{
+				std::fprintf(stderr, "shard %zu: Error: unknown exception\n", index);
+			}
+			if (code != 0)
+			{
+				::unlink(temporary.c_str());
+			}
+			std::fflush(stderr);
+			::_exit(code);
+		}
+		::close(report[1]);
+		const Worker worker = { pid, index, report[0] };
+		return worker;
+	}
+
+	// in the worker: solve shard index into a temporary file and rename it into place once
+	// complete, so a shard file is never half written; returns its rows
+	uint64_t solve(size_t index)
+	{
+		const Shard &shard = shards_[index];
+		const std::string path = shard_path(index);
+		const std::string temporary = path + ".tmp";
+		uint64_t rows = 0;
+		if (kind_ == Kind::binary)
+		{
+			FormulaV4File file(input_.c_str(), FormulaV4File::Mode::read);
+			const uint64_t group_rows = file.header().group_rows;
+			FormulaV4FileWriter writer(temporary.c_str(), static_cast<size_t>(group_rows));
+			FormulaV4ThreadPool pool(options_.threads);
+			for (uint64_t g = shard.first / group_rows; g * group_rows < shard.last; ++g)
+			{
+				writer.write(file.solve_group(static_cast<size_t>(g),
+					[&](FormulaV4aColumns &columns) { FormulaV4Parallel::solve(columns, pool); }));
+			}
+			writer.finish();
+			rows = writer.rows();
+		}
+		else
+		{
+			FILE *in = std::fopen(input_.c_str(), "rb");
+			if (!in || ::fseeko(in, static_cast<off_t>(shard.first), SEEK_SET) != 0)
+			{
+				fail("cannot open", input_);
+			}
+			FILE *out = std::fopen(temporary.c_str(), "wb");
+			if (!out)
+			{
+				fail("cannot create", temporary);
+			}
+			FormulaV4Pipeline::Options stages;
+			stages.solve_threads = options_.threads;
+			stages.delimiter = delimiter_;
+			stages.header = index == 0;
+			FormulaV4Arena arena(FormulaV4Arena::BLOCK_BYTES, options_.pages);
+			FormulaV4Pipeline pipeline(stages, &arena);
+			const bool written = pipeline.run(in, out, shard.last - shard.first);
+			std::fclose(in);
+			if (std::fclose(out) != 0 || !written)
+			{
+				fail("cannot write", temporary);
+			}
+			rows = pipeline.rows();
+		}
+		if (std::rename(temporary.c_str(), path.c_str()) != 0)
+		{
+			fail("cannot write", path);
+		}
+		return rows;
+	}
+
+	// the shards into output in row order, then the shards and the manifest removed
+	void merge()
+	{
+		if (kind_ == Kind::binary)
+		{
+			FormulaV4FileWriter writer(output_.c_str(), FormulaV4FileWriter::GROUP_ROWS);
+			for (size_t i = 0; i < shards_.size(); ++i)
+			{
+				FormulaV4File file(shard_path(i).c_str(), FormulaV4File::Mode::read);
+				for (size_t g = 0; g < file.groups(); ++g)
+				{
+					writer.write(file.group(g));
+				}
+			}
+			writer.finish();
+		}
+		else
+		{
+			const int out = ::open(output_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (out < 0)
+			{
+				fail("cannot create", output_);
+			}
+			for (size_t i = 0; i < shards_.size(); ++i)
+			{
+				const int in = ::open(shard_path(i).c_str(), O_RDONLY);
+				const bool ok = in >= 0 && FormulaV4File::transfer(in, out, shards_[i].bytes);
+				const int error = errno;
+				if (in >= 0)
+				{
+					::close(in);
+				}
+				if (!ok)
+				{
+					::close(out);
+					errno = error;
+					fail("cannot write", output_);
+				}
+			}
+			if (::close(out) != 0)
+			{
+				fail("cannot write", output_);
+			}
+		}
+		for (size_t i = 0; i < shards_.size(); ++i)
+		{
+			::unlink(shard_path(i).c_str());
+		}
+		::unlink(manifest_.c_str());
+	}
+
+	[[noreturn]] static void fail(const char *what, const std::string &path)
+	{
+		throw FormulaV4FileException(std::string("Error: ") + what + " " + path + ": " + std::strerror(errno));
+	}
+
+	std::string input_;
+	std::string output_;
+	std::string manifest_;
+	Options options_;
+	Kind kind_;
+	int delimiter_;					// a char, kept as the manifest writes it
+	uint64_t header_end_;			// where the first line that is not blank ends
+	uint64_t input_bytes_;
+	uint64_t input_mtime_;
+	std::vector<Shard> shards_;
+	double seconds_;
+};
@@ -0,0 +1,741 @@
+// FormulaV4Simd.h
+//
+// Vectorized batch solver for FormulaV4aColumns. The kernels in
+// FormulaV4SimdKernels.h are compiled for plain scalar code, AVX2 and AVX-512,
+// and the widest set the CPU supports is picked at runtime. solve() runs the
+// kernels over runs of rows with the same unknowns as they come;
+// solve_partitioned() sorts rows by unknowns first, for input in any order.
+// FormulaV4Simd solves double columns; FormulaV4SimdT<float> solves
+// FormulaV4aColumnsT<float> with twice as many lanes per vector (8 for AVX2,
+// 16 for AVX-512) and half the bytes per row.
+#pragma once
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "FormulaV4a.h"
+#include "FormulaV4Trace.h"
+
+#if !defined(FORMULAV4_NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define FORMULAV4_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define FORMULAV4_SIMD_X86 0
+#endif
+
+// a run of rows handed to one kernel; all rows have the same two unknowns
+template <class T>
+struct FormulaV4RunT
+{
+	T *distance;
+	T *time;
+	T *initial_velocity;
+	T *final_velocity;
+	T *acceleration;
+	FormulaV4Status *status;
+	size_t rows;
+};
+
+template <class T>
+using FormulaV4KernelT = void (*)(const FormulaV4RunT<T>&);
+template <class T>
+using FormulaV4KernelsT = std::array<FormulaV4KernelT<T>, 1 << VARIABLES>;
+
+typedef FormulaV4RunT<double> FormulaV4Run;
+typedef FormulaV4KernelT<double> FormulaV4Kernel;
+typedef FormulaV4KernelsT<double> FormulaV4Kernels;
+
+// lanes types: the handful of vector operations the kernels need, one lane per row, over
+// elements of type T
+template <class Element>
+struct FormulaV4ScalarLanesT
+{
+	typedef Element T;
+	typedef T V;
+	typedef bool M;
+	static const int width = 1;
+
+	static V load(const T *p) { return *p; }
+	static void store(T *p, V v) { *p = v; }
+	static V set1(T x) { return x; }
+	static V add(V a, V b) { return a + b; }
+	static V sub(V a, V b) { return a - b; }
+	static V mul(V a, V b) { return a * b; }
+	static V div(V a, V b) { return a / b; }
+	static V sqrt(V a) { return std::sqrt(a); }
+	static M eq_zero(V a) { return a == 0.0; }
+	static M lt_zero(V a) { return a < 0; }
+	static M and_(M a, M b) { return a && b; }
+	static M or_(M a, M b) { return a || b; }
+	static M andnot(M a, M b) { return a && !b; }	// a and not b
+	static V select(M m, V if_true, V if_false) { return m ? if_true : if_false; }
+	static unsigned bits(M m) { return m; }
+};
+
+typedef FormulaV4ScalarLanesT<double> FormulaV4ScalarLanes;
+
+struct FormulaV4ScalarKernels
+{
+	typedef FormulaV4ScalarLanes L;
+#include "FormulaV4SimdKernels.h"
+};
+
+struct FormulaV4ScalarFloatKernels
+{
+	typedef FormulaV4ScalarLanesT<float> L;
+#include "FormulaV4SimdKernels.h"
+};
+
+// buckets of the partitioned path: 0 to PAIRS - 1 for the masks with exactly two unknowns,
+// in mask order, and PAIRS for every other mask
+struct FormulaV4Buckets
+{
+	static const unsigned char PAIRS = 10;
+	typedef std::array<unsigned char, 1 << VARIABLES> Table;
+
+	static constexpr Table table()
+	{
+		Table buckets = {};
+		unsigned char next = 0;
+		for (unsigned key = 0; key < buckets.size(); ++key)
+		{
+			unsigned blanks = 0;
+			for (unsigned bits = key; bits != 0; bits &= bits - 1)
+			{
+				++blanks;
+			}
+			buckets[key] = blanks == 2 ? next++ : PAIRS;
+		}
+		return buckets;
+	}
+
+	// the mask of unknowns of each row, as a bucket; the scalar version of the AVX2 classify
+	static void classify(const unsigned char *presence, size_t rows, unsigned char *bucket)
+	{
+		static constexpr Table buckets = table();
+		for (size_t i = 0; i < rows; ++i)
+		{
+			bucket[i] = buckets[~presence[i] & ALL_PRESENT];
+		}
+	}
+};
+
+#if FORMULAV4_SIMD_X86
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#pragma GCC optimize("fp-contract=off")	// keep results bit-identical to the scalar kernels
+#endif
+
+struct FormulaV4Avx2Lanes
+{
+	typedef double T;
+	typedef __m256d V;
+	typedef __m256d M;
+	static const int width = 4;
+
+	static V load(const double *p) { return _mm256_loadu_pd(p); }
+	static void store(double *p, V v) { _mm256_storeu_pd(p, v); }
+	static V set1(double x) { return _mm256_set1_pd(x); }
+	static V add(V a, V b) { return _mm256_add_pd(a, b); }
+	static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+	static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+	static V div(V a, V b) { return _mm256_div_pd(a, b); }
+	static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+	static M eq_zero(V a) { return _mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_EQ_OQ); }
+	static M lt_zero(V a) { return _mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_LT_OQ); }
+	static M and_(M a, M b) { return _mm256_and_pd(a, b); }
+	static M or_(M a, M b) { return _mm256_or_pd(a, b); }
+	static M andnot(M a, M b) { return _mm256_andnot_pd(b, a); }
+	static V select(M m, V if_true, V if_false) { return _mm256_blendv_pd(if_false, if_true, m); }
+	static unsigned bits(M m) { return static_cast<unsigned>(_mm256_movemask_pd(m)); }
+};
+
+struct FormulaV4Avx2Kernels
+{
+	typedef FormulaV4Avx2Lanes L;
+#include "FormulaV4SimdKernels.h"
+};
+
+struct FormulaV4Avx2FloatLanes
+{
+	typedef float T;
+	typedef __m256 V;
+	typedef __m256 M;
+	static const int width = 8;
+
+	static V load(const float *p) { return _mm256_loadu_ps(p); }
+	static void store(float *p, V v) { _mm256_storeu_ps(p, v); }
+	static V set1(float x) { return _mm256_set1_ps(x); }
+	static V add(V a, V b) { return _mm256_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm256_div_ps(a, b); }
+	static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+	static M eq_zero(V a) { return _mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_EQ_OQ); }
+	static M lt_zero(V a) { return _mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_LT_OQ); }
+	static M and_(M a, M b) { return _mm256_and_ps(a, b); }
+	static M or_(M a, M b) { return _mm256_or_ps(a, b); }
+	static M andnot(M a, M b) { return _mm256_andnot_ps(b, a); }
+	static V select(M m, V if_true, V if_false) { return _mm256_blendv_ps(if_false, if_true, m); }
+	static unsigned bits(M m) { return static_cast<unsigned>(_mm256_movemask_ps(m)); }
+};
+
+struct FormulaV4Avx2FloatKernels
+{
+	typedef FormulaV4Avx2FloatLanes L;
+#include "FormulaV4SimdKernels.h"
+};
+
+// 32 rows per step: the 5-bit mask of unknowns indexes a 32-entry table, so counting the
+// blanks and finding the bucket is one byte shuffle per half of the table
+struct FormulaV4Avx2Buckets
+{
+	static void classify(const unsigned char *presence, size_t rows, unsigned char *bucket)
+	{
+		static constexpr FormulaV4Buckets::Table buckets = FormulaV4Buckets::table();
+		const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buckets.data())));
+		const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buckets.data() + 16)));
+		const __m256i all = _mm256_set1_epi8(static_cast<char>(ALL_PRESENT));
+		const __m256i bit4 = _mm256_set1_epi8(16);
+		size_t i = 0;
+		for (; i + 32 <= rows; i += 32)
+		{
+			const __m256i key = _mm256_andnot_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(presence + i)), all);
+			const __m256i upper = _mm256_cmpeq_epi8(_mm256_and_si256(key, bit4), bit4);
+			const __m256i result = _mm256_blendv_epi8(_mm256_shuffle_epi8(low, key), _mm256_shuffle_epi8(high, key), upper);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(bucket + i), result);
+		}
+		FormulaV4Buckets::classify(presence + i, rows - i, bucket + i);
+	}
+};
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"	// false positive inside _mm512_sqrt_pd
+#endif
+
+struct FormulaV4Avx512Lanes
+{
+	typedef double T;
+	typedef __m512d V;
+	typedef __mmask8 M;
+	static const int width = 8;
+
+	static V load(const double *p) { return _mm512_loadu_pd(p); }
+	static void store(double *p, V v) { _mm512_storeu_pd(p, v); }
+	static V set1(double x) { return _mm512_set1_pd(x); }
+	static V add(V a, V b) { return _mm512_add_pd(a, b); }
+	static V sub(V a, V b) { return _mm512_sub_pd(a, b); }
+	static V mul(V a, V b) { return _mm512_mul_pd(a, b); }
+	static V div(V a, V b) { return _mm512_div_pd(a, b); }
+	static V sqrt(V a) { return _mm512_sqrt_pd(a); }
+	static M eq_zero(V a) { return _mm512_cmp_pd_mask(a, _mm512_setzero_pd(), _CMP_EQ_OQ); }
+	static M lt_zero(V a) { return _mm512_cmp_pd_mask(a, _mm512_setzero_pd(), _CMP_LT_OQ); }
+	static M and_(M a, M b) { return static_cast<M>(a & b); }
+	static M or_(M a, M b) { return static_cast<M>(a | b); }
+	static M andnot(M a, M b) { return static_cast<M>(a & ~b); }
+	static V select(M m, V if_true, V if_false) { return _mm512_mask_blend_pd(m, if_false, if_true); }
+	static unsigned bits(M m) { return m; }
+};
+
+struct FormulaV4Avx512Kernels
+{
+	typedef FormulaV4Avx512Lanes L;
+#include "FormulaV4SimdKernels.h"
+};
+
+struct FormulaV4Avx512FloatLanes
+{
+	typedef float T;
+	typedef __m512 V;
+	typedef __mmask16 M;
+	static const int width = 16;
+
+	static V load(const float *p) { return _mm512_loadu_ps(p); }
+	static void store(float *p, V v) { _mm512_storeu_ps(p, v); }
+	static V set1(float x) { return _mm512_set1_ps(x); }
+	static V add(V a, V b) { return _mm512_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm512_div_ps(a, b); }
+	static V sqrt(V a) { return _mm512_sqrt_ps(a); }
+	static M eq_zero(V a) { return _mm512_cmp_ps_mask(a, _mm512_setzero_ps(), _CMP_EQ_OQ); }
+	static M lt_zero(V a) { return _mm512_cmp_ps_mask(a, _mm512_setzero_ps(), _CMP_LT_OQ); }
+	static M and_(M a, M b) { return static_cast<M>(a & b); }
+	static M or_(M a, M b) { return static_cast<M>(a | b); }
+	static M andnot(M a, M b) { return static_cast<M>(a & ~b); }
+	static V select(M m, V if_true, V if_false) { return _mm512_mask_blend_ps(m, if_false, if_true); }
+	static unsigned bits(M m) { return m; }
+};
+
+struct FormulaV4Avx512FloatKernels
+{
+	typedef FormulaV4Avx512FloatLanes L;
+#include "FormulaV4SimdKernels.h"
+};
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+#endif
+
+#endif // FORMULAV4_SIMD_X86
+
+// the kernels of each instruction set for element type T
+template <class T>
+struct FormulaV4KernelSets;
+
+template <>
+struct FormulaV4KernelSets<double>
+{
+	typedef FormulaV4ScalarKernels Scalar;
+#if FORMULAV4_SIMD_X86
+	typedef FormulaV4Avx2Kernels Avx2;
+	typedef FormulaV4Avx512Kernels Avx512;
+#endif
+};
+
+template <>
+struct FormulaV4KernelSets<float>
+{
+	typedef FormulaV4ScalarFloatKernels Scalar;
+#if FORMULAV4_SIMD_X86
+	typedef FormulaV4Avx2FloatKernels Avx2;
+	typedef FormulaV4Avx512FloatKernels Avx512;
+#endif
+};
+
+// the instruction set choice and block sizes, shared by every element type
+class FormulaV4SimdIsa
+{
+public:
+	enum class Isa { scalar, avx2, avx512 };
+
+	// rows solved per kernel call; bounds the status buffer calculate() keeps on the stack
+	static const size_t BLOCK_ROWS = 256;
+
+	// rows sorted at a time by solve_partitioned(); its buffers are on the stack
+	static const size_t PARTITION_ROWS = 1024;
+
+	// a slice whose rows already come in runs at least this long on average is solved in place
+	static const size_t PARTITION_RUN_ROWS = 16;
+
+	// widest instruction set supported by this CPU and OS
+	static Isa detect()
+	{
+#if FORMULAV4_SIMD_X86 && defined(__GNUC__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+		{
+			return Isa::avx512;
+		}
+		if (__builtin_cpu_supports("avx2"))
+		{
+			return Isa::avx2;
+		}
+#elif FORMULAV4_SIMD_X86 && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		__cpuidex(info, 7, 0);
+		const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+		if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+		{
+			return Isa::avx512;
+		}
+		if ((info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6)
+		{
+			return Isa::avx2;
+		}
+#endif
+		return Isa::scalar;
+	}
+
+	// instruction set used by calculate(); starts at detect()
+	static Isa isa()
+	{
+		return selected();
+	}
+
+	// force a narrower instruction set (e.g. to compare against the scalar fallback);
+	// requests wider than the CPU supports are clamped to detect()
+	static void use(Isa isa)
+	{
+		selected() = std::min(isa, detect());
+	}
+
+private:
+	static Isa &selected()
+	{
+		static Isa isa = detect();
+		return isa;
+	}
+};
+
+// T is double (FormulaV4Simd) or float
+template <class T>
+class FormulaV4SimdT: public FormulaV4SimdIsa
+{
+public:
+	typedef FormulaV4aColumnsT<T> Columns;
+
+	// solve every row of a columnar batch in place, with the same results and exceptions
+	// as FormulaV4a::calculate(columns); a bad row is only reported once its block is done
+	static void calculate(Columns &columns)
+	{
+		calculate(columns, isa());
+	}
+
+	static void calculate(Columns &columns, Isa isa)
+	{
+		calculate(columns, 0, columns.rows, isa);
+	}
+
+	// solve rows [first, last) only; errors still report the row's index in columns
+	static void calculate(Columns &columns, size_t first, size_t last)
+	{
+		calculate(columns, first, last, isa());
+	}
+
+	static void calculate(Columns &columns, size_t first, size_t last, Isa isa)
+	{
+		FormulaV4TraceSpan span("solve");
+		const Dispatch dispatch(isa);
+		FormulaV4Status block_status[BLOCK_ROWS];
+
+		for (size_t begin = first; begin < last; )
+		{
+			const unsigned key = unknowns_key(columns.presence[begin]);
+			const size_t end = block_end(columns, begin, last, key);
+			FormulaV4Status *status = columns.status != nullptr ? columns.status + begin : block_status;
+
+			const uint64_t start = FormulaV4Metrics::start();
+			if (!solve_block(columns, begin, end, key, dispatch, status))
+			{
+				std::fill(status, status + (end - begin), unknowns_status(key));
+			}
+			FormulaV4Metrics::record_block(key, status, end - begin, start);
+			for (size_t i = begin; i < end; ++i)
+			{
+				if (status[i - begin] != FormulaV4Status::ok)
+				{
+					throw FormulaV4aException(std::string(status_message(status[i - begin])) + " (row " + std::to_string(i) + ")");
+				}
+			}
+			begin = end;
+		}
+	}
+
+	// batch calculate() without exceptions, like FormulaV4a::solve(columns): every row
+	// is attempted and gets its status, and only rows that solved become fully present
+	static void solve(Columns &columns) noexcept
+	{
+		solve(columns, 0, columns.rows, isa());
+	}
+
+	static void solve(Columns &columns, size_t first, size_t last) noexcept
+	{
+		solve(columns, first, last, isa());
+	}
+
+	static void solve(Columns &columns, size_t first, size_t last, Isa isa) noexcept
+	{
+		FormulaV4TraceSpan span("solve");
+		solve_runs(columns, first, last, Dispatch(isa));
+	}
+
+	// solve() for rows in any order: each slice of PARTITION_ROWS rows is sorted into one
+	// bucket per pair of unknowns, each bucket is gathered and solved full width, and the
+	// results are scattered back to their rows. Rows without exactly two blanks get their
+	// status while they are sorted. Slices that are already mostly in runs of the same
+	// unknowns skip the sort and are solved like solve() does.
+	static void solve_partitioned(Columns &columns) noexcept
+	{
+		solve_partitioned(columns, 0, columns.rows, isa());
+	}
+
+	static void solve_partitioned(Columns &columns, size_t first, size_t last) noexcept
+	{
+		solve_partitioned(columns, first, last, isa());
+	}
+
+	static void solve_partitioned(Columns &columns, size_t first, size_t last, Isa isa) noexcept
+	{
+		FormulaV4TraceSpan span("solve");
+		const Dispatch dispatch(isa);
+		for (size_t begin = first; begin < last; begin += PARTITION_ROWS)
+		{
+			solve_slice(columns, begin, std::min(begin + PARTITION_ROWS, last), dispatch);
+		}
+	}
+
+private:
+	typedef FormulaV4RunT<T> Run;
+	typedef FormulaV4KernelsT<T> Kernels;
+	typedef FormulaV4KernelSets<T> Sets;
+
+	static unsigned unknowns_key(unsigned char presence)
+	{
+		return ~presence & ALL_PRESENT;
+	}
+
+	// kernels for one instruction set, looked up once per call
+	struct Dispatch
+	{
+		explicit Dispatch(Isa isa)
+			: kernels(&kernels_for(isa)), tail_kernels(&kernels_for(Isa::scalar)), width(width_of(isa)), isa(isa)
+		{
+		}
+
+		const Kernels *kernels;
+		const Kernels *tail_kernels;
+		size_t width;
+		Isa isa;
+	};
+
+	// solve rows [first, last) one run of rows with the same unknowns at a time
+	static void solve_runs(Columns &columns, size_t first, size_t last, const Dispatch &dispatch)
+	{
+		for (size_t begin = first; begin < last; )
+		{
+			const unsigned key = unknowns_key(columns.presence[begin]);
+			const size_t end = block_end(columns, begin, last, key);
+			const uint64_t start = FormulaV4Metrics::start();
+			if (!solve_block(columns, begin, end, key, dispatch, columns.status + begin))
+			{
+				std::fill(columns.status + begin, columns.status + end, unknowns_status(key));
+			}
+			FormulaV4Metrics::record_block(key, columns.status + begin, end - begin, start);
+			begin = end;
+		}
+	}
+
+	// one slice of solve_partitioned(): a counting sort of the row indices by bucket, then
+	// gather, solve and scatter per bucket
+	static void solve_slice(Columns &columns, size_t begin, size_t end, const Dispatch &dispatch)
+	{
+		const size_t rows = end - begin;
+		unsigned char bucket[PARTITION_ROWS];
+		uint16_t order[PARTITION_ROWS];
+		size_t start[FormulaV4Buckets::PAIRS + 2] = {};
+		{
+			FormulaV4TraceSpan span("classify");
+#if FORMULAV4_SIMD_X86
+			if (dispatch.isa != Isa::scalar)
+			{
+				FormulaV4Avx2Buckets::classify(columns.presence + begin, rows, bucket);
+			}
+			else
+#endif
+			{
+				FormulaV4Buckets::classify(columns.presence + begin, rows, bucket);
+			}
+			size_t runs = 1;
+			for (size_t i = 1; i < rows; ++i)
+			{
+				runs += bucket[i] != bucket[i - 1];
+			}
+			if (rows < runs * PARTITION_RUN_ROWS)
+			{
+				// four counts per bucket, so rows of the same bucket do not wait on each other
+				uint16_t counts[4][FormulaV4Buckets::PAIRS + 1] = {};
+				size_t i = 0;
+				for (; i + 4 <= rows; i += 4)
+				{
+					++counts[0][bucket[i]];
+					++counts[1][bucket[i + 1]];
+					++counts[2][bucket[i + 2]];
+					++counts[3][bucket[i + 3]];
+				}
+				for (; i < rows; ++i)
+				{
+					++counts[0][bucket[i]];
+				}
+				for (int b = 0; b <= FormulaV4Buckets::PAIRS; ++b)
+				{
+					start[b + 1] = start[b] + counts[0][b] + counts[1][b] + counts[2][b] + counts[3][b];
+				}
+			}
+		}
+		if (start[FormulaV4Buckets::PAIRS + 1] == 0)
+		{
+			solve_runs(columns, begin, end, dispatch);
+			return;
+		}
+		{
+			FormulaV4TraceSpan span("partition");
+			size_t next[FormulaV4Buckets::PAIRS + 1];
+			std::copy(start, start + FormulaV4Buckets::PAIRS + 1, next);
+			for (size_t i = 0; i < rows; ++i)
+			{
+				order[next[bucket[i]]++] = static_cast<uint16_t>(i);
+			}
+
+			// flagged rows: too many or too few blanks
+			for (size_t k = start[FormulaV4Buckets::PAIRS]; k < rows; ++k)
+			{
+				const size_t row = begin + order[k];
+				const unsigned key = unknowns_key(columns.presence[row]);
+				columns.status[row] = unknowns_status(key);
+				FormulaV4Metrics::record(key, columns.status[row], 0);
+			}
+		}
+
+		FormulaV4TraceSpan span("kernel");
+		T *column[VARIABLES] = { columns.distance, columns.time, columns.initial_velocity, columns.final_velocity,
+			columns.acceleration };
+		T gathered[VARIABLES][PARTITION_ROWS];
+		FormulaV4Status status[PARTITION_ROWS];
+		for (int b = 0; b < FormulaV4Buckets::PAIRS; ++b)
+		{
+			const uint16_t *rows_of = order + start[b];
+			const size_t n = start[b + 1] - start[b];
+			if (n == 0)
+			{
+				continue;
+			}
+			const uint64_t started = FormulaV4Metrics::start();
+			const unsigned key = unknowns_key(columns.presence[begin + rows_of[0]]);
+			for (int id = 0; id < VARIABLES; ++id)
+			{
+				// the kernels only read the unknowns to keep them in rows that fail, which are not scattered
+				if (key & (1u << id))
+				{
+					std::fill(gathered[id], gathered[id] + n, T(0));
+					continue;
+				}
+				for (size_t k = 0; k < n; ++k)
+				{
+					gathered[id][k] = column[id][begin + rows_of[k]];
+				}
+			}
+
+			const size_t body = n / dispatch.width * dispatch.width;
+			std::fill(status, status + n, FormulaV4Status::ok);
+			const Run run = { gathered[0], gathered[1], gathered[2], gathered[3], gathered[4], status, body };
+			(*dispatch.kernels)[key](run);
+			const Run tail = { gathered[0] + body, gathered[1] + body, gathered[2] + body, gathered[3] + body,
+				gathered[4] + body, status + body, n - body };
+			(*dispatch.tail_kernels)[key](tail);
+
+			// only the two unknowns can have changed, and only in rows that solved
+			for (size_t k = 0; k < n; ++k)
+			{
+				const size_t row = begin + rows_of[k];
+				columns.status[row] = status[k];
+				if (status[k] == FormulaV4Status::ok)
+				{
+					for (int id = 0; id < VARIABLES; ++id)
+					{
+						if (key & (1u << id))
+						{
+							column[id][row] = gathered[id][k];
+						}
+					}
+					columns.presence[row] = ALL_PRESENT;
+				}
+			}
+			FormulaV4Metrics::record_block(key, status, n, started);
+		}
+	}
+
+	// end of the block of consecutive rows from begin that share key, at most BLOCK_ROWS long
+	static size_t block_end(const Columns &columns, size_t begin, size_t last, unsigned key)
+	{
+		size_t end = begin + 1;
+		while (end < last && end - begin < BLOCK_ROWS && unknowns_key(columns.presence[end]) == key)
+		{
+			++end;
+		}
+		return end;
+	}
+
+	// run the kernel for key over rows [begin, end), vector lanes first and the scalar kernel
+	// for the remainder; rows that solve are marked fully present. Returns false, touching
+	// nothing, when key is not a supported pair.
+	static bool solve_block(Columns &columns, size_t begin, size_t end, unsigned key, const Dispatch &dispatch,
+		FormulaV4Status *status)
+	{
+		const FormulaV4KernelT<T> kernel = (*dispatch.kernels)[key];
+		if (kernel == nullptr)
+		{
+			return false;
+		}
+
+		const size_t rows = end - begin;
+		const size_t body = rows / dispatch.width * dispatch.width;
+		std::fill(status, status + rows, FormulaV4Status::ok);
+
+		Run run = { columns.distance + begin, columns.time + begin, columns.initial_velocity + begin,
+			columns.final_velocity + begin, columns.acceleration + begin, status, body };
+		kernel(run);
+
+		Run tail = { run.distance + body, run.time + body, run.initial_velocity + body,
+			run.final_velocity + body, run.acceleration + body, status + body, rows - body };
+		(*dispatch.tail_kernels)[key](tail);
+
+		for (size_t i = 0; i < rows; ++i)
+		{
+			if (status[i] == FormulaV4Status::ok)
+			{
+				columns.presence[begin + i] = ALL_PRESENT;
+			}
+		}
+		return true;
+	}
+
+	static size_t width_of(Isa isa)
+	{
+#if FORMULAV4_SIMD_X86
+		switch (isa)
+		{
+		case Isa::avx512:
+			return Sets::Avx512::L::width;
+		case Isa::avx2:
+			return Sets::Avx2::L::width;
+		default:
+			break;
+		}
+#endif
+		return Sets::Scalar::L::width;
+	}
+
+	static const Kernels &kernels_for(Isa isa)
+	{
+		static const Kernels scalar = Sets::Scalar::table();
+#if FORMULAV4_SIMD_X86
+		static const Kernels avx2 = Sets::Avx2::table();
+		static const Kernels avx512 = Sets::Avx512::table();
+		switch (isa)
+		{
+		case Isa::avx512:
+			return avx512;
+		case Isa::avx2:
+			return avx2;
+		default:
+			break;
+		}
+#endif
+		return scalar;
+	}
+};
+
+typedef FormulaV4SimdT<double> FormulaV4Simd;
@@ -0,0 +1,218 @@
+// FormulaV4SimdKernels.h
+//
+// The ten unknown-pair kernels, written once against a lanes type L and its
+// element type L::T.
+// FormulaV4Simd.h includes this file inside one struct per instruction set
+// (scalar, AVX2, AVX-512), so every set runs exactly the same arithmetic.
+// Do not include it directly.
+//
+// Each kernel solves r.rows rows that all share the same two unknowns, with
+// r.rows a multiple of L::width, and r.status preset to ok. The checks that
+// FormulaV4a returns a status for are kept as per-lane masks: a bad lane
+// leaves its unknowns untouched and gets its status, and the other lanes
+// carry on.
+
+typedef L::T T;
+typedef L::V V;
+typedef L::M M;
+typedef FormulaV4RunT<T> Run;
+
+// distance = initial_velocity * time + 0.5 * (acceleration * time^2)
+static V distance_from(V vi, V t, V a)
+{
+	return L::add(L::mul(vi, t), L::mul(L::set1(0.5), L::mul(a, L::mul(t, t))));
+}
+
+// time from the velocities, or from distance when acceleration is zero (FormulaV4a time_from)
+static V time_from(V d, V vi, V vf, V a, M &zero_vf)
+{
+	const M zero_a = L::eq_zero(a);
+	zero_vf = L::and_(zero_a, L::eq_zero(vf));
+	return L::select(zero_a, L::div(d, vf), L::div(L::sub(vf, vi), a));
+}
+
+// store computed values for good lanes only
+static void store(T *p, M bad, V x)
+{
+	L::store(p, L::select(bad, L::load(p), x));
+}
+
+// the masks marked by one kernel never overlap, so OR-ing a code into ok (zero) sets it
+static void mark(FormulaV4Status *status, M m, FormulaV4Status code)
+{
+	const unsigned bits = L::bits(m);
+	for (int j = 0; j < L::width; ++j)
+	{
+		status[j] = static_cast<FormulaV4Status>(static_cast<unsigned char>(status[j]) |
+			((bits >> j) & 1) * static_cast<unsigned char>(code));
+	}
+}
+
+// if distance if the first incognita...
+static void distance_time(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V vi = L::load(r.initial_velocity + i), vf = L::load(r.final_velocity + i), a = L::load(r.acceleration + i);
+		const M zero_a = L::eq_zero(a);
+		const V t = L::div(L::sub(vf, vi), a);
+		store(r.time + i, zero_a, t);
+		store(r.distance + i, zero_a, distance_from(vi, t, a));
+		mark(r.status + i, zero_a, FormulaV4Status::zero_acceleration);
+	}
+}
+
+static void distance_initial_velocity(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V t = L::load(r.time + i), vf = L::load(r.final_velocity + i), a = L::load(r.acceleration + i);
+		const V vi = L::sub(vf, L::mul(a, t));
+		L::store(r.initial_velocity + i, vi);
+		L::store(r.distance + i, distance_from(vi, t, a));
+	}
+}
+
+static void distance_final_velocity(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V t = L::load(r.time + i), vi = L::load(r.initial_velocity + i), a = L::load(r.acceleration + i);
+		L::store(r.final_velocity + i, L::add(vi, L::mul(a, t)));
+		L::store(r.distance + i, distance_from(vi, t, a));
+	}
+}
+
+static void distance_acceleration(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V t = L::load(r.time + i), vi = L::load(r.initial_velocity + i), vf = L::load(r.final_velocity + i);
+		const M zero_t = L::eq_zero(t);
+		const V a = L::div(L::sub(vf, vi), t);
+		store(r.acceleration + i, zero_t, a);
+		store(r.distance + i, zero_t, distance_from(vi, t, a));
+		mark(r.status + i, zero_t, FormulaV4Status::zero_time);
+	}
+}
+
+// if time is the first incognita...
+static void time_initial_velocity(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V d = L::load(r.distance + i), vf = L::load(r.final_velocity + i), a = L::load(r.acceleration + i);
+		const V temp = L::sub(L::mul(vf, vf), L::mul(L::set1(2), L::mul(a, d))); // vi^2 = vf^2 - 2ad
+		const M negative = L::lt_zero(temp);
+		const V vi = L::sqrt(temp);
+		M zero_vf;
+		const V t = time_from(d, vi, vf, a, zero_vf);
+		zero_vf = L::andnot(zero_vf, negative);
+		const M bad = L::or_(negative, zero_vf);
+		store(r.initial_velocity + i, bad, vi);
+		store(r.time + i, bad, t);
+		mark(r.status + i, negative, FormulaV4Status::negative_discriminant);
+		mark(r.status + i, zero_vf, FormulaV4Status::zero_final_velocity);
+	}
+}
+
+static void time_final_velocity(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V d = L::load(r.distance + i), vi = L::load(r.initial_velocity + i), a = L::load(r.acceleration + i);
+		const V temp = L::add(L::mul(vi, vi), L::mul(L::set1(2), L::mul(a, d)));
+		const M negative = L::lt_zero(temp);
+		const V vf = L::sqrt(temp);
+		M zero_vf;
+		const V t = time_from(d, vi, vf, a, zero_vf);
+		zero_vf = L::andnot(zero_vf, negative);
+		const M bad = L::or_(negative, zero_vf);
+		store(r.final_velocity + i, bad, vf);
+		store(r.time + i, bad, t);
+		mark(r.status + i, negative, FormulaV4Status::negative_discriminant);
+		mark(r.status + i, zero_vf, FormulaV4Status::zero_final_velocity);
+	}
+}
+
+static void time_acceleration(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V d = L::load(r.distance + i), vi = L::load(r.initial_velocity + i), vf = L::load(r.final_velocity + i);
+		const M zero_d = L::eq_zero(d);
+		const V a = L::div(L::sub(L::mul(vf, vf), L::mul(vi, vi)), L::mul(L::set1(2), d));
+		M zero_vf;
+		const V t = time_from(d, vi, vf, a, zero_vf);
+		zero_vf = L::andnot(zero_vf, zero_d);
+		const M bad = L::or_(zero_d, zero_vf);
+		store(r.acceleration + i, bad, a);
+		store(r.time + i, bad, t);
+		mark(r.status + i, zero_d, FormulaV4Status::zero_distance);
+		mark(r.status + i, zero_vf, FormulaV4Status::zero_final_velocity);
+	}
+}
+
+// both initial_velocity is the first incognita...
+static void initial_velocity_final_velocity(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V d = L::load(r.distance + i), t = L::load(r.time + i), a = L::load(r.acceleration + i);
+		const M zero_t = L::eq_zero(t);
+		const V vi = L::sub(L::div(d, t), L::mul(L::mul(L::set1(0.5), a), t));
+		store(r.initial_velocity + i, zero_t, vi);
+		store(r.final_velocity + i, zero_t, L::add(vi, L::mul(a, t)));
+		mark(r.status + i, zero_t, FormulaV4Status::zero_time);
+	}
+}
+
+static void initial_velocity_acceleration(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V d = L::load(r.distance + i), t = L::load(r.time + i), vf = L::load(r.final_velocity + i);
+		const M zero_t = L::eq_zero(t);
+		const V vi = L::sub(L::div(L::mul(L::set1(2), d), t), vf);
+		const M negative = L::andnot(L::lt_zero(vi), zero_t);
+		const M bad = L::or_(zero_t, negative);
+		store(r.initial_velocity + i, bad, vi);
+		store(r.acceleration + i, bad, L::div(L::sub(vf, vi), t));
+		mark(r.status + i, zero_t, FormulaV4Status::zero_time);
+		mark(r.status + i, negative, FormulaV4Status::negative_velocity);
+	}
+}
+
+// last case is final_velocity and acceleration...
+static void final_velocity_acceleration(const Run &r)
+{
+	for (size_t i = 0; i < r.rows; i += L::width)
+	{
+		const V d = L::load(r.distance + i), t = L::load(r.time + i), vi = L::load(r.initial_velocity + i);
+		const M zero_t = L::eq_zero(t);
+		const V vf = L::sub(L::div(L::mul(L::set1(2), d), t), vi);
+		const M negative = L::andnot(L::lt_zero(vf), zero_t);
+		const M bad = L::or_(zero_t, negative);
+		store(r.final_velocity + i, bad, vf);
+		store(r.acceleration + i, bad, L::div(L::sub(vf, vi), t));
+		mark(r.status + i, zero_t, FormulaV4Status::zero_time);
+		mark(r.status + i, negative, FormulaV4Status::negative_velocity);
+	}
+}
+
+// kernel for each mask of blank ValueIds (bits in ValueId order), null for anything but a supported pair
+static FormulaV4KernelsT<T> table()
+{
+	FormulaV4KernelsT<T> kernels = {};
+	kernels[(1 << 0) | (1 << 1)] = &distance_time;
+	kernels[(1 << 0) | (1 << 2)] = &distance_initial_velocity;
+	kernels[(1 << 0) | (1 << 3)] = &distance_final_velocity;
+	kernels[(1 << 0) | (1 << 4)] = &distance_acceleration;
+	kernels[(1 << 1) | (1 << 2)] = &time_initial_velocity;
+	kernels[(1 << 1) | (1 << 3)] = &time_final_velocity;
+	kernels[(1 << 1) | (1 << 4)] = &time_acceleration;
+	kernels[(1 << 2) | (1 << 3)] = &initial_velocity_final_velocity;
+	kernels[(1 << 2) | (1 << 4)] = &initial_velocity_acceleration;
+	kernels[(1 << 3) | (1 << 4)] = &final_velocity_acceleration;
+	return kernels;
+}
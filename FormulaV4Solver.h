@@ -0,0 +1,115 @@
+// FormulaV4Solver.h
+//
+// FormulaV4Solver<First, Second> solves one pair of unknowns chosen at
+// compile time, e.g. FormulaV4Solver<ValueId::distance, ValueId::time>.
+// There is no key to compute, no table lookup and no blank tracking: solve()
+// calls the FormulaV4a formula for that pair directly, taken from the same
+// table FormulaV4a dispatches through, so the two cannot diverge. A pair
+// with no formula does not compile.
+#pragma once
+#include "FormulaV4a.h"
+
+template <ValueId First, ValueId Second>
+class FormulaV4Solver
+{
+	static_assert(First != Second, "FormulaV4Solver needs two different unknowns");
+
+public:
+	FormulaV4Solver()
+	{
+	}
+
+	void set(ValueId id, double value)
+	{
+		values_.at(id) = value;
+	}
+
+	double get(ValueId id) const
+	{
+		return values_.variables_[static_cast<int>(id)];
+	}
+
+	void calculate()
+	{
+		const FormulaV4Status status = solve();
+		if (status != FormulaV4Status::ok)
+		{
+			throw FormulaV4aException(status_message(status));
+		}
+	}
+
+	// fills in First and Second from the other three values, which are taken as set
+	FormulaV4Status solve() noexcept
+	{
+		return check_status(formula<Values>()(values_));
+	}
+
+	// solve every row of a batch whose blanks are all First and Second; presence is not
+	// read, and the rows that solve are marked fully present
+	static void solve(FormulaV4aColumns &columns) noexcept
+	{
+		for (size_t i = 0; i < columns.rows; ++i)
+		{
+			FormulaV4a::Row row(columns, i);
+			const FormulaV4Status status = check_status(formula<FormulaV4a::Row>()(row));
+			columns.status[i] = status;
+			if (status == FormulaV4Status::ok)
+			{
+				columns.presence[i] = ALL_PRESENT;
+			}
+		}
+	}
+
+private:
+	static constexpr unsigned KEY = FormulaV4a::as_bit(First) | FormulaV4a::as_bit(Second);
+
+	static_assert(FormulaV4a::init_formulas<FormulaV4a::Row>()[KEY] != nullptr,
+		"FormulaV4Solver: no formula for this pair of unknowns");
+
+	// five plain values with the accessors the formulas use
+	struct Values
+	{
+		double& at(ValueId id)
+		{
+			return variables_[static_cast<int>(id)];
+		}
+
+		double& distance()
+		{
+			return at(ValueId::distance);
+		}
+
+		double& time()
+		{
+			return at(ValueId::time);
+		}
+
+		double& initial_velocity()
+		{
+			return at(ValueId::initial_velocity);
+		}
+
+		double& final_velocity()
+		{
+			return at(ValueId::final_velocity);
+		}
+
+		double& acceleration()
+		{
+			return at(ValueId::acceleration);
+		}
+
+		double variables_[VARIABLES] = {};
+	};
+
+	// a constant worked out at compile time, like the table of FormulaV4a::formula(), so even an
+	// unoptimized build does not build the table per call; optimized, the call is direct and inlined
+	template <class V>
+	static unsigned (*formula())(V&)
+	{
+		static constexpr unsigned (*pair_formula)(V&) = FormulaV4a::init_formulas<V>()[KEY];
+		return pair_formula;
+	}
+
+	Values values_;
+};
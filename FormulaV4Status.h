@@ -0,0 +1,151 @@
+// FormulaV4Status.h
+//
+// Outcome of a V4 solve, returned by the noexcept solve() entry points and
+// stored per row in batch mode. The throwing calculate() functions wrap these.
+//
+// The formulas themselves do not stop at a failed precondition: they always
+// compute a result and return a FormulaV4Check mask of the checks that
+// failed, leaving their callers to turn it into a status with check_status()
+// and then record it, skip the row or throw.
+#pragma once
+
+enum class FormulaV4Status : unsigned char
+{
+	ok,
+	too_many_blanks,		// more than two unknowns
+	too_few_blanks,			// less than two unknowns
+	unsupported_pair,		// two unknowns, but no formula for them
+	zero_time,				// divide by zero
+	zero_acceleration,
+	zero_distance,
+	zero_final_velocity,
+	negative_discriminant,	// square root of a negative number
+	negative_velocity,		// a solved velocity came out negative
+	invalid_row				// input row is not five numbers or blanks
+};
+
+// the message FormulaV4a has always used for each failure
+inline const char *status_message(FormulaV4Status status)
+{
+	switch (status)
+	{
+	case FormulaV4Status::ok:
+		return "OK";
+	case FormulaV4Status::too_many_blanks:
+		return "Error: more than two blank fields.";
+	case FormulaV4Status::too_few_blanks:
+		return "Error: less than two blank fields.";
+	case FormulaV4Status::unsupported_pair:
+		return "Error: did not find a valid combination of two empty fields.";
+	case FormulaV4Status::zero_time:
+		return "Error: divide by zero - time cannot be zero.";
+	case FormulaV4Status::zero_acceleration:
+		return "Error: divide by zero - acceleration cannot be zero.";
+	case FormulaV4Status::zero_distance:
+		return "Error: divide by zero - distance cannot be zero.";
+	case FormulaV4Status::zero_final_velocity:
+		return "Error: divide by zero - final velocity cannot be zero.";
+	case FormulaV4Status::negative_discriminant:
+	case FormulaV4Status::negative_velocity:
+		return "Error: inputs do not produce a valid solution.";
+	case FormulaV4Status::invalid_row:
+		return "Error: row does not hold five numbers or blank fields.";
+	}
+	return "Error: unknown status.";
+}
+
+// short machine-readable name, as written to status columns in text output
+inline const char *status_name(FormulaV4Status status)
+{
+	switch (status)
+	{
+	case FormulaV4Status::ok:
+		return "ok";
+	case FormulaV4Status::too_many_blanks:
+		return "too_many_blanks";
+	case FormulaV4Status::too_few_blanks:
+		return "too_few_blanks";
+	case FormulaV4Status::unsupported_pair:
+		return "unsupported_pair";
+	case FormulaV4Status::zero_time:
+		return "zero_time";
+	case FormulaV4Status::zero_acceleration:
+		return "zero_acceleration";
+	case FormulaV4Status::zero_distance:
+		return "zero_distance";
+	case FormulaV4Status::zero_final_velocity:
+		return "zero_final_velocity";
+	case FormulaV4Status::negative_discriminant:
+		return "negative_discriminant";
+	case FormulaV4Status::negative_velocity:
+		return "negative_velocity";
+	case FormulaV4Status::invalid_row:
+		return "invalid_row";
+	}
+	return "unknown";
+}
+
+// status for a mask of unknowns (one bit per variable) that has no formula
+inline FormulaV4Status unknowns_status(unsigned key)
+{
+	int blanks = 0;
+	for (; key != 0; key &= key - 1)
+	{
+		++blanks;
+	}
+	if (blanks > 2)
+	{
+		return FormulaV4Status::too_many_blanks;
+	}
+	if (blanks < 2)
+	{
+		return FormulaV4Status::too_few_blanks;
+	}
+	return FormulaV4Status::unsupported_pair;
+}
+
+// the preconditions the formulas check, one bit each. The bits are in the order the formulas
+// used to check them, so the lowest bit of a mask is the status they would have returned.
+struct FormulaV4Check
+{
+	static const unsigned zero_time = 1u << 0;
+	static const unsigned zero_acceleration = 1u << 1;
+	static const unsigned zero_distance = 1u << 2;
+	static const unsigned negative_discriminant = 1u << 3;
+	static const unsigned zero_final_velocity = 1u << 4;
+	static const unsigned negative_velocity = 1u << 5;
+	static const unsigned CHECKS = 6;
+
+	// bit if failed, without a branch
+	static constexpr unsigned check(bool failed, unsigned bit)
+	{
+		return static_cast<unsigned>(failed) * bit;
+	}
+};
+
+// status for a mask of failed FormulaV4Check bits; ok for none
+inline FormulaV4Status check_status(unsigned failed)
+{
+	struct Table
+	{
+		FormulaV4Status status[1 << FormulaV4Check::CHECKS];
+	};
+	static constexpr Table table = []
+	{
+		const FormulaV4Status first[FormulaV4Check::CHECKS] = { FormulaV4Status::zero_time,
+			FormulaV4Status::zero_acceleration, FormulaV4Status::zero_distance, FormulaV4Status::negative_discriminant,
+			FormulaV4Status::zero_final_velocity, FormulaV4Status::negative_velocity };
+		Table t = {};
+		for (unsigned mask = 1; mask < (1u << FormulaV4Check::CHECKS); ++mask)
+		{
+			unsigned bit = 0;
+			while (!(mask & (1u << bit)))
+			{
+				++bit;
+			}
+			t.status[mask] = first[bit];
+		}
+		return t;
+	}();
+	return table.status[failed & ((1u << FormulaV4Check::CHECKS) - 1)];
+}
@@ -0,0 +1,192 @@
+// FormulaV4Sweep.h
+//
+// Parameter sweeps: every combination of a range for each of three known
+// values, with the other two solved. Points are generated a chunk at a time
+// into one FormulaV4Batch and solved with the vector kernels, so the input
+// table never exists and a sweep of any size runs in the memory of a chunk.
+// Every row of a sweep has the same unknowns, so the kernels run full width.
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include "FormulaV4Csv.h"
+#include "FormulaV4Parallel.h"
+
+// first, first + step, ... up to last (within rounding); a single value when step is 0. A
+// negative step goes down from first to last.
+struct FormulaV4SweepRange
+{
+	double first;
+	double last;
+	double step;
+
+	// finite bounds and step, a step of 0 only when first == last, a step that leads from first
+	// towards last, and a count that fits a size_t
+	bool valid() const
+	{
+		if (!std::isfinite(first) || !std::isfinite(last) || !std::isfinite(step))
+		{
+			return false;
+		}
+		if (first == last)
+		{
+			return true;
+		}
+		const double steps = (last - first) / step;
+		return step != 0 && steps >= 0 && steps < 0x1p63;
+	}
+
+	// for a valid() range
+	size_t count() const
+	{
+		if (first == last)
+		{
+			return 1;
+		}
+		return static_cast<size_t>(std::floor((last - first) / step + 1e-9)) + 1;
+	}
+
+	// computed from the index, so long sweeps do not accumulate rounding
+	double at(size_t i) const
+	{
+		return first + static_cast<double>(i) * step;
+	}
+};
+
+class FormulaV4Sweep
+{
+public:
+	static const size_t CHUNK_ROWS = 1 << 16;
+
+	FormulaV4Sweep(): varied_(0), next_(0)
+	{
+	}
+
+	// sweep id over range; the two ValueIds without a range are the unknowns
+	void vary(ValueId id, FormulaV4SweepRange range)
+	{
+		if (!range.valid())
+		{
+			throw FormulaV4aException("Error: a sweep range needs finite values and a nonzero step towards its last value.");
+		}
+		ranges_[static_cast<int>(id)] = range;
+		varied_ |= 1u << static_cast<int>(id);
+		next_ = 0;
+	}
+
+	void fix(ValueId id, double value)
+	{
+		vary(id, FormulaV4SweepRange{ value, value, 0 });
+	}
+
+	// the bitmask of unknown ValueIds
+	unsigned unknowns() const
+	{
+		return ~varied_ & ALL_PRESENT;
+	}
+
+	// number of points; the last varied ValueId changes fastest. Throws if it does not fit a size_t.
+	size_t size() const
+	{
+		check();
+		size_t points = 1;
+		for (int id = 0; id < VARIABLES; ++id)
+		{
+			if (varied_ & (1u << id))
+			{
+				const size_t count = ranges_[id].count();
+				if (points > SIZE_MAX / count)
+				{
+					throw FormulaV4aException("Error: a sweep has too many points.");
+				}
+				points *= count;
+			}
+		}
+		return points;
+	}
+
+	// generate points [first, first + rows) into batch, unsolved; rows is capped at the capacity
+	void fill(FormulaV4Batch &batch, size_t first, size_t rows) const
+	{
+		FormulaV4TraceSpan span("generate");
+		check();
+		rows = std::min(rows, batch.capacity());
+		int known[3];
+		size_t index[3], count[3];
+		size_t rest = first;
+		for (int k = 2, id = VARIABLES - 1; id >= 0; --id)
+		{
+			if (varied_ & (1u << id))
+			{
+				known[k] = id;
+				count[k] = ranges_[id].count();
+				index[k] = rest % count[k];
+				rest /= count[k];
+				--k;
+			}
+		}
+
+		// odometer over the three indices, with the last one fastest
+		const unsigned char presence = static_cast<unsigned char>(varied_);
+		for (size_t row = 0; row < rows; ++row)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				batch.values[known[k]][row] = ranges_[known[k]].at(index[k]);
+			}
+			batch.presence[row] = presence;
+			for (int k = 2; k >= 0 && ++index[k] == count[k]; --k)
+			{
+				index[k] = 0;
+			}
+		}
+		batch.rows = rows;
+	}
+
+	// pull interface: the next chunk of solved points into batch; false once the sweep is done
+	bool next(FormulaV4Batch &batch, FormulaV4ThreadPool &pool)
+	{
+		const size_t points = size();
+		if (next_ >= points)
+		{
+			return false;
+		}
+		fill(batch, next_, points - next_);
+		next_ += batch.rows;
+		FormulaV4aColumns columns = batch.view();
+		FormulaV4Parallel::solve(columns, pool);
+		return true;
+	}
+
+	// index of the first point of the chunk next() returns
+	size_t position() const
+	{
+		return next_;
+	}
+
+	// push interface: sink(const FormulaV4aColumns &chunk, size_t first_point) for each solved chunk in order;
+	// the chunk lives in arena when one is given
+	template <class Sink>
+	void run(Sink sink, FormulaV4ThreadPool &pool, size_t chunk_rows = CHUNK_ROWS, FormulaV4Arena *arena = nullptr)
+	{
+		FormulaV4Batch batch(std::max<size_t>(chunk_rows, 1), arena);
+		next_ = 0;
+		for (size_t first = next_; next(batch, pool); first = next_)
+		{
+			const FormulaV4aColumns columns = batch.view();
+			sink(columns, first);
+		}
+	}
+
+private:
+	void check() const
+	{
+		if (unknowns_status(unknowns()) != FormulaV4Status::unsupported_pair)
+		{
+			throw FormulaV4aException("Error: a sweep needs ranges for exactly three values.");
+		}
+	}
+
+	FormulaV4SweepRange ranges_[VARIABLES];
+	unsigned varied_;
+	size_t next_;
+};
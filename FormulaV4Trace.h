@@ -0,0 +1,232 @@
+// FormulaV4Trace.h
+//
+// Timed spans around the stages of a batch job (read, parse, solve,
+// validate, format, write), kept in a ring buffer per thread and written
+// out as Chrome trace JSON for chrome://tracing or ui.perfetto.dev:
+//
+//   FormulaV4TraceSpan span("parse");	// from here to the end of the scope
+//
+// Build with FORMULAV4_TRACE=1 to compile the spans in; otherwise a span is
+// an empty object and costs nothing. Compiled in, spans record only after
+// FormulaV4Trace::enable(true), and cost a relaxed load and a branch before
+// that. A thread's ring keeps its last RING_EVENTS spans, so tracing a long
+// job in production keeps the most recent part of it.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "FormulaV4Metrics.h"
+
+#ifndef FORMULAV4_TRACE
+#define FORMULAV4_TRACE 0
+#endif
+
+class FormulaV4Trace
+{
+public:
+	static const bool compiled = FORMULAV4_TRACE != 0;
+	static const size_t RING_EVENTS = 1 << 16;
+
+	// start or stop recording; does nothing when compiled out
+	static void enable(bool on)
+	{
+#if FORMULAV4_TRACE
+		FormulaV4Clock::ticks_per_ns();		// calibrate now rather than during the first write()
+		switch_().store(on, std::memory_order_relaxed);
+#else
+		(void)on;
+#endif
+	}
+
+	static bool enabled()
+	{
+#if FORMULAV4_TRACE
+		return switch_().load(std::memory_order_relaxed);
+#else
+		return false;
+#endif
+	}
+
+	// a span of name over ticks [begin, end) of FormulaV4Clock; name must outlive the trace
+	static void record(const char *name, uint64_t begin, uint64_t end)
+	{
+#if FORMULAV4_TRACE
+		Ring &ring = local();
+		const uint64_t n = ring.written.load(std::memory_order_relaxed);
+		Event &event = ring.events[n % RING_EVENTS];
+		event.name = name;
+		event.begin = begin;
+		event.end = end;
+		ring.written.store(n + 1, std::memory_order_release);
+#else
+		(void)name;
+		(void)begin;
+		(void)end;
+#endif
+	}
+
+	// every recorded span as a Chrome trace, one thread per ring; call it while no thread is
+	// recording. Returns false if out could not be written.
+	static bool write(FILE *out)
+	{
+		bool ok = std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out) >= 0;
+#if FORMULAV4_TRACE
+		Registry &registry = rings();
+		std::lock_guard<std::mutex> lock(registry.lock);
+		uint64_t origin = UINT64_MAX;
+		for (auto &ring : registry.rings)
+		{
+			ring->each([&](const Event &event) { origin = std::min(origin, event.begin); });
+		}
+		const double ticks_per_us = FormulaV4Clock::ticks_per_ns() * 1e3;
+		const char *comma = "";
+		for (size_t tid = 0; tid < registry.rings.size(); ++tid)
+		{
+			registry.rings[tid]->each([&](const Event &event)
+			{
+				ok = std::fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"formulav4\",\"ph\":\"X\",\"pid\":0,\"tid\":%zu,"
+					"\"ts\":%.3f,\"dur\":%.3f}", comma, event.name, tid, (event.begin - origin) / ticks_per_us,
+					(event.end - event.begin) / ticks_per_us) > 0 && ok;
+				comma = ",";
+			});
+		}
+#endif
+		return std::fputs("\n]}\n", out) >= 0 && ok;
+	}
+
+	// drop every recorded span
+	static void clear()
+	{
+#if FORMULAV4_TRACE
+		Registry &registry = rings();
+		std::lock_guard<std::mutex> lock(registry.lock);
+		for (auto &ring : registry.rings)
+		{
+			ring->written.store(0, std::memory_order_relaxed);
+		}
+#endif
+	}
+
+#if FORMULAV4_TRACE
+private:
+	struct Event
+	{
+		const char *name;
+		uint64_t begin;
+		uint64_t end;
+	};
+
+	// one thread's spans; only the owning thread writes them
+	struct Ring
+	{
+		template <class F>
+		void each(F f) const
+		{
+			const uint64_t n = written.load(std::memory_order_acquire);
+			for (uint64_t i = n > RING_EVENTS ? n - RING_EVENTS : 0; i < n; ++i)
+			{
+				f(events[i % RING_EVENTS]);
+			}
+		}
+
+		Event events[RING_EVENTS];
+		std::atomic<uint64_t> written{ 0 };
+		std::atomic<bool> in_use{ false };
+	};
+
+	// as in FormulaV4Metrics, a ring outlives its thread and is reused by the next one
+	struct Registry
+	{
+		std::mutex lock;
+		std::vector<std::unique_ptr<Ring>> rings;
+	};
+
+	static std::atomic<bool> &switch_()
+	{
+		static std::atomic<bool> on{ false };
+		return on;
+	}
+
+	static Registry &rings()
+	{
+		static Registry *registry = new Registry;
+		return *registry;
+	}
+
+	struct Owner
+	{
+		Ring *ring = nullptr;
+
+		~Owner()
+		{
+			if (ring)
+			{
+				ring->in_use.store(false, std::memory_order_release);
+			}
+		}
+	};
+
+	static Ring &local()
+	{
+		thread_local Owner owner;
+		if (!owner.ring)
+		{
+			Registry &registry = rings();
+			std::lock_guard<std::mutex> lock(registry.lock);
+			for (auto &ring : registry.rings)
+			{
+				bool free = false;
+				if (ring->in_use.compare_exchange_strong(free, true, std::memory_order_acquire))
+				{
+					owner.ring = ring.get();
+					break;
+				}
+			}
+			if (!owner.ring)
+			{
+				registry.rings.emplace_back(new Ring);
+				owner.ring = registry.rings.back().get();
+				owner.ring->in_use.store(true, std::memory_order_relaxed);
+			}
+		}
+		return *owner.ring;
+	}
+#endif
+};
+
+// records its scope as a span while tracing is enabled
+class FormulaV4TraceSpan
+{
+public:
+#if FORMULAV4_TRACE
+	explicit FormulaV4TraceSpan(const char *name)
+		: name_(name), begin_(FormulaV4Trace::enabled() ? FormulaV4Clock::now() : 0)
+	{
+	}
+
+	~FormulaV4TraceSpan()
+	{
+		if (begin_ != 0)
+		{
+			FormulaV4Trace::record(name_, begin_, FormulaV4Clock::now());
+		}
+	}
+#else
+	explicit FormulaV4TraceSpan(const char *)
+	{
+	}
+#endif
+
+	FormulaV4TraceSpan(const FormulaV4TraceSpan&) = delete;
+	FormulaV4TraceSpan& operator=(const FormulaV4TraceSpan&) = delete;
+
+#if FORMULAV4_TRACE
+private:
+	const char *name_;
+	uint64_t begin_;
+#endif
+};
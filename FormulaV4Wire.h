@@ -0,0 +1,207 @@
+// FormulaV4Wire.h
+//
+// Binary framing of the local solver service (FormulaV4Server.h) and the
+// socket plumbing its clients share. A request is a FormulaV4WireHeader
+// followed by header.rows FormulaV4Problem records; the reply is a header
+// with the same id followed by the same records solved, each with its
+// status. Everything is in the native byte order and layout, so the
+// service is for clients on the same host, over a Unix domain socket or
+// loopback TCP. Addresses are written "unix:/path/to/socket" or
+// "tcp:port" (127.0.0.1 only). POSIX only.
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "FormulaV4Problem.h"
+
+class FormulaV4WireException: public std::exception
+{
+public:
+	FormulaV4WireException(std::string message): msg_(message)
+	{
+	}
+
+	std::string message() const
+	{
+		return msg_;
+	}
+
+private:
+	std::string msg_;
+};
+
+struct FormulaV4WireHeader
+{
+	static const uint32_t REQUEST = 0x51345646;		// "FV4Q" in little-endian order
+	static const uint32_t REPLY = 0x52345646;		// "FV4R"
+	static const uint32_t MAX_ROWS = 1 << 16;		// per request
+
+	enum Error : uint32_t
+	{
+		none,
+		bad_magic,			// not a request; the server closes the connection
+		too_many_rows		// more than MAX_ROWS; the server closes the connection
+	};
+
+	uint32_t magic;
+	uint32_t id;				// chosen by the client and echoed in the reply
+	uint32_t rows;				// records that follow
+	uint32_t error;				// reply only
+	uint64_t wait_ns;			// reply only: from the arrival of the request to the start of its batch
+	uint64_t solve_ns;			// reply only: time in the kernels of the micro-batch that held the request
+};
+
+static_assert(sizeof(FormulaV4WireHeader) == 32, "FormulaV4WireHeader is part of the wire format");
+static_assert(sizeof(FormulaV4Problem) == 48, "FormulaV4Problem is part of the wire format");
+
+namespace FormulaV4Wire
+{
+	// a sockaddr for address, in storage; returns its length
+	inline socklen_t resolve(const std::string &address, sockaddr_storage &storage)
+	{
+		std::memset(&storage, 0, sizeof(storage));
+		if (address.compare(0, 5, "unix:") == 0)
+		{
+			sockaddr_un &un = reinterpret_cast<sockaddr_un&>(storage);
+			const std::string path = address.substr(5);
+			if (path.empty() || path.size() >= sizeof(un.sun_path))
+			{
+				throw FormulaV4WireException("Error: bad socket path in " + address + ".");
+			}
+			un.sun_family = AF_UNIX;
+			std::memcpy(un.sun_path, path.c_str(), path.size() + 1);
+			return static_cast<socklen_t>(sizeof(sockaddr_un));
+		}
+		if (address.compare(0, 4, "tcp:") == 0)
+		{
+			char *end;
+			const unsigned long port = std::strtoul(address.c_str() + 4, &end, 10);
+			if (*end == '\0' && end != address.c_str() + 4 && port < 65536)
+			{
+				sockaddr_in &in = reinterpret_cast<sockaddr_in&>(storage);
+				in.sin_family = AF_INET;
+				in.sin_port = htons(static_cast<uint16_t>(port));
+				in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+				return static_cast<socklen_t>(sizeof(sockaddr_in));
+			}
+		}
+		throw FormulaV4WireException("Error: " + address + " is not unix:/path or tcp:port.");
+	}
+
+	[[noreturn]] inline void fail(const std::string &what)
+	{
+		throw FormulaV4WireException("Error: " + what + ": " + std::strerror(errno));
+	}
+
+	// small frames go out at once on TCP
+	inline void no_delay(int fd, const sockaddr_storage &storage)
+	{
+		if (storage.ss_family == AF_INET)
+		{
+			const int on = 1;
+			::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}
+	}
+
+	// a non-blocking listening socket on address; a stale Unix socket file is replaced
+	inline int listen(const std::string &address)
+	{
+		sockaddr_storage storage;
+		const socklen_t length = resolve(address, storage);
+		const int fd = ::socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+		{
+			fail("cannot create a socket for " + address);
+		}
+		if (storage.ss_family == AF_UNIX)
+		{
+			::unlink(reinterpret_cast<sockaddr_un&>(storage).sun_path);
+		}
+		else
+		{
+			const int on = 1;
+			::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		}
+		if (::bind(fd, reinterpret_cast<sockaddr*>(&storage), length) != 0 || ::listen(fd, SOMAXCONN) != 0)
+		{
+			const int error = errno;
+			::close(fd);
+			errno = error;
+			fail("cannot listen on " + address);
+		}
+		return fd;
+	}
+
+	// a blocking connection to address
+	inline int connect(const std::string &address)
+	{
+		sockaddr_storage storage;
+		const socklen_t length = resolve(address, storage);
+		const int fd = ::socket(storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+		{
+			fail("cannot create a socket for " + address);
+		}
+		if (::connect(fd, reinterpret_cast<sockaddr*>(&storage), length) != 0)
+		{
+			const int error = errno;
+			::close(fd);
+			errno = error;
+			fail("cannot connect to " + address);
+		}
+		no_delay(fd, storage);
+		return fd;
+	}
+
+	// all of bytes to a blocking socket; flags MSG_MORE holds them back for what follows
+	inline void send_all(int fd, const void *data, size_t bytes, int flags = 0)
+	{
+		const char *p = static_cast<const char*>(data);
+		while (bytes != 0)
+		{
+			const ssize_t sent = ::send(fd, p, bytes, flags | MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (sent <= 0)
+			{
+				fail("cannot send to the solver service");
+			}
+			p += sent;
+			bytes -= static_cast<size_t>(sent);
+		}
+	}
+
+	// exactly bytes from a blocking socket
+	inline void receive_all(int fd, void *data, size_t bytes)
+	{
+		char *p = static_cast<char*>(data);
+		while (bytes != 0)
+		{
+			const ssize_t received = ::recv(fd, p, bytes, 0);
+			if (received < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (received == 0)
+			{
+				throw FormulaV4WireException("Error: the solver service closed the connection.");
+			}
+			if (received < 0)
+			{
+				fail("cannot receive from the solver service");
+			}
+			p += received;
+			bytes -= static_cast<size_t>(received);
+		}
+	}
+}
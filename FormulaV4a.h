@@ -3,11 +3,14 @@
 #include <exception>
 #include <string>
 #include <array>
+#include <cmath>
+#include <cstddef>
 #include <sstream>
-#include <unordered_map>
-#include <functional>
+#include "FormulaV4Metrics.h"
+#include "FormulaV4Status.h"
 
 const int VARIABLES = 5;
+const unsigned ALL_PRESENT = (1 << VARIABLES) - 1;
 
 enum class ValueId: int
 {
@@ -18,20 +21,6 @@ enum class ValueId: int
 	acceleration
 };
 
-// specialize std::hash to support hashing a pair of ValueId
-namespace std
-{
-	template <>
-	class hash<std::pair<ValueId, ValueId>>
-	{
-	public:
-		size_t operator()(const std::pair<ValueId, ValueId> &p) const
-		{
-			return hash<ValueId>()(p.first) ^ hash<ValueId>()(p.second);
-		}
-	};
-};
-
 //FormulaV4aException communicates parse and calculation errors back to the main program
 class FormulaV4aException: public std::exception
 {
@@ -49,10 +38,35 @@ private:
 	std::string msg_;
 };
 
-class FormulaV4a
+template <ValueId First, ValueId Second>
+class FormulaV4Solver;
+class FormulaV4ProblemSolver;
+
+// FormulaV4aColumns describes a batch of problems stored as structure-of-arrays.
+// Each column holds one variable for every row, and bit N of presence[row] is on
+// when the value with ValueId N is known. status receives each row's outcome; it
+// is required by solve() and optional (null) for calculate(). The caller owns all
+// the storage.
+template <class T>
+struct FormulaV4aColumnsT
+{
+	T *distance;
+	T *time;
+	T *initial_velocity;
+	T *final_velocity;
+	T *acceleration;
+	unsigned char *presence;
+	FormulaV4Status *status;
+	size_t rows;
+};
+
+// FormulaV4aT<T> works in scalar type T: float, double (FormulaV4a) or
+// FormulaV4DoubleDouble; constants are converted to T so float stays float
+template <class T>
+class FormulaV4aT
 {
 public:
-	FormulaV4a(): formulas_(init_formulas())
+	FormulaV4aT()
 	{
 	}
 	
@@ -65,84 +79,136 @@ public:
 		}
 	}
 
-	void set(ValueId id, double value)
+	void set(ValueId id, T value)
 	{
 		values_.set(id, value);
 	}
 
-	double get(ValueId id) const
+	T get(ValueId id) const
 	{
 		return values_.get(id);
 	}
 
+	bool is_blank(ValueId id) const
+	{
+		return values_.is_blank(id);
+	}
+
 	void calculate()
 	{
-		std::vector<ValueId> unknowns;
+		const FormulaV4Status status = solve();
+		if (status != FormulaV4Status::ok)
+		{
+			throw FormulaV4aException(status_message(status));
+		}
+	}
+
+	// calculate() without exceptions; on failure the blank fields stay blank
+	FormulaV4Status solve() noexcept
+	{
+		const uint64_t start = FormulaV4Metrics::start();
 
-		// find the unknowns
+		// find the unknowns, one bit per blank ValueId
+		unsigned key = 0;
 		for (int id = 0; id < VARIABLES; ++id)
 		{
 			if (values_.is_blank(static_cast<ValueId>(id)))
 			{
-				unknowns.push_back(static_cast<ValueId>(id));
+				key |= as_bit(static_cast<ValueId>(id));
 			}
 		}
 
-		// two and only two fields should be blank
-		if (unknowns.size() > 2)
+		const FormulaV4Status status = solve(key);
+		FormulaV4Metrics::record(key, status, start);
+		return status;
+	}
+
+	// solve every row of a columnar batch in place, using the same formulas as calculate()
+	// solved rows are marked fully present; the first invalid row throws and stops the batch
+	static void calculate(FormulaV4aColumnsT<T> &columns)
+	{
+		for (size_t i = 0; i < columns.rows; ++i)
 		{
-			throw FormulaV4aException("Error: more than two blank fields.");
+			const FormulaV4Status status = solve_row(columns, i);
+			if (columns.status != nullptr)
+			{
+				columns.status[i] = status;
+			}
+			if (status != FormulaV4Status::ok)
+			{
+				throw FormulaV4aException(std::string(status_message(status)) + " (row " + std::to_string(i) + ")");
+			}
 		}
-		if (unknowns.size() < 2)
+	}
+
+	// batch calculate() without exceptions: every row is attempted, its outcome is written
+	// to columns.status, and only the rows that solved are marked fully present
+	static void solve(FormulaV4aColumnsT<T> &columns) noexcept
+	{
+		for (size_t i = 0; i < columns.rows; ++i)
 		{
-			throw FormulaV4aException("Error: less than two blank fields.");
+			columns.status[i] = solve_row(columns, i);
 		}
+	}
 
-		// find the right formula
-		auto formula_ptr = formulas_.find(std::make_pair(unknowns[0], unknowns[1]));
-		if (formula_ptr == formulas_.end())
+private:
+	FormulaV4Status solve(unsigned key) noexcept
+	{
+		// find the right formula; only the ten valid pairs of blanks have one
+		auto formulaV4a = formula<Values>(key);
+		if (formulaV4a == nullptr)
 		{
-			throw FormulaV4aException("Error: did not find a valid combination of two empty fields.");
+			return unknowns_status(key);
 		}
-		auto formulaV4a = formula_ptr->second;
 
 		// call the formula
-		formulaV4a(values_);
+		const FormulaV4Status status = check_status(formulaV4a(values_));
+		if (status != FormulaV4Status::ok)
+		{
+			return status;
+		}
 
 		// now all fields should be set
 		for (auto &val : values_.variables_)
 		{
 			val.is_blank = false;
 		}
+		return status;
 	}
 
-private:
+	// solves one fixed pair with the formulas below
+	template <ValueId First, ValueId Second>
+	friend class FormulaV4Solver;
+
+	// solves FormulaV4Problem records with the same formulas
+	friend class FormulaV4ProblemSolver;
+
 	struct Value
 	{
 		Value(): v(0.0), is_blank(true)
 		{
 		}
 
-		double v;
+		T v;
 		bool is_blank;
 	};
 
 
 	struct Values
 	{
-		void set(ValueId id, double value)
+		void set(ValueId id, T value)
 		{
 			auto &val = variables_.at(static_cast<int>(id));
 			val.v = value;
 			val.is_blank = false;
 		}
 
-		double get(ValueId id) const
+		T get(ValueId id) const
 		{
 			return variables_.at(static_cast<int>(id)).v;
 		}
 
-		double& at(ValueId id)
+		T& at(ValueId id)
 		{
 			return variables_.at(static_cast<int>(id)).v;
 		}
@@ -152,199 +218,294 @@ private:
 			return variables_.at(static_cast<int>(id)).is_blank;
 		}
 
-		double& distance()
+		T& distance()
 		{
 			return at(ValueId::distance);
 		}
 
-		double& time()
+		T& time()
 		{
 			return at(ValueId::time);
 		}
 
-		double& initial_velocity()
+		T& initial_velocity()
 		{
 			return at(ValueId::initial_velocity);
 		}
 
-		double& final_velocity()
+		T& final_velocity()
 		{
 			return at(ValueId::final_velocity);
 		}
 
-		double& acceleration()
+		T& acceleration()
 		{
 			return at(ValueId::acceleration);
 		}
 
-		// more helpers
-		double at2() const  //acceleration * time^2
+		std::array<Value, VARIABLES> variables_;
+	};
+
+	// one row of a FormulaV4aColumns batch, with the same accessors as Values
+	struct Row
+	{
+		Row(FormulaV4aColumnsT<T> &columns, size_t row): columns_(columns), row_(row)
 		{
-			return get(ValueId::acceleration) * pow(get(ValueId::time), 2);
 		}
 
-		double ad() const  //acceleration * distance
+		T& distance()
 		{
-			return get(ValueId::acceleration) * get(ValueId::distance);
+			return columns_.distance[row_];
 		}
 
-		double initial_velocity2() const  //vi^2
+		T& time()
 		{
-			return pow(get(ValueId::initial_velocity), 2);
+			return columns_.time[row_];
 		}
 
-		double final_velocity2() const  //vf^2
+		T& initial_velocity()
 		{
-			return pow(get(ValueId::final_velocity), 2);
+			return columns_.initial_velocity[row_];
 		}
 
-		void calculate_distance()
+		T& final_velocity()
 		{
-			distance() = initial_velocity() * time() + 0.5 * at2();
+			return columns_.final_velocity[row_];
 		}
 
-		void calculate_time()
+		T& acceleration()
 		{
-			if (acceleration() == 0.0)
-			{
-				if (final_velocity() == 0.0)
-				{
-					throw FormulaV4aException("Error: divide by zero - final velocity cannot be zero.");
-				}
-				time() = distance() / final_velocity();
-			}
-			else
-			{
-				if (acceleration() == 0.0)
-				{
-					throw FormulaV4aException("Error: divide by zero - acceleration cannot be zero.");
-				}
-				time() = (final_velocity() - initial_velocity()) / acceleration();
-			}
+			return columns_.acceleration[row_];
 		}
 
-		std::array<Value, VARIABLES> variables_;
+		FormulaV4aColumnsT<T> &columns_;
+		size_t row_;
 	};
 
-	typedef std::unordered_map<std::pair<ValueId, ValueId>, std::function<void (Values&)>> Formulas;
+	// indexed by the bitmask of blank ValueIds; null for anything but a supported pair. A
+	// formula returns the FormulaV4Check bits that failed.
+	template <class V>
+	using Formulas = std::array<unsigned (*)(V&), 1 << VARIABLES>;
+
+	static FormulaV4Status solve_row(FormulaV4aColumnsT<T> &columns, size_t i) noexcept
+	{
+		// bit N of the key is on when ValueId N is blank
+		const uint64_t start = FormulaV4Metrics::start();
+		const unsigned key = ~columns.presence[i] & ALL_PRESENT;
+		auto row_formula = formula<Row>(key);
+		FormulaV4Status status = unknowns_status(key);
+		if (row_formula != nullptr)
+		{
+			Row row(columns, i);
+			status = check_status(row_formula(row));
+			if (status == FormulaV4Status::ok)
+			{
+				columns.presence[i] = ALL_PRESENT;
+			}
+		}
+		FormulaV4Metrics::record(key, status, start);
+		return status;
+	}
 
 	Values values_;
-	Formulas formulas_;
 
-	static Formulas init_formulas()
+	static T sqrt_(T x)
 	{
-		Formulas formulas;
+		using std::sqrt;
+		return sqrt(x);		// FormulaV4DoubleDouble's is found by argument-dependent lookup
+	}
 
-		// if distance if the first incognita...
-		formulas[std::make_pair(ValueId::distance, ValueId::time)] =
-			[](Values &v)
-			{
-				if (v.acceleration() == 0.0)
-				{
-					throw FormulaV4aException("Error: divide by zero - acceleration cannot be zero.");
-				}
-				v.time() = (v.final_velocity() - v.initial_velocity()) / v.acceleration();
-				v.calculate_distance();
-			};
-		formulas[std::make_pair(ValueId::distance, ValueId::initial_velocity)] =
-			[](Values &v)
-			{
-				v.initial_velocity() = v.final_velocity() - v.acceleration() * v.time();
-				v.calculate_distance();
-			};
-		formulas[std::make_pair(ValueId::distance, ValueId::final_velocity)] =
-			[](Values &v)
-			{
-				v.final_velocity() = v.initial_velocity() + v.acceleration() * v.time();
-				v.calculate_distance();
-			};
-		formulas[std::make_pair(ValueId::distance, ValueId::acceleration)] =
-			[](Values &v)
-			{
-				if (v.time() == 0.0)
-				{
-					throw FormulaV4aException("Error: divide by zero - time cannot be zero.");
-				}
-				v.acceleration() = (v.final_velocity() - v.initial_velocity()) / v.time();
-				v.calculate_distance();
-			};
-
-		// if time is the first incognita...
-		formulas[std::make_pair(ValueId::time, ValueId::initial_velocity)] =
-			[](Values &v)
-			{
-				double temp = v.final_velocity2() - 2 * v.ad(); // vi^2 = vf^2 - 2ad
-				if (temp < 0)
-				{
-					throw FormulaV4aException("Error: inputs do not produce a valid solution.");
-				}
-				v.initial_velocity() = sqrt(temp);
-				v.calculate_time();
-			};
-		formulas[std::make_pair(ValueId::time, ValueId::final_velocity)] =
-			[](Values &v)
-			{
-				double temp = v.initial_velocity2() + 2 * v.ad();
-				if (temp < 0)
-				{
-					throw FormulaV4aException("Error: inputs do not produce a valid solution.");
-				}
-				v.final_velocity() = sqrt(temp);
-				v.calculate_time();
-			};
-		formulas[std::make_pair(ValueId::time, ValueId::acceleration)] =
-			[](Values &v)
-			{
-				if (v.distance() == 0.0)
-				{
-					throw FormulaV4aException("Error: divide by zero - distance cannot be zero.");
-				}
-				v.acceleration() = (v.final_velocity2() - v.initial_velocity2()) / (2 * v.distance());
-				v.calculate_time();
-			};
-
-		// both initial_velocity is the first incognita...
-		formulas[std::make_pair(ValueId::initial_velocity, ValueId::final_velocity)] =
-			[](Values &v)
-			{
-				if (v.time() == 0.0)
-				{
-					throw FormulaV4aException("Error: divide by zero - time cannot be zero.");
-				}
-				v.initial_velocity() = (v.distance() / v.time()) - 0.5 * v.acceleration() * v.time();
-				v.final_velocity() = v.initial_velocity() + v.acceleration() * v.time();
-			};
-		formulas[std::make_pair(ValueId::initial_velocity, ValueId::acceleration)] =
-			[](Values &v)
-			{
-				if (v.time() == 0.0)
-				{
-					throw FormulaV4aException("Error: divide by zero - time cannot be zero.");
-				}
-				v.initial_velocity() = (2 * v.distance()) / v.time() - v.final_velocity();
-				if (v.initial_velocity() < 0)
-				{
-					throw FormulaV4aException("Error: inputs do not produce a valid solution.");
-				}
-				v.acceleration() = (v.final_velocity() - v.initial_velocity()) / v.time();
-			};
-
-		// last case is final_velocity and acceleration...
-		formulas[std::make_pair(ValueId::final_velocity, ValueId::acceleration)] =
-			[](Values &v)
-			{
-				if (v.time() == 0.0)
-				{
-					throw FormulaV4aException("Error: divide by zero - time cannot be zero.");
-				}
-				v.final_velocity() = (2 * v.distance()) / v.time() - v.initial_velocity();
-				if (v.final_velocity() < 0)
-				{
-					throw FormulaV4aException("Error: inputs do not produce a valid solution.");
-				}
-				v.acceleration() = (v.final_velocity() - v.initial_velocity()) / v.time();
-			};
+	static constexpr unsigned as_bit(ValueId id)
+	{
+		return 1u << static_cast<int>(id);
+	}
+
+	// the ten pair formulas, written against any type with the Values accessors (Values or Row).
+	// Each is straight-line code: it computes its unknowns whatever the inputs, collects the checks
+	// that failed, and stores the unknowns only if none did, with a select rather than a branch.
+
+	// field = value unless a check failed
+	static void put(T &field, unsigned failed, T value)
+	{
+		field = failed ? field : value;
+	}
+
+	static unsigned check(bool failed, unsigned bit)
+	{
+		return FormulaV4Check::check(failed, bit);
+	}
+
+	// distance = initial_velocity * time + 0.5 * (acceleration * time^2)
+	static T distance_from(T vi, T t, T a)
+	{
+		return vi * t + T(0.5) * (a * (t * t));
+	}
+
+	// time from the velocities, or from distance when acceleration is zero; both are worked out
+	// and one is kept
+	static T time_from(T d, T vi, T vf, T a, unsigned &failed)
+	{
+		const bool zero_a = a == 0.0;
+		failed |= check(zero_a && vf == 0.0, FormulaV4Check::zero_final_velocity);
+		const T by_distance = d / vf;
+		const T by_velocities = (vf - vi) / a;
+		return zero_a ? by_distance : by_velocities;
+	}
+
+	// if distance if the first incognita...
+	template <class V>
+	static unsigned distance_time(V &v)
+	{
+		const T vi = v.initial_velocity(), vf = v.final_velocity(), a = v.acceleration();
+		const unsigned failed = check(a == 0.0, FormulaV4Check::zero_acceleration);
+		const T t = (vf - vi) / a;
+		put(v.time(), failed, t);
+		put(v.distance(), failed, distance_from(vi, t, a));
+		return failed;
+	}
+
+	template <class V>
+	static unsigned distance_initial_velocity(V &v)
+	{
+		const T t = v.time(), vf = v.final_velocity(), a = v.acceleration();
+		const T vi = vf - a * t;
+		v.initial_velocity() = vi;
+		v.distance() = distance_from(vi, t, a);
+		return 0;
+	}
+
+	template <class V>
+	static unsigned distance_final_velocity(V &v)
+	{
+		const T t = v.time(), vi = v.initial_velocity(), a = v.acceleration();
+		v.final_velocity() = vi + a * t;
+		v.distance() = distance_from(vi, t, a);
+		return 0;
+	}
+
+	template <class V>
+	static unsigned distance_acceleration(V &v)
+	{
+		const T t = v.time(), vi = v.initial_velocity(), vf = v.final_velocity();
+		const unsigned failed = check(t == 0.0, FormulaV4Check::zero_time);
+		const T a = (vf - vi) / t;
+		put(v.acceleration(), failed, a);
+		put(v.distance(), failed, distance_from(vi, t, a));
+		return failed;
+	}
+
+	// if time is the first incognita...
+	template <class V>
+	static unsigned time_initial_velocity(V &v)
+	{
+		const T d = v.distance(), vf = v.final_velocity(), a = v.acceleration();
+		const T temp = vf * vf - T(2) * (a * d); // vi^2 = vf^2 - 2ad
+		unsigned failed = check(temp < 0, FormulaV4Check::negative_discriminant);
+		const T vi = sqrt_(temp);
+		const T t = time_from(d, vi, vf, a, failed);
+		put(v.initial_velocity(), failed, vi);
+		put(v.time(), failed, t);
+		return failed;
+	}
+
+	template <class V>
+	static unsigned time_final_velocity(V &v)
+	{
+		const T d = v.distance(), vi = v.initial_velocity(), a = v.acceleration();
+		const T temp = vi * vi + T(2) * (a * d);
+		unsigned failed = check(temp < 0, FormulaV4Check::negative_discriminant);
+		const T vf = sqrt_(temp);
+		const T t = time_from(d, vi, vf, a, failed);
+		put(v.final_velocity(), failed, vf);
+		put(v.time(), failed, t);
+		return failed;
+	}
 
+	template <class V>
+	static unsigned time_acceleration(V &v)
+	{
+		const T d = v.distance(), vi = v.initial_velocity(), vf = v.final_velocity();
+		unsigned failed = check(d == 0.0, FormulaV4Check::zero_distance);
+		const T a = (vf * vf - vi * vi) / (T(2) * d);
+		const T t = time_from(d, vi, vf, a, failed);
+		put(v.acceleration(), failed, a);
+		put(v.time(), failed, t);
+		return failed;
+	}
+
+	// both initial_velocity is the first incognita...
+	template <class V>
+	static unsigned initial_velocity_final_velocity(V &v)
+	{
+		const T d = v.distance(), t = v.time(), a = v.acceleration();
+		const unsigned failed = check(t == 0.0, FormulaV4Check::zero_time);
+		const T vi = (d / t) - T(0.5) * a * t;
+		put(v.initial_velocity(), failed, vi);
+		put(v.final_velocity(), failed, vi + a * t);
+		return failed;
+	}
+
+	template <class V>
+	static unsigned initial_velocity_acceleration(V &v)
+	{
+		const T d = v.distance(), t = v.time(), vf = v.final_velocity();
+		const T vi = (T(2) * d) / t - vf;
+		const unsigned failed = check(t == 0.0, FormulaV4Check::zero_time) |
+			check(vi < 0, FormulaV4Check::negative_velocity);
+		put(v.initial_velocity(), failed, vi);
+		put(v.acceleration(), failed, (vf - vi) / t);
+		return failed;
+	}
+
+	// last case is final_velocity and acceleration...
+	template <class V>
+	static unsigned final_velocity_acceleration(V &v)
+	{
+		const T d = v.distance(), t = v.time(), vi = v.initial_velocity();
+		const T vf = (T(2) * d) / t - vi;
+		const unsigned failed = check(t == 0.0, FormulaV4Check::zero_time) |
+			check(vf < 0, FormulaV4Check::negative_velocity);
+		put(v.final_velocity(), failed, vf);
+		put(v.acceleration(), failed, (vf - vi) / t);
+		return failed;
+	}
+
+	// hands every (unknown, unknown, formula) triple to add, so each table lists the pairs once
+	template <class V, class Add>
+	static constexpr void for_each_formula(Add add)
+	{
+		add(ValueId::distance, ValueId::time, &distance_time<V>);
+		add(ValueId::distance, ValueId::initial_velocity, &distance_initial_velocity<V>);
+		add(ValueId::distance, ValueId::final_velocity, &distance_final_velocity<V>);
+		add(ValueId::distance, ValueId::acceleration, &distance_acceleration<V>);
+		add(ValueId::time, ValueId::initial_velocity, &time_initial_velocity<V>);
+		add(ValueId::time, ValueId::final_velocity, &time_final_velocity<V>);
+		add(ValueId::time, ValueId::acceleration, &time_acceleration<V>);
+		add(ValueId::initial_velocity, ValueId::final_velocity, &initial_velocity_final_velocity<V>);
+		add(ValueId::initial_velocity, ValueId::acceleration, &initial_velocity_acceleration<V>);
+		add(ValueId::final_velocity, ValueId::acceleration, &final_velocity_acceleration<V>);
+	}
+
+	// the bitmask of two blanks is a perfect hash of the pair, so the formulas live in
+	// a table built at compile time and shared by every instance
+	template <class V>
+	static constexpr Formulas<V> init_formulas()
+	{
+		Formulas<V> formulas = {};
+		for_each_formula<V>([&](ValueId first, ValueId second, unsigned (*formula)(V&))
+		{
+			formulas[as_bit(first) | as_bit(second)] = formula;
+		});
 		return formulas;
 	}
+
+	template <class V>
+	static unsigned (*formula(unsigned key))(V&)
+	{
+		static constexpr Formulas<V> formulas = init_formulas<V>();
+		return formulas[key];
+	}
 };
+
+typedef FormulaV4aColumnsT<double> FormulaV4aColumns;
+typedef FormulaV4aT<double> FormulaV4a;
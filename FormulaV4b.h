@@ -1,11 +1,13 @@
 // FormulaV4a.h
 //
+#pragma once
 #include <array>
 #include <bitset>
-#include <functional>
+#include <cmath>
 #include <stdexcept>
 #include <string>
-#include <map>
+#include "FormulaV4Metrics.h"
+#include "FormulaV4Status.h"
 
 struct FormulaV4bException : std::runtime_error
 {
@@ -15,38 +17,66 @@ struct FormulaV4bException : std::runtime_error
 	}
 };
 
-class FormulaV4b
+// FormulaV4bT<T> works in scalar type T: float, double (FormulaV4b) or
+// FormulaV4DoubleDouble, like FormulaV4aT
+template <class T>
+class FormulaV4bT
 {
 public:
 	// equation variables, count is the number of variables
 	enum struct tag : unsigned {distance, time, initial_velocity, final_velocity, acceleration, count };
 
-	FormulaV4b()
-		: _functions(create_function_map(this))
+	// eager: calculate() turns the unknowns into knowns, as it always has
+	// lazy: solved values stay derived from the values passed to set(); changing one of
+	// those makes them stale, and get() re-solves the pair the next time one is read
+	enum struct mode { eager, lazy };
+
+	explicit FormulaV4bT(mode const m = mode::eager) : _stale(false), _lazy(m == mode::lazy)
 	{
 	}
 
 	// calculate for two unknowns
 	void calculate()
+	{
+		const FormulaV4Status status = solve();
+		if (status != FormulaV4Status::ok)
+			throw FormulaV4bException(status_message(status));
+	}
+
+	// calculate without exceptions, reporting what went wrong as a status
+	FormulaV4Status solve() noexcept
 	{
 		// Find the right equation given the missing values (getUnknownsKey)
-		auto const function_it(_functions.find(getUnknownsKey()));
-		if (function_it == _functions.end())
-			throw FormulaV4bException("Unrecognized combination of unknowns");
-		// Compute the missing values
-		function_it->second();
+		// and compute them; unsupported keys have no compute function.
+		// Derived values from an earlier solve are unknowns again.
+		const uint64_t start = FormulaV4Metrics::start();
+		const unsigned key = getUnknownsKey();
+		_presence &= presence_sequence(~key);
+		_derived.reset();
+		_stale = false;
+		const compute_function compute = function(key);
+		const FormulaV4Status status = compute ? check_status((this->*compute)()) : unknowns_status(key);
+		if (_lazy && status == FormulaV4Status::ok)
+			_derived = presence_sequence(key);
+		FormulaV4Metrics::record(key, status, start);
+		return status;
 	}
 
 	// reset bits to false = no eqn vars have been set
 	void reset()
 	{
 		_presence.reset();
+		_derived.reset();
+		_stale = false;
 	}
 
-	void set(tag const t, double const v)
+	void set(tag const t, T const v)
 	{
-		_values[as_underlying(t)] = v;
-		_presence[as_underlying(t)] = true;
+		// setting a value the solve already used does not make the derived values stale
+		if (_derived.any() && (_derived[as_underlying(t)] || _values[as_underlying(t)] != v))
+			_stale = true;
+		assign(t, v);
+		_derived[as_underlying(t)] = false;
 	}
 
 	bool has(tag const t) const
@@ -54,152 +84,245 @@ public:
 		return _presence[as_underlying(t)];
 	}
 
-	double get(tag const t) const
+	// in lazy mode, a stale derived value is re-solved first, and a failed re-solve throws
+	T get(tag const t) const
 	{
-		return has(t) ? _values[as_underlying(t)] : throw FormulaV4bException();
+		if (_stale && _derived[as_underlying(t)])
+			refresh();
+		return value(t);
 	}
 
-	// returns state of unset vars using enums as bit positions
+	// true for values calculate() filled in, in lazy mode
+	bool derived(tag const t) const
+	{
+		return _derived[as_underlying(t)];
+	}
+
+	// returns state of unset vars using enums as bit positions; derived values count as unset
 	unsigned getUnknownsKey() const
 	{
 		// ~ because bits are on for vars that have been set (for example, "01011"), so 
 		// we need to bitwise not to reverse them (~"01011" = "10100", so distance and
 		// initial_velocity are unset) 
 		// & part masks off unused positions
-		return ~static_cast<unsigned>(_presence.to_ulong()) & (as_bit(tag::count) - 1);
+		return ~static_cast<unsigned>((_presence & ~_derived).to_ulong()) & (as_bit(tag::count) - 1);
 	}
 
 private:
-	typedef std::array<double, static_cast<unsigned>(tag::count)> value_sequence;
+	typedef std::array<T, static_cast<unsigned>(tag::count)> value_sequence;
 	typedef std::bitset<static_cast<unsigned>(tag::count)> presence_sequence;
-	typedef std::map<unsigned, std::function<void()>> function_map;
+	typedef unsigned (FormulaV4bT::*compute_function)();		// returns the FormulaV4Check bits that failed
+	typedef std::array<compute_function, 1 << static_cast<unsigned>(tag::count)> function_map;
 
 	// enum element as unsigned 
-	static unsigned as_underlying(tag const t) { return static_cast<unsigned>(t); }
+	static constexpr unsigned as_underlying(tag const t) { return static_cast<unsigned>(t); }
 	// bit value as unsigned
-	static unsigned as_bit       (tag const t) { return 1 << as_underlying(t);    }
+	static constexpr unsigned as_bit       (tag const t) { return 1 << as_underlying(t);    }
 
-	// loads up our map of unknowns -> compute function that solves for unknowns
-static function_map create_function_map(FormulaV4b* p)
+	// builds the table of unknowns -> compute function that solves for unknowns;
+	// it holds member pointers rather than bound functions, so one table serves
+	// every instance and copies of an object stay independent
+static constexpr function_map create_function_map()
 {
 	// note that the compute functions could be made lamdas
 	// left this way, it is easy to see what is going on
-	function_map f;
-	f[as_bit(tag::distance) | as_bit(tag::time)] = std::bind(&FormulaV4b::compute_distance_time, p);
-	f[as_bit(tag::distance) | as_bit(tag::initial_velocity)] = std::bind(&FormulaV4b::compute_distance_initial_velocity, p);
-	f[as_bit(tag::distance) | as_bit(tag::final_velocity)] = std::bind(&FormulaV4b::compute_distance_final_velocity, p);
-	f[as_bit(tag::distance) | as_bit(tag::acceleration)] = std::bind(&FormulaV4b::compute_distance_acceleration, p);
+	function_map f = {};
+	f[as_bit(tag::distance) | as_bit(tag::time)] = &FormulaV4bT::compute_distance_time;
+	f[as_bit(tag::distance) | as_bit(tag::initial_velocity)] = &FormulaV4bT::compute_distance_initial_velocity;
+	f[as_bit(tag::distance) | as_bit(tag::final_velocity)] = &FormulaV4bT::compute_distance_final_velocity;
+	f[as_bit(tag::distance) | as_bit(tag::acceleration)] = &FormulaV4bT::compute_distance_acceleration;
 
-	f[as_bit(tag::time) | as_bit(tag::initial_velocity)] = std::bind(&FormulaV4b::compute_time_initial_velocity, p);
-	f[as_bit(tag::time) | as_bit(tag::final_velocity)] = std::bind(&FormulaV4b::compute_time_final_velocity, p);
-	f[as_bit(tag::time) | as_bit(tag::acceleration)] = std::bind(&FormulaV4b::compute_time_acceleration, p);
+	f[as_bit(tag::time) | as_bit(tag::initial_velocity)] = &FormulaV4bT::compute_time_initial_velocity;
+	f[as_bit(tag::time) | as_bit(tag::final_velocity)] = &FormulaV4bT::compute_time_final_velocity;
+	f[as_bit(tag::time) | as_bit(tag::acceleration)] = &FormulaV4bT::compute_time_acceleration;
 
-	f[as_bit(tag::initial_velocity) | as_bit(tag::final_velocity)] = std::bind(&FormulaV4b::compute_initial_velocity_final_velocity, p);
-	f[as_bit(tag::initial_velocity) | as_bit(tag::acceleration)] = std::bind(&FormulaV4b::compute_initial_velocity_acceleration, p);
+	f[as_bit(tag::initial_velocity) | as_bit(tag::final_velocity)] = &FormulaV4bT::compute_initial_velocity_final_velocity;
+	f[as_bit(tag::initial_velocity) | as_bit(tag::acceleration)] = &FormulaV4bT::compute_initial_velocity_acceleration;
 
-	f[as_bit(tag::final_velocity) | as_bit(tag::acceleration)] = std::bind(&FormulaV4b::compute_final_velocity_acceleration, p);
+	f[as_bit(tag::final_velocity) | as_bit(tag::acceleration)] = &FormulaV4bT::compute_final_velocity_acceleration;
 	return f;
 }
 
+	// compute function for a key from getUnknownsKey(), built at compile time
+	static compute_function function(unsigned const key)
+	{
+		static constexpr function_map functions = create_function_map();
+		return functions[key];
+	}
+
+	// re-solve stale derived values; they are a cache of the set() values, hence mutable
+	void refresh() const
+	{
+		const FormulaV4Status status = const_cast<FormulaV4bT*>(this)->solve();
+		if (status != FormulaV4Status::ok)
+			throw FormulaV4bException(status_message(status));
+	}
+
+	// value and assign are get and set without staleness tracking, for get() and the compute
+	// functions, which only write the unknowns
+	T value(tag const t) const
+	{
+		return has(t) ? _values[as_underlying(t)] : throw FormulaV4bException();
+	}
+
+	void assign(tag const t, T const v)
+	{
+		_values[as_underlying(t)] = v;
+		_presence[as_underlying(t)] = true;
+	}
+
+	// known and assign_if are value and assign without a branch: known reads a value the key
+	// says is there, and assign_if writes an unknown only if no check failed
+	T known(tag const t) const
+	{
+		return _values[as_underlying(t)];
+	}
+
+	void assign_if(unsigned const failed, tag const t, T const v)
+	{
+		_values[as_underlying(t)] = failed ? _values[as_underlying(t)] : v;
+		_presence[as_underlying(t)] = _presence[as_underlying(t)] || !failed;
+	}
+
+	static unsigned check(bool const failed, unsigned const bit)
+	{
+		return FormulaV4Check::check(failed, bit);
+	}
+
+	static T sqrt_(T const x)
+	{
+		using std::sqrt;
+		return sqrt(x);		// FormulaV4DoubleDouble's is found by argument-dependent lookup
+	}
+
 	// compute helper functions
-	double get_distance_using_time_initvel_acc() const 
+	static T distance_using_time_initvel_acc(T const t, T const vi, T const a)
 	{
 		// distance = initial_velocity * time + 0.5 * (acceleration * time^2)
-		return get(tag::initial_velocity) * get(tag::time) + (0.5 * get(tag::acceleration)) * pow(get(tag::time), 2);
+		return vi * t + (T(0.5) * a) * (t * t);
 	}
 
-	double get_time_using_vel_acc_or_dist() const
+	static T time_using_vel_acc_or_dist(T const d, T const vi, T const vf, T const a,
+		unsigned &failed)
 	{
-		// if we have acceleration, compute time with it as denominator
-		if (get(tag::acceleration) != 0)
-			return (get(tag::final_velocity) - get(tag::initial_velocity)) / get(tag::acceleration);
-		if (get(tag::final_velocity) != 0)
-			return get(tag::distance) / get(tag::final_velocity);
-		throw FormulaV4bException("Acceleration and final velocity cannot both be zero");
+		// with acceleration, time has it as denominator, else final velocity;
+		// both are computed and one is kept
+		failed |= check(a == 0 && vf == 0, FormulaV4Check::zero_final_velocity);	// cannot both be zero
+		const T by_acceleration = (vf - vi) / a;
+		const T by_distance = d / vf;
+		return a != 0 ? by_acceleration : by_distance;
 	}
 
 	// compute functions
-	void compute_distance_time() 
-	{ 
-		if (get(tag::acceleration) == 0)
-			throw FormulaV4bException("Accleration cannot be zero when distance and time are unknowns");
-		set(tag::time, (get(tag::final_velocity) - get(tag::initial_velocity)) / get(tag::acceleration));
-		set(tag::distance, get_distance_using_time_initvel_acc());
+	unsigned compute_distance_time()
+	{
+		const T vi = known(tag::initial_velocity), vf = known(tag::final_velocity), a = known(tag::acceleration);
+		const unsigned failed = check(a == 0, FormulaV4Check::zero_acceleration);
+		const T t = (vf - vi) / a;
+		assign_if(failed, tag::time, t);
+		assign_if(failed, tag::distance, distance_using_time_initvel_acc(t, vi, a));
+		return failed;
 	}
 
-	void compute_distance_initial_velocity() 
-	{ 
-		set(tag::initial_velocity, get(tag::final_velocity) - get(tag::acceleration) * get(tag::time));
-		set(tag::distance, get_distance_using_time_initvel_acc());
+	unsigned compute_distance_initial_velocity()
+	{
+		const T t = known(tag::time), vf = known(tag::final_velocity), a = known(tag::acceleration);
+		const T vi = vf - a * t;
+		assign(tag::initial_velocity, vi);
+		assign(tag::distance, distance_using_time_initvel_acc(t, vi, a));
+		return 0;
 	}
 
-	void compute_distance_final_velocity() 
-	{ 
-		set(tag::final_velocity, get(tag::initial_velocity) + get(tag::acceleration) * get(tag::time));
-		set(tag::distance, get_distance_using_time_initvel_acc());
+	unsigned compute_distance_final_velocity()
+	{
+		const T t = known(tag::time), vi = known(tag::initial_velocity), a = known(tag::acceleration);
+		assign(tag::final_velocity, vi + a * t);
+		assign(tag::distance, distance_using_time_initvel_acc(t, vi, a));
+		return 0;
 	}
 
-	void compute_distance_acceleration() 
-	{ 
-		if (get(tag::time) == 0)
-			throw FormulaV4bException("Time cannot be zero when distance and acceleration are unknown");
-		set(tag::time, (get(tag::final_velocity) - get(tag::initial_velocity)) / get(tag::time));
-		set(tag::distance, get_distance_using_time_initvel_acc());
+	unsigned compute_distance_acceleration()
+	{
+		const T t = known(tag::time), vi = known(tag::initial_velocity), vf = known(tag::final_velocity);
+		const unsigned failed = check(t == 0, FormulaV4Check::zero_time);
+		const T a = (vf - vi) / t;
+		assign_if(failed, tag::acceleration, a);
+		assign_if(failed, tag::distance, distance_using_time_initvel_acc(t, vi, a));
+		return failed;
 	}
 
-	void compute_time_initial_velocity() 
+	unsigned compute_time_initial_velocity()
 	{
-		const double val = get(tag::final_velocity) - 2 * (get(tag::acceleration) * get(tag::distance));
-		if (val < 0)
-			throw FormulaV4aException("Inputs do not result in a valid solution for initial velocity");
-		set(tag::initial_velocity, sqrt(val));
-		set(tag::time, get_time_using_vel_acc_or_dist());
+		// vi^2 = vf^2 - 2ad
+		const T d = known(tag::distance), vf = known(tag::final_velocity), a = known(tag::acceleration);
+		const T val = vf * vf - T(2) * (a * d);
+		unsigned failed = check(val < 0, FormulaV4Check::negative_discriminant);
+		const T vi = sqrt_(val);
+		const T t = time_using_vel_acc_or_dist(d, vi, vf, a, failed);
+		assign_if(failed, tag::initial_velocity, vi);
+		assign_if(failed, tag::time, t);
+		return failed;
 	}
 
-	void compute_time_final_velocity() 
-	{ 
-		const double val = get(tag::final_velocity) + 2 * (get(tag::acceleration) * get(tag::distance));
-		if (val < 0)
-			throw FormulaV4aException("Inputs do not result in a valid solution for final velocity");
-		set(tag::initial_velocity, sqrt(val));
-		set(tag::time, get_time_using_vel_acc_or_dist());
+	unsigned compute_time_final_velocity()
+	{
+		// vf^2 = vi^2 + 2ad
+		const T d = known(tag::distance), vi = known(tag::initial_velocity), a = known(tag::acceleration);
+		const T val = vi * vi + T(2) * (a * d);
+		unsigned failed = check(val < 0, FormulaV4Check::negative_discriminant);
+		const T vf = sqrt_(val);
+		const T t = time_using_vel_acc_or_dist(d, vi, vf, a, failed);
+		assign_if(failed, tag::final_velocity, vf);
+		assign_if(failed, tag::time, t);
+		return failed;
 	}
 
-	void compute_time_acceleration() 
-	{ 
-		set(tag::acceleration, (pow(get(tag::final_velocity),2) - pow(get(tag::initial_velocity),2)) / (2 * get(tag::distance)));
-		set(tag::time, get_time_using_vel_acc_or_dist());
+	unsigned compute_time_acceleration()
+	{
+		const T d = known(tag::distance), vi = known(tag::initial_velocity), vf = known(tag::final_velocity);
+		const T a = (vf * vf - vi * vi) / (T(2) * d);
+		unsigned failed = 0;
+		const T t = time_using_vel_acc_or_dist(d, vi, vf, a, failed);
+		assign_if(failed, tag::acceleration, a);
+		assign_if(failed, tag::time, t);
+		return failed;
 	}
 
-	void compute_initial_velocity_final_velocity()
+	unsigned compute_initial_velocity_final_velocity()
 	{
-		if (get(tag::time) == 0)
-			throw FormulaV4bException("Time cannot be zero when initial velocity and final velocity are unknown");
-		set(tag::initial_velocity, (get(tag::distance) / get(tag::time)) - 0.5 * get(tag::acceleration) * get(tag::time));
-		set(tag::final_velocity, get(tag::initial_velocity) + get(tag::acceleration) * get(tag::time));
+		const T d = known(tag::distance), t = known(tag::time), a = known(tag::acceleration);
+		const unsigned failed = check(t == 0, FormulaV4Check::zero_time);
+		const T vi = (d / t) - T(0.5) * a * t;
+		assign_if(failed, tag::initial_velocity, vi);
+		assign_if(failed, tag::final_velocity, vi + a * t);
+		return failed;
 	}
 
-	void compute_initial_velocity_acceleration()
+	unsigned compute_initial_velocity_acceleration()
 	{
-		if (get(tag::time) == 0)
-			throw FormulaV4bException("Time cannot be zero when initial velocity and acceleration are unknown");
-		set(tag::initial_velocity, (2 * get(tag::distance)) / get(tag::time) - get(tag::final_velocity));
-		if (get(tag::initial_velocity) == 0)
-			throw FormulaV4aException("Inputs do not result in a valid solution for acceleration");
-		set(tag::acceleration, (get(tag::final_velocity) - get(tag::initial_velocity)) / get(tag::time));
+		const T d = known(tag::distance), t = known(tag::time), vf = known(tag::final_velocity);
+		const T vi = (T(2) * d) / t - vf;
+		const unsigned failed = check(t == 0, FormulaV4Check::zero_time) | check(vi == 0, FormulaV4Check::negative_velocity);
+		assign_if(failed, tag::initial_velocity, vi);
+		assign_if(failed, tag::acceleration, (vf - vi) / t);
+		return failed;
 	}
 
-	void compute_final_velocity_acceleration()
+	unsigned compute_final_velocity_acceleration()
 	{
-		if (get(tag::time) == 0)
-			throw FormulaV4bException("Time cannot be zero when final velocity and acceleration are unknown");
-		set(tag::final_velocity, (2 * get(tag::distance)) / get(tag::time) - get(tag::initial_velocity));
-		if (get(tag::final_velocity) == 0)
-			throw FormulaV4aException("Inputs do not result in a valid solution for acceleration");
-		set(tag::acceleration, (get(tag::final_velocity) - get(tag::initial_velocity)) / get(tag::time));
+		const T d = known(tag::distance), t = known(tag::time), vi = known(tag::initial_velocity);
+		const T vf = (T(2) * d) / t - vi;
+		const unsigned failed = check(t == 0, FormulaV4Check::zero_time) | check(vf == 0, FormulaV4Check::negative_velocity);
+		assign_if(failed, tag::final_velocity, vf);
+		assign_if(failed, tag::acceleration, (vf - vi) / t);
+		return failed;
 	}
 
-	value_sequence    _values;		// equation variable values
-	presence_sequence _presence;	// equation variable set/not set flags
-	function_map      _functions;	// map of unknowns -> compute function
+	mutable value_sequence    _values;		// equation variable values
+	mutable presence_sequence _presence;	// equation variable set/not set flags
+	mutable presence_sequence _derived;		// set by a lazy solve rather than by set()
+	mutable bool _stale;					// a set() value changed since the derived values were solved
+	bool _lazy;
 };
+
+typedef FormulaV4bT<double> FormulaV4b;
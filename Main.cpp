@@ -1,13 +1,77 @@
 // File: main.cpp
 //
+// Streams CSV/TSV problems through the V4 engine:
+//   main [-d delimiter] [-j threads] [-o output] [input]
+// reads input (default stdin), one problem per line as distance, time,
+// initial velocity, final velocity, acceleration with the two unknowns left
+// blank, and writes each row back solved, with a status column. Reading,
+// parsing, solving and writing run as the pipeline of FormulaV4Pipeline.h,
+// with -j solve threads and --parse-threads and --write-threads for the
+// other stages. Throughput and the utilization of each stage are reported
+// on stderr. "main --demo" prints the original worked examples.
+//
+// The same problems can be kept in the binary column format of FormulaV4File.h:
+//   main --to-binary [-d delimiter] -o file.fv4 [input]    convert CSV
+//   main --binary [-j threads] [-o output.fv4] file.fv4    solve, in place without -o
+//   main --to-csv [-o output] file.fv4                     convert back, with statuses
+//
+// and a sweep solves every combination of three known values, e.g.
+//   main --sweep acceleration=0.1:10:0.001 time=1:100:1 initial_velocity=0 [-o output]
+// with distance and final velocity as the unknowns; a range is first:last:step, counting
+// down when step is negative.
+//
+// In a build with FORMULAV4_METRICS=1, --metrics file writes the solve
+// counters and latency histograms at exit: JSON when file ends in .json,
+// Prometheus text otherwise. In a build with FORMULAV4_TRACE=1, --trace file
+// writes the read/parse/solve/validate/format/write spans of every thread
+// as Chrome trace JSON.
+//
+// "main --serve unix:/path/to/socket" (or tcp:port, loopback only) runs
+// the local solver service of FormulaV4Server.h until SIGINT or SIGTERM;
+// --batch rows and --budget microseconds set its micro-batching.
+//
+// "main --ring /name [--slots n] [-j threads]" creates the shared-memory
+// ring of FormulaV4Ring.h and solves what producers put in it until
+// SIGINT or SIGTERM.
+//
+// "main --shards n [--retries n] [--no-merge] -o output input" splits a
+// CSV or column file input on row boundaries into n shards solved by n
+// worker processes (FormulaV4Shard.h), sharing -j threads between them, and
+// concatenates their outputs into output in row order. A shard that keeps
+// failing is left for the next run of the same command, which solves only
+// what is not done; --no-merge leaves the shards and output.manifest instead.
+//
+// --huge-pages backs the batch columns of the CSV, --to-binary and --sweep
+// modes with 2 MB pages, reserved ones if the system has them and
+// transparent huge pages otherwise.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
 #include "FormulaV1.h"
 #include "FormulaV2.h"
 #include "FormulaV3.h"
 #include "FormulaV4a.h"
 #include "FormulaV4b.h"
+#include "FormulaV4Csv.h"
+#include "FormulaV4File.h"
+#include "FormulaV4Metrics.h"
+#include "FormulaV4Parallel.h"
+#include "FormulaV4Pipeline.h"
+#include "FormulaV4Ring.h"
+#include "FormulaV4Server.h"
+#include "FormulaV4Shard.h"
+#include "FormulaV4Sweep.h"
+#include "FormulaV4Trace.h"
 
-int main(int argc, char **argv)
+// one worked example per formula version
+static int demo()
 {
 	FormulaV1 formulaV1;
 	formulaV1.setA(23.33); 
@@ -46,4 +110,482 @@ int main(int argc, char **argv)
 	std::cout << "v4b   => acc=" << formulaV4b.get(tv4b::acceleration) << ", dist=" << formulaV4b.get(tv4b::distance) << ", vinitial=" << formulaV4b.get(tv4b::initial_velocity) << ", vfinal=" << formulaV4b.get(tv4b::final_velocity) << ", time="<< formulaV4b.get(tv4b::time) << ", " << std::endl;
 
 	return 0;
-}
\ No newline at end of file
+}
+
+// solve everything from in and write it to out; returns false if out could not be written
+static bool stream(FILE *in, FILE *out, FormulaV4Pipeline::Options options, FormulaV4Arena &arena)
+{
+	FormulaV4Pipeline pipeline(options, &arena);
+	const bool written = pipeline.run(in, out);
+
+	const double seconds = pipeline.seconds();
+	std::fprintf(stderr, "%zu rows, %zu bytes in, %zu bytes out in %.3f s: %.0f rows/s, %.1f MB/s in, %.1f MB/s out\n",
+		pipeline.rows(), pipeline.bytes_in(), pipeline.bytes_out(), seconds, pipeline.rows() / seconds,
+		pipeline.bytes_in() / seconds / 1e6, pipeline.bytes_out() / seconds / 1e6);
+	std::fprintf(stderr, "stage utilization: %s\n", pipeline.summary().c_str());
+	return written;
+}
+
+// solve a column file through its mapping, in place or in a copy at output
+static void solve_binary(const char *input, const char *output, unsigned threads)
+{
+	const auto start = std::chrono::steady_clock::now();
+	if (output)
+	{
+		FormulaV4TraceSpan span("copy");
+		FormulaV4File::copy(input, output);
+	}
+	FormulaV4ThreadPool pool(threads);
+	FormulaV4File file(output ? output : input, FormulaV4File::Mode::update);
+	for (size_t g = 0; g < file.groups(); ++g)
+	{
+		file.solve_group(g, [&](FormulaV4aColumns &columns) { FormulaV4Parallel::solve(columns, pool); });
+	}
+	{
+		FormulaV4TraceSpan span("sync");
+		file.sync();
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const double bytes = static_cast<double>(file.header().file_bytes());
+	std::fprintf(stderr, "%zu rows, %.0f bytes in %.3f s: %.0f rows/s, %.1f MB/s\n",
+		file.rows(), bytes, seconds, file.rows() / seconds, bytes / seconds / 1e6);
+}
+
+// CSV rows to a column file; statuses are ok, or invalid_row for lines that did not parse
+static void csv_to_binary(FILE *in, const char *output, char delimiter, FormulaV4Arena &arena)
+{
+	FormulaV4Batch batch(FormulaV4FileWriter::GROUP_ROWS, &arena);
+	FormulaV4CsvReader reader(in, delimiter);
+	FormulaV4FileWriter writer(output);
+	while (reader.read(batch) != 0)
+	{
+		std::fill(batch.status.begin(), batch.status.begin() + batch.rows, FormulaV4Status::ok);
+		reader.mark_invalid(batch);
+		writer.write(batch.view());
+	}
+	writer.finish();
+	std::fprintf(stderr, "%zu rows\n", writer.rows());
+}
+
+// a column file back to CSV with a header; returns false if out could not be written
+static bool binary_to_csv(const char *input, FILE *out)
+{
+	FormulaV4File file(input, FormulaV4File::Mode::read);
+	FormulaV4CsvWriter writer(out, ',');
+	writer.write_header("distance,time,initial_velocity,final_velocity,acceleration");
+	for (size_t g = 0; g < file.groups(); ++g)
+	{
+		writer.write(file.group(g));
+	}
+	writer.flush();
+	std::fprintf(stderr, "%zu rows\n", file.rows());
+	return !writer.failed();
+}
+
+// name=first:last:step or name=value, added to sweep; false if arg is not one, or if the
+// range is not valid() (non-finite, a zero step between different values, or a step away from last)
+static bool parse_sweep(const char *arg, FormulaV4Sweep &sweep)
+{
+	static const char *names[] = { "distance", "time", "initial_velocity", "final_velocity", "acceleration" };
+	const char *equals = std::strchr(arg, '=');
+	if (!equals)
+	{
+		return false;
+	}
+	for (int id = 0; id < VARIABLES; ++id)
+	{
+		if (std::strncmp(arg, names[id], equals - arg) == 0 && names[id][equals - arg] == '\0')
+		{
+			FormulaV4SweepRange range = { 0, 0, 0 };
+			char *end;
+			range.first = range.last = std::strtod(equals + 1, &end);
+			if (*end == ':')
+			{
+				range.last = std::strtod(end + 1, &end);
+				range.step = *end == ':' ? std::strtod(end + 1, &end) : 1;
+			}
+			if (*end != '\0' || end == equals + 1 || !range.valid())
+			{
+				return false;
+			}
+			sweep.vary(static_cast<ValueId>(id), range);
+			return true;
+		}
+	}
+	return false;
+}
+
+// stream every solved point of a sweep to out as CSV; returns false if out could not be written
+static bool run_sweep(FormulaV4Sweep &sweep, FILE *out, unsigned threads, FormulaV4Arena &arena)
+{
+	const auto start = std::chrono::steady_clock::now();
+	FormulaV4ThreadPool pool(threads);
+	FormulaV4CsvWriter writer(out, ',');
+	writer.write_header("distance,time,initial_velocity,final_velocity,acceleration");
+	sweep.run([&](const FormulaV4aColumns &chunk, size_t) { writer.write(chunk); }, pool, FormulaV4Sweep::CHUNK_ROWS, &arena);
+	writer.flush();
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::fprintf(stderr, "%zu points in %.3f s: %.0f points/s, %.1f MB/s out\n", sweep.size(), seconds,
+		sweep.size() / seconds, writer.bytes() / seconds / 1e6);
+	return !writer.failed();
+}
+
+// solve input in shards by worker processes; false if a shard failed
+static bool run_shards(const char *input, const char *output, FormulaV4Shards::Options options)
+{
+	FormulaV4Shards job(input, output, options);
+	const bool solved = job.run();
+	size_t reused = 0;
+	for (const auto &shard : job.shards())
+	{
+		reused += shard.reused;
+	}
+	std::fprintf(stderr, "%zu rows in %zu shards (%zu done by an earlier run) in %.3f s: %.0f rows/s\n", job.rows(),
+		job.shards().size(), reused, job.seconds(), job.rows() / job.seconds());
+	if (solved && !options.merge)
+	{
+		std::fprintf(stderr, "shards listed in %s\n", job.manifest().c_str());
+	}
+	return solved;
+}
+
+static FormulaV4Server *serving = nullptr;
+
+static void stop_serving(int)
+{
+	serving->stop();
+}
+
+// run the solver service on address until SIGINT or SIGTERM
+static void serve(const char *address, FormulaV4Server::Options options)
+{
+	FormulaV4Server server(address, options);
+	serving = &server;
+	std::signal(SIGINT, stop_serving);
+	std::signal(SIGTERM, stop_serving);
+	std::signal(SIGPIPE, SIG_IGN);
+	std::fprintf(stderr, "serving on %s: batches of %zu rows, %u us budget\n", address, options.batch_rows,
+		options.budget_us);
+	server.run();
+	std::signal(SIGINT, SIG_DFL);
+	std::signal(SIGTERM, SIG_DFL);
+	serving = nullptr;
+
+	const FormulaV4Server::Stats stats = server.stats();
+	std::fprintf(stderr, "%llu connections, %llu requests, %llu rows in %llu batches\n",
+		static_cast<unsigned long long>(stats.connections), static_cast<unsigned long long>(stats.requests),
+		static_cast<unsigned long long>(stats.rows), static_cast<unsigned long long>(stats.batches));
+}
+
+static std::atomic<bool> ring_stop(false);
+
+static void stop_ring(int)
+{
+	ring_stop.store(true);
+}
+
+// create the ring name and solve in it with threads solvers until SIGINT or SIGTERM
+static void serve_ring(const char *name, size_t slots, unsigned threads)
+{
+	threads = std::max(threads, 1u);
+	FormulaV4Ring ring(name, slots, FormulaV4Ring::Sharing::multiple,
+		threads > 1 ? FormulaV4Ring::Sharing::multiple : FormulaV4Ring::Sharing::single);
+	std::signal(SIGINT, stop_ring);
+	std::signal(SIGTERM, stop_ring);
+	std::fprintf(stderr, "solving in ring %s: %zu slots, %u solvers\n", name, ring.slots(), threads);
+	std::vector<std::thread> solvers;
+	for (unsigned t = 1; t < threads; ++t)
+	{
+		solvers.emplace_back([&] { ring.serve(ring_stop); });
+	}
+	ring.serve(ring_stop);
+	for (auto &solver : solvers)
+	{
+		solver.join();
+	}
+	std::signal(SIGINT, SIG_DFL);
+	std::signal(SIGTERM, SIG_DFL);
+}
+
+// dump the solve metrics to path, as JSON for a .json name and Prometheus text otherwise
+static bool write_metrics(const char *path)
+{
+	if (!FormulaV4Metrics::enabled)
+	{
+		std::fprintf(stderr, "main: built without FORMULAV4_METRICS, the metrics are empty\n");
+	}
+	const size_t length = std::strlen(path);
+	const bool json = length >= 5 && std::strcmp(path + length - 5, ".json") == 0;
+	const std::string text = json ? FormulaV4Metrics::json() + "\n" : FormulaV4Metrics::prometheus();
+	FILE *file = std::fopen(path, "wb");
+	if (!file)
+	{
+		std::fprintf(stderr, "main: cannot create %s\n", path);
+		return false;
+	}
+	const bool written = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+	return std::fclose(file) == 0 && written;
+}
+
+// write the spans recorded since FormulaV4Trace::enable() to path
+static bool write_trace(const char *path)
+{
+	if (!FormulaV4Trace::compiled)
+	{
+		std::fprintf(stderr, "main: built without FORMULAV4_TRACE, the trace is empty\n");
+	}
+	FILE *file = std::fopen(path, "wb");
+	if (!file)
+	{
+		std::fprintf(stderr, "main: cannot create %s\n", path);
+		return false;
+	}
+	const bool written = FormulaV4Trace::write(file);
+	return std::fclose(file) == 0 && written;
+}
+
+static int usage()
+{
+	std::fprintf(stderr, "usage: main [--demo] [-d ,|tab] [-j threads] [--parse-threads n] [--write-threads n]\n"
+		"            [-o output] [input]\n"
+		"       main --to-binary [-d ,|tab] -o output [input]\n"
+		"       main --binary [-j threads] [-o output] input\n"
+		"       main --to-csv [-o output] input\n"
+		"       main --sweep name=first:last:step name=... name=... [-j threads] [-o output]\n"
+		"       main --serve unix:path|tcp:port [--batch rows] [--budget us]\n"
+		"       main --ring /name [--slots n] [-j threads]\n"
+		"       main --shards n [--retries n] [--no-merge] [-d ,|tab] [-j threads] -o output input\n"
+		"every mode also takes --metrics file, --trace file and --huge-pages\n");
+	return 2;
+}
+
+int main(int argc, char **argv)
+{
+	const char *input = nullptr;
+	const char *output = nullptr;
+	const char *metrics = nullptr;
+	const char *trace = nullptr;
+	char delimiter = 0;
+	FormulaV4Arena::Pages pages = FormulaV4Arena::Pages::normal;
+	unsigned threads = FormulaV4ThreadPool::default_threads();
+	enum { csv, binary, to_binary, to_csv, sweep, service, ring, sharded } mode = csv;
+	size_t slots = FormulaV4Ring::SLOTS;
+	FormulaV4Shards::Options shard_options;
+	FormulaV4Pipeline::Options stages;
+	const char *address = nullptr;
+	FormulaV4Server::Options service_options;
+	FormulaV4Sweep ranges;
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *arg = argv[i];
+		if (std::strcmp(arg, "--demo") == 0)
+		{
+			return demo();
+		}
+		else if (std::strcmp(arg, "--binary") == 0)
+		{
+			mode = binary;
+		}
+		else if (std::strcmp(arg, "--to-binary") == 0)
+		{
+			mode = to_binary;
+		}
+		else if (std::strcmp(arg, "--to-csv") == 0)
+		{
+			mode = to_csv;
+		}
+		else if (std::strcmp(arg, "--sweep") == 0)
+		{
+			mode = sweep;
+		}
+		else if (std::strcmp(arg, "--serve") == 0 && i + 1 < argc)
+		{
+			mode = service;
+			address = argv[++i];
+		}
+		else if (std::strcmp(arg, "--ring") == 0 && i + 1 < argc)
+		{
+			mode = ring;
+			address = argv[++i];
+		}
+		else if (std::strcmp(arg, "--shards") == 0 && i + 1 < argc)
+		{
+			mode = sharded;
+			shard_options.shards = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (std::strcmp(arg, "--retries") == 0 && i + 1 < argc)
+		{
+			shard_options.retries = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (std::strcmp(arg, "--no-merge") == 0)
+		{
+			shard_options.merge = false;
+		}
+		else if (std::strcmp(arg, "--slots") == 0 && i + 1 < argc)
+		{
+			slots = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(arg, "--parse-threads") == 0 && i + 1 < argc)
+		{
+			stages.parse_threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (std::strcmp(arg, "--write-threads") == 0 && i + 1 < argc)
+		{
+			stages.write_threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (std::strcmp(arg, "--batch") == 0 && i + 1 < argc)
+		{
+			service_options.batch_rows = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(arg, "--budget") == 0 && i + 1 < argc)
+		{
+			service_options.budget_us = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (mode == sweep && arg[0] != '-')
+		{
+			if (!parse_sweep(arg, ranges))
+			{
+				return usage();
+			}
+		}
+		else if (std::strcmp(arg, "-d") == 0 && i + 1 < argc)
+		{
+			arg = argv[++i];
+			delimiter = std::strcmp(arg, "tab") == 0 || std::strcmp(arg, "\\t") == 0 ? '\t' : arg[0];
+		}
+		else if (std::strcmp(arg, "-j") == 0 && i + 1 < argc)
+		{
+			threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (std::strcmp(arg, "-o") == 0 && i + 1 < argc)
+		{
+			output = argv[++i];
+		}
+		else if (std::strcmp(arg, "--metrics") == 0 && i + 1 < argc)
+		{
+			metrics = argv[++i];
+		}
+		else if (std::strcmp(arg, "--trace") == 0 && i + 1 < argc)
+		{
+			trace = argv[++i];
+		}
+		else if (std::strcmp(arg, "--huge-pages") == 0)
+		{
+			pages = FormulaV4Arena::Pages::huge;
+		}
+		else if (arg[0] == '-' && arg[1] != '\0')
+		{
+			return usage();
+		}
+		else
+		{
+			input = std::strcmp(arg, "-") == 0 ? nullptr : arg;
+		}
+	}
+
+	if (((mode == binary || mode == to_csv || mode == sharded) && !input) ||
+		((mode == to_binary || mode == sharded) && !output) ||
+		(mode == sweep && unknowns_status(ranges.unknowns()) != FormulaV4Status::unsupported_pair))
+	{
+		return usage();
+	}
+
+	// the text side of each mode goes through stdio, the binary side through FormulaV4File
+	const bool text_in = mode == csv || mode == to_binary;
+	const bool text_out = mode == csv || mode == to_csv || mode == sweep;
+	FILE *in = text_in && input ? std::fopen(input, "rb") : stdin;
+	if (!in)
+	{
+		std::fprintf(stderr, "main: cannot open %s\n", input);
+		return 1;
+	}
+	FILE *out = text_out && output ? std::fopen(output, "wb") : stdout;
+	if (!out)
+	{
+		std::fprintf(stderr, "main: cannot create %s\n", output);
+		return 1;
+	}
+
+	FormulaV4Trace::enable(trace != nullptr);
+	FormulaV4Arena arena(FormulaV4Arena::BLOCK_BYTES, pages);
+	bool written = true;
+	try
+	{
+		switch (mode)
+		{
+		case csv:
+			stages.solve_threads = threads;
+			stages.delimiter = delimiter;
+			written = stream(in, out, stages, arena);
+			break;
+		case binary:
+			solve_binary(input, output, threads);
+			break;
+		case to_binary:
+			csv_to_binary(in, output, delimiter, arena);
+			break;
+		case to_csv:
+			written = binary_to_csv(input, out);
+			break;
+		case sweep:
+			written = run_sweep(ranges, out, threads, arena);
+			break;
+		case service:
+			serve(address, service_options);
+			break;
+		case ring:
+			serve_ring(address, slots, threads);
+			break;
+		case sharded:
+			shard_options.threads = std::max(threads / std::max(shard_options.shards, 1u), 1u);
+			shard_options.delimiter = delimiter;
+			shard_options.pages = pages;
+			if (!run_shards(input, output, shard_options))
+			{
+				return 1;		// the manifest keeps what is done for the next run
+			}
+			break;
+		}
+	}
+	catch (const FormulaV4WireException &e)
+	{
+		std::fprintf(stderr, "main: %s\n", e.message().c_str());
+		return 1;
+	}
+	catch (const FormulaV4FileException &e)
+	{
+		std::fprintf(stderr, "main: %s\n", e.message().c_str());
+		return 1;
+	}
+	catch (const FormulaV4aException &e)
+	{
+		std::fprintf(stderr, "main: %s\n", e.message().c_str());
+		return 1;
+	}
+	catch (const std::exception &e)
+	{
+		// out of memory, or threads, sockets or mappings the arena, pipeline, server and ring could not get
+		std::fprintf(stderr, "main: Error: %s\n", e.what());
+		return 1;
+	}
+	if (in != stdin)
+	{
+		std::fclose(in);
+	}
+	if (metrics && !write_metrics(metrics))
+	{
+		written = false;
+	}
+	if (trace && !write_trace(trace))
+	{
+		written = false;
+	}
+	if ((out != stdout && std::fclose(out) != 0) || !written)
+	{
+		std::fprintf(stderr, "main: error writing output\n");
+		return 1;
+	}
+	return 0;
+}